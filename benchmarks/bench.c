@@ -0,0 +1,309 @@
+/*
+ * this program measures the main operations of a threading library:
+ *   create_join     latency of creating a thread and joining it
+ *   yield_pingpong  round trip of two threads handing a token to each
+ *                   other with yield (two context switches)
+ *   spinlock        lock + unlock of one spinlock by 1..N threads
+ *   mutex           lock + unlock of one mutex by 1..N threads (not in
+ *                   many-many, which has no mutexes)
+ *   matrix          a parallel_for multiplication of two square matrices
+ * it is compiled with one of the libraries or with pthreads, so that the
+ * models can be compared side by side, build.sh builds all four:
+ * gcc -O2 -I../src/mythread_type_oneone bench.c ../src/mythread_type_oneone/mythread.c -o bench_oneone -lpthread -lrt -lm
+ * gcc -O2 -I../src/mythread_type_manyone bench.c ../src/mythread_type_manyone/mythread.c -o bench_manyone -lpthread -lrt -lm
+ * gcc -O2 -I../src/mythread_type_manymany bench.c ../src/mythread_type_manymany/mythread.c -o bench_manymany -lpthread -lrt -lm
+ * gcc -O2 -DBENCH_PTHREAD bench.c -o bench_pthread -lpthread -lrt -lm
+ * usage: bench [max threads] [benchmark]
+ * max threads (default 4) is the largest number of contenders, the lock
+ * benchmarks run with 1, 2, 4, ... up to it, and the number of parts of
+ * the matrix loop, if a benchmark name is given only that one runs
+ * every result is printed as one json object per line, with percentiles
+ * of the time of one operation in nanoseconds (taken over batches of
+ * operations) and the operations per second, so the output of all four
+ * programs can be concatenated and compared by a script
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+
+#ifdef BENCH_PTHREAD
+#include <pthread.h>
+#define IMPL "pthread"
+typedef pthread_t mythread_t;
+typedef pthread_spinlock_t mythread_spinlock_t;
+typedef pthread_mutex_t mythread_mutex_t;
+#define mythread_init()
+#define mythread_create(t, f, a) pthread_create(t, NULL, f, a)
+#define mythread_join pthread_join
+#define mythread_yield sched_yield
+#define mythread_spin_init(l) pthread_spin_init(l, PTHREAD_PROCESS_PRIVATE)
+#define mythread_spin_lock pthread_spin_lock
+#define mythread_spin_unlock pthread_spin_unlock
+#define mythread_mutex_init(m) pthread_mutex_init(m, NULL)
+#define mythread_mutex_lock pthread_mutex_lock
+#define mythread_mutex_unlock pthread_mutex_unlock
+#define HAVE_MUTEX
+#else
+#include "mythread.h"
+#if defined(MYTHREAD_ONE_ONE)
+#define IMPL "oneone"
+#define HAVE_MUTEX
+#elif defined(MYTHREAD_MANY_ONE)
+#define IMPL "manyone"
+#define HAVE_MUTEX
+#else
+#define IMPL "manymany"
+#endif
+#endif
+
+#define MAX_THREADS 64
+#define BATCH 64				//operations timed together as one sample
+#define CREATE_SAMPLES 2000
+#define PINGPONG_SAMPLES 2000
+#define LOCK_SAMPLES 500		//samples of every contending thread
+#define MATRIX_N 256
+#define MATRIX_SAMPLES 10
+
+static double *samples;
+static int nsamples;
+
+static inline long now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static int cmp_double(const void *a, const void *b) {
+	double x = *(const double *)a, y = *(const double *)b;
+	return x < y ? -1 : x > y;
+}
+
+static double percentile(double p) {
+	int i = (int)(p * (nsamples - 1) + 0.5);
+	return samples[i];
+}
+
+/* prints the percentiles of the samples (nanoseconds per operation) and
+ * the throughput of ops operations which took total nanoseconds
+ */
+static void report(const char *bench, int threads, long ops, long total) {
+	qsort(samples, nsamples, sizeof(double), cmp_double);
+	printf("{\"impl\": \"%s\", \"bench\": \"%s\", \"threads\": %d, \"ops\": %ld, "
+		"\"p50_ns\": %.1f, \"p90_ns\": %.1f, \"p99_ns\": %.1f, \"max_ns\": %.1f, \"ops_per_s\": %.0f}\n",
+		IMPL, bench, threads, ops, percentile(0.5), percentile(0.9), percentile(0.99),
+		samples[nsamples - 1], ops * 1e9 / total);
+	fflush(stdout);
+}
+
+static void *nothing(void *arg) {
+	return arg;
+}
+
+static void bench_create_join() {
+	mythread_t t;
+	long start = now_ns(), t0;
+	for(nsamples = 0; nsamples < CREATE_SAMPLES; nsamples++) {
+		t0 = now_ns();
+		mythread_create(&t, nothing, NULL);
+		mythread_join(t, NULL);
+		samples[nsamples] = now_ns() - t0;
+	}
+	report("create_join", 1, CREATE_SAMPLES, now_ns() - start);
+}
+
+/* the token is handed over by writing the number of the other thread,
+ * each thread yields until the token is its own
+ */
+static volatile int token;
+
+static void *pong(void *arg) {
+	long i;
+	for(i = 0; i < (long)PINGPONG_SAMPLES * BATCH; i++) {
+		while(token != 1)
+			mythread_yield();
+		token = 0;
+	}
+	return NULL;
+}
+
+static void bench_pingpong() {
+	mythread_t t;
+	long start, t0;
+	int i;
+	token = 0;
+	mythread_create(&t, pong, NULL);
+	start = now_ns();
+	for(nsamples = 0; nsamples < PINGPONG_SAMPLES; nsamples++) {
+		t0 = now_ns();
+		for(i = 0; i < BATCH; i++) {
+			token = 1;
+			while(token != 0)
+				mythread_yield();
+		}
+		samples[nsamples] = (double)(now_ns() - t0) / BATCH;
+	}
+	report("yield_pingpong", 2, (long)PINGPONG_SAMPLES * BATCH, now_ns() - start);
+	mythread_join(t, NULL);
+}
+
+/* every contender takes the lock BATCH times per sample and writes its
+ * samples to its own part of the array
+ */
+static mythread_spinlock_t spin;
+#ifdef HAVE_MUTEX
+static mythread_mutex_t mutex;
+#endif
+static volatile long counter;
+static volatile int go;
+
+struct contender {
+	int id, mutex;
+};
+
+static void *contend(void *arg) {
+	struct contender *c = (struct contender *)arg;
+	double *s = samples + c->id * LOCK_SAMPLES;
+	long t0;
+	int i, j;
+	while(!go)
+		mythread_yield();
+	for(i = 0; i < LOCK_SAMPLES; i++) {
+		t0 = now_ns();
+		for(j = 0; j < BATCH; j++) {
+#ifdef HAVE_MUTEX
+			if(c->mutex) {
+				mythread_mutex_lock(&mutex);
+				counter++;
+				mythread_mutex_unlock(&mutex);
+				continue;
+			}
+#endif
+			mythread_spin_lock(&spin);
+			counter++;
+			mythread_spin_unlock(&spin);
+		}
+		s[i] = (double)(now_ns() - t0) / BATCH;
+	}
+	return NULL;
+}
+
+static void bench_lock(int mutex, int nthreads) {
+	mythread_t t[MAX_THREADS];
+	struct contender c[MAX_THREADS];
+	long start;
+	int i;
+	counter = go = 0;
+	for(i = 0; i < nthreads; i++) {
+		c[i].id = i;
+		c[i].mutex = mutex;
+		mythread_create(&t[i], contend, &c[i]);
+	}
+	start = now_ns();
+	go = 1;
+	for(i = 0; i < nthreads; i++)
+		mythread_join(t[i], NULL);
+	nsamples = nthreads * LOCK_SAMPLES;
+	report(mutex ? "mutex" : "spinlock", nthreads, counter, now_ns() - start);
+	if(counter != (long)nthreads * LOCK_SAMPLES * BATCH)
+		fprintf(stderr, "%s: lost updates, counter %ld\n", mutex ? "mutex" : "spinlock", counter);
+}
+
+static double *ma, *mb, *mc;
+
+static void multiply(long lo, long hi, void *ctx) {
+	long i, j, k;
+	double a;
+	for(i = lo; i < hi; i++) {
+		for(j = 0; j < MATRIX_N; j++)
+			mc[i * MATRIX_N + j] = 0;
+		for(k = 0; k < MATRIX_N; k++) {
+			a = ma[i * MATRIX_N + k];
+			for(j = 0; j < MATRIX_N; j++)
+				mc[i * MATRIX_N + j] += a * mb[k * MATRIX_N + j];
+		}
+	}
+}
+
+#ifdef BENCH_PTHREAD
+/* pthreads have no parallel loop, the rows are split in nparts equal
+ * parts, one thread each
+ */
+struct part {
+	long lo, hi;
+};
+
+static void *part_run(void *arg) {
+	struct part *p = (struct part *)arg;
+	multiply(p->lo, p->hi, NULL);
+	return NULL;
+}
+
+static void parallel_rows(int nparts) {
+	pthread_t t[MAX_THREADS];
+	struct part p[MAX_THREADS];
+	int i;
+	for(i = 0; i < nparts; i++) {
+		p[i].lo = (long)MATRIX_N * i / nparts;
+		p[i].hi = (long)MATRIX_N * (i + 1) / nparts;
+		pthread_create(&t[i], NULL, part_run, &p[i]);
+	}
+	for(i = 0; i < nparts; i++)
+		pthread_join(t[i], NULL);
+}
+#else
+static void parallel_rows(int nparts) {
+	mythread_parallel_for(0, MATRIX_N, (MATRIX_N + nparts - 1) / nparts, multiply, NULL);
+}
+#endif
+
+static void bench_matrix(int nparts) {
+	long start, t0, i;
+	ma = (double *)malloc(3 * MATRIX_N * MATRIX_N * sizeof(double));
+	mb = ma + MATRIX_N * MATRIX_N;
+	mc = mb + MATRIX_N * MATRIX_N;
+	for(i = 0; i < 2 * MATRIX_N * MATRIX_N; i++)
+		ma[i] = (double)(i % 17) / 16;
+	start = now_ns();
+	for(nsamples = 0; nsamples < MATRIX_SAMPLES; nsamples++) {
+		t0 = now_ns();
+		parallel_rows(nparts);
+		samples[nsamples] = now_ns() - t0;
+	}
+	report("matrix", nparts, MATRIX_SAMPLES, now_ns() - start);
+	free(ma);
+}
+
+static int selected(const char *only, const char *bench) {
+	return !only || !strcmp(only, bench);
+}
+
+int main(int argc, char *argv[]) {
+	int max = argc > 1 ? atoi(argv[1]) : 4, n;
+	const char *only = argc > 2 ? argv[2] : NULL;
+	if(max < 1 || max > MAX_THREADS)
+		max = 4;
+	samples = (double *)malloc(MAX_THREADS * LOCK_SAMPLES * sizeof(double));
+	mythread_init();
+	mythread_spin_init(&spin);
+#ifdef HAVE_MUTEX
+	mythread_mutex_init(&mutex);
+#endif
+	if(selected(only, "create_join"))
+		bench_create_join();
+	if(selected(only, "yield_pingpong"))
+		bench_pingpong();
+	for(n = 1; n <= max; n = n < max && 2 * n > max ? max : 2 * n) {
+		if(selected(only, "spinlock"))
+			bench_lock(0, n);
+#ifdef HAVE_MUTEX
+		if(selected(only, "mutex"))
+			bench_lock(1, n);
+#endif
+	}
+	if(selected(only, "matrix"))
+		bench_matrix(max);
+	return 0;
+}
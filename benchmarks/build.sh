@@ -0,0 +1,25 @@
+#!/bin/sh
+# builds bench.c side by side with each library and with pthreads:
+# bench_oneone, bench_manyone, bench_manymany and bench_pthread
+# usage: ./build.sh [output directory]
+# the output directory defaults to the directory of this script, CC and
+# CFLAGS can be set in the environment (gcc and -O2 by default)
+# the programs print json lines which can be concatenated and compared:
+# ./bench_pthread 8 > bench.jsonl; ./bench_oneone 8 >> bench.jsonl ...
+
+set -e
+dir=$(cd "$(dirname "$0")" && pwd)
+src="$dir/../src"
+out=${1:-$dir}
+CC=${CC:-gcc}
+CFLAGS=${CFLAGS:--O2}
+# glibc older than 2.34 keeps pthreads and timer_create in separate libraries
+LIBS="-lpthread -lrt -lm"
+
+mkdir -p "$out"
+for model in oneone manyone manymany; do
+	$CC $CFLAGS -I"$src/mythread_type_$model" "$dir/bench.c" "$src/mythread_type_$model/mythread.c" -o "$out/bench_$model" $LIBS
+	echo "built $out/bench_$model"
+done
+$CC $CFLAGS -DBENCH_PTHREAD "$dir/bench.c" -o "$out/bench_pthread" $LIBS
+echo "built $out/bench_pthread"
@@ -0,0 +1,70 @@
+/*
+ * this program measures the number of context switches per second
+ * between two contexts which switch to each other in a loop, once with
+ * swapcontext (which the many-one library used before) and once with
+ * __mythread_context_switch (which it uses now)
+ * it is compiled with the many-one library:
+ * gcc -O2 -I../src/mythread_type_manyone switch.c ../src/mythread_type_manyone/mythread.c
+ * an optional argument gives the number of round trips
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <ucontext.h>
+#include "mythread.h"
+
+#define STACK (64 * 1024)
+
+static ucontext_t uc_main, uc_other;
+static struct mythread_context c_main, c_other;
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* the other side of the loop, it switches back to main forever
+ */
+static void uc_pong(void) {
+	while(1)
+		swapcontext(&uc_other, &uc_main);
+}
+
+static void c_pong(int unused) {
+	while(1)
+		__mythread_context_switch(&c_other, &c_main);
+}
+
+/* prints the switches per second of n round trips (2 switches each)
+ * which took t seconds
+ */
+static void report(const char *name, long n, double t) {
+	printf("%-28s %12.0f switches/s %8.1f ns/switch\n", name, 2 * n / t, t * 1e9 / (2 * n));
+}
+
+int main(int argc, char *argv[]) {
+	long i, n = argc > 1 ? atol(argv[1]) : 2000000;
+	double t;
+	mythread_init();
+
+	getcontext(&uc_other);
+	uc_other.uc_stack.ss_sp = malloc(STACK);
+	uc_other.uc_stack.ss_size = STACK;
+	uc_other.uc_link = NULL;
+	makecontext(&uc_other, uc_pong, 0);
+	swapcontext(&uc_main, &uc_other);
+	t = now();
+	for(i = 0; i < n; i++)
+		swapcontext(&uc_main, &uc_other);
+	report("swapcontext", n, now() - t);
+
+	__mythread_context_make(&c_other, malloc(STACK), STACK, c_pong, 0);
+	__mythread_context_switch(&c_main, &c_other);
+	t = now();
+	for(i = 0; i < n; i++)
+		__mythread_context_switch(&c_main, &c_other);
+	report("__mythread_context_switch", n, now() - t);
+	return 0;
+}
@@ -0,0 +1,1638 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <signal.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sched.h>
+#include <time.h>
+#include <ucontext.h>
+#include <link.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#ifdef __x86_64__
+#include <asm/prctl.h>
+#endif
+#include "mythread.h"
+
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+/* the table of all threads, it is a two level array of slots which never
+ * moves: a chunk of MYTHREAD_TABLE_CHUNK slots is allocated only when all
+ * slots before it are in use and slots of collected threads are reused
+ * through a free list linked by slot index
+ * mythread_t keeps the index of the slot plus one in its low 32 bits (0 is
+ * the main thread) and the generation of the slot in its high 32 bits, the
+ * generation changes every time the slot is freed so an old id of a reused
+ * slot is rejected
+ */
+static struct mythread_slot *__table[MYTHREAD_TABLE_CHUNKS];
+static int __table_size = 0, __table_free = -1;	//number of slots ever used and first free slot
+static struct mythread_struct __mainthread;		//the main thread, it is pinned to worker 0
+static struct mythread_worker __workers[MAX_WORKERS];
+static int __nworkers = 0;					//number of workers started
+static long __quantum = MYTHREAD_QUANTUM;		//time slice in microseconds
+static volatile int __idle_seq = 0, __nidle = 0;
+											//futex word on which idle workers sleep and number of
+											//workers sleeping on it
+static mythread_spinlock_t superlock = MYTHREAD_SPINLOCK_INITIALIZER;	//a superlock for locking during changing some delicate data structures (used internally)
+static sighandler_t def_sig_handlers[32], sigdfls[32];
+											//there 32 signals defined as per GNU, so these pointers will store
+											//pointers to default handlers and handlers replaced by common handler
+static struct {
+	unsigned long start, end;
+} __libc_text[MYTHREAD_LIBC_RANGES];		//code of libc and the allocator, a tick there does not preempt
+static int __nlibc_text = 0;
+static unsigned long __created = 0, __exited = 0;	//numbers of created and terminated threads, guarded by superlock
+
+/* the periodic export of the counters, see mythread_stats_export, the
+ * scheduler loop of worker 0 writes a snapshot when the deadline passes
+ */
+static char __export_path[256];
+static volatile long __export_interval = 0;	//milliseconds between two snapshots, 0 if there is no export
+static unsigned long __export_deadline = 0;
+static struct mythread_trace_ring __trace[MAX_WORKERS];	//events of the tracer, one ring per worker
+static volatile int __tracing = 0;			//non zero while events are recorded
+static unsigned long __trace_tsc, __trace_ns;	//time stamp counter and monotonic time when the trace started
+static char __trace_path[256];				//file the trace is dumped to at exit (MYTHREAD_TRACE)
+
+/* a bounded cache of stacks and thread structures of collected threads,
+ * new threads take them from here before calling malloc
+ * both lists are linked through the first word of the cached memory and
+ * are guarded by the superlock
+ */
+static struct {
+	void *stacks, *descs;
+	int nstacks, ndescs, cap;
+	unsigned long stack_hits, stack_misses, desc_hits, desc_misses;
+} __pool = {NULL, NULL, 0, 0, MYTHREAD_POOL_CAP, 0, 0, 0, 0};
+
+/* returns the monotonic time in nanoseconds
+ */
+static inline unsigned long now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+/* reads the time stamp counter of the cpu, which is much cheaper than
+ * clock_gettime, it is converted to time only when the trace is dumped
+ * (the counters of all cpus are assumed to be in sync, as they are on
+ * current x86 and arm cpus)
+ */
+static inline unsigned long trace_clock(void) {
+#if defined(__x86_64__) || defined(__i386__)
+	unsigned int lo, hi;
+	__asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+	return ((unsigned long)hi << 32) | lo;
+#elif defined(__aarch64__)
+	unsigned long t;
+	__asm__ volatile("mrs %0, cntvct_el0" : "=r"(t));
+	return t;
+#else
+	return now_ns();
+#endif
+}
+
+/* every worker points its thread pointer to its own struct mythread_worker,
+ * on x86-64 glibc uses fs for its TLS and leaves gs free, so the gs base
+ * is set once when the worker starts and reading the current worker or
+ * the thread running on it is a single load, without any system call
+ * on other architectures the worker is found by comparing the tid of the
+ * kernel thread (every worker is a separate pthread)
+ */
+static void set_thread_pointer(struct mythread_worker *w) {
+	w->self = w;
+	w->tid = syscall(SYS_gettid);
+#ifdef __x86_64__
+	syscall(SYS_arch_prctl, ARCH_SET_GS, (unsigned long)w);
+#endif
+}
+
+static inline struct mythread_worker *current_worker(void) {
+	struct mythread_worker *w;
+#ifdef __x86_64__
+	__asm__ volatile("mov %%gs:0, %0" : "=r"(w));
+#else
+	int i, tid = syscall(SYS_gettid);
+	for(i = 1; i < __nworkers; i++)
+		if(__workers[i].tid == tid)
+			break;
+	w = &__workers[i == __nworkers ? 0 : i];
+#endif
+	return w;
+}
+
+/* returns the green thread running on the calling worker (NULL inside the
+ * scheduler loop)
+ * the thread may be moved to another worker by the tick at any moment, so
+ * on x86-64 it is read with one instruction relative to gs, elsewhere the
+ * worker is read again to make sure the thread did not move in between
+ */
+static inline struct mythread_struct *current_thread(void) {
+	struct mythread_struct *t;
+#ifdef __x86_64__
+	__asm__ volatile("mov %%gs:%c1, %0" : "=r"(t) : "i"(offsetof(struct mythread_worker, current)));
+#else
+	struct mythread_worker *w;
+	do {
+		w = current_worker();
+		t = w->current;
+	} while(w != current_worker());
+#endif
+	return t;
+}
+
+/* records an event in the ring of worker w (the worker of the calling
+ * thread if w is NULL), the slot is claimed with an atomic add on head,
+ * so a thread which moves to another worker halfway or a signal handler
+ * never shares a slot with another event and no lock is needed
+ */
+static void trace_record(struct mythread_worker *w, unsigned int type, mythread_t thread, unsigned long arg) {
+	struct mythread_trace_ring *r;
+	struct mythread_trace_event *e;
+	if(!w)
+		w = current_worker();
+	r = &__trace[w->id];
+	e = &r->events[__atomic_fetch_add(&r->head, 1, __ATOMIC_RELAXED) & r->mask];
+	e->ts = trace_clock();
+	e->thread = thread;
+	e->arg = arg;
+	e->type = type;
+	e->cpu = w->id;
+}
+
+/* records an event if tracing is on, while it is off this is a single
+ * well predicted branch
+ */
+static inline void trace(struct mythread_worker *w, unsigned int type, mythread_t thread, unsigned long arg) {
+	if(__builtin_expect(__tracing, 0))
+		trace_record(w, type, thread, arg);
+}
+
+/* spins one round, pause tells the cpu that this is a busy wait loop, so
+ * it does not fill its pipeline with loads of the lock and leaves the
+ * core to the other hyperthread
+ */
+static inline void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+	__asm__ volatile("pause" ::: "memory");
+#elif defined(__aarch64__)
+	__asm__ volatile("yield" ::: "memory");
+#else
+	__asm__ volatile("" ::: "memory");
+#endif
+}
+
+/* gives the cpu away while a ticket lock is still not ours after
+ * MYTHREAD_SPIN_YIELD rounds, the holder may be a green thread waiting
+ * on this worker or a worker which the kernel has descheduled
+ * a thread which can not be switched out (or the scheduler loop) yields
+ * the whole worker instead
+ */
+static inline void spin_yield(void) {
+	struct mythread_struct *t = current_thread();
+	if(t && !t->nopreempt)
+		mythread_yield();
+	else
+		sched_yield();
+}
+
+/* the ticket lock behind mythread_spinlock_t and the superlock
+ * a waiter backs off in proportion to its distance from the owner, so
+ * the waiters do not all hammer the lock line at every handover
+ */
+static inline void ticket_lock(mythread_spinlock_t *lock) {
+	unsigned short ticket = __atomic_fetch_add(&lock->next, 1, __ATOMIC_RELAXED), owner;
+	unsigned int i, delay, rounds = 0;
+	while((owner = __atomic_load_n(&lock->owner, __ATOMIC_ACQUIRE)) != ticket) {
+		if(++rounds > MYTHREAD_SPIN_YIELD) {
+			spin_yield();
+			continue;
+		}
+		delay = (unsigned short)(ticket - owner) * MYTHREAD_SPIN_BACKOFF;
+		if(delay > MYTHREAD_SPIN_BACKOFF_MAX)
+			delay = MYTHREAD_SPIN_BACKOFF_MAX;
+		for(i = 0; i < delay; i++)
+			cpu_relax();
+	}
+}
+
+/* takes a ticket only if it is served right away, owner can not move
+ * past next, so if next is still the observed owner the lock is ours
+ */
+static inline int ticket_trylock(mythread_spinlock_t *lock) {
+	unsigned short owner = __atomic_load_n(&lock->owner, __ATOMIC_ACQUIRE);
+	return __atomic_compare_exchange_n(&lock->next, &owner, owner + 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+static inline void ticket_unlock(mythread_spinlock_t *lock) {
+	__atomic_store_n(&lock->owner, lock->owner + 1, __ATOMIC_RELEASE);
+}
+
+/* a static lock which will only be used internally by thread functions
+ * superlock_acquire and superlock_release are used directly only by the
+ * scheduler loop, which has no current thread and is never preempted
+ */
+static inline void superlock_acquire() {
+	ticket_lock(&superlock);
+}
+
+static inline void superlock_release() {
+	ticket_unlock(&superlock);
+}
+
+/* this function locks the lock
+ * the calling thread is not preempted while holding the lock, otherwise
+ * other threads on the same worker would spin for a whole time slice
+ */
+static inline void superlock_lock() {
+	current_thread()->nopreempt++;
+	superlock_acquire();
+}
+
+/* unlocks the static superlock
+ */
+static inline void superlock_unlock() {
+	superlock_release();
+	current_thread()->nopreempt--;
+}
+
+/* returns the slot with index ind
+ */
+static inline struct mythread_slot *table_slot(unsigned long ind) {
+	return &__table[ind / MYTHREAD_TABLE_CHUNK][ind % MYTHREAD_TABLE_CHUNK];
+}
+
+/* finds the thread with id mythread, it returns NULL if there is no such
+ * thread or it is already collected
+ * lookups only read the table (which never moves), so no lock is taken
+ * the thread is loaded before the generation is checked, both with
+ * acquire paired with the release stores of table_alloc and table_free,
+ * so a thread which got the slot after the old id was freed is never
+ * returned for it
+ */
+static inline struct mythread_struct *table_lookup(mythread_t mythread) {
+	unsigned long ind = (mythread & 0xffffffffUL) - 1;
+	struct mythread_slot *s;
+	struct mythread_struct *t;
+	if(ind >= (unsigned long)__atomic_load_n(&__table_size, __ATOMIC_ACQUIRE))
+		return NULL;
+	s = table_slot(ind);
+	t = __atomic_load_n(&s->thread, __ATOMIC_ACQUIRE);
+	if(__atomic_load_n(&s->gen, __ATOMIC_ACQUIRE) != (unsigned int)(mythread >> 32))
+		return NULL;
+	return t;
+}
+
+/* gives a slot (a freed one if possible) to thread t and sets its id,
+ * it returns -1 if the table is full
+ * called with superlock held
+ */
+static int table_alloc(struct mythread_struct *t) {
+	int ind;
+	struct mythread_slot *s, *chunk;
+	if(__table_free != -1) {
+		ind = __table_free;
+		s = table_slot(ind);
+		__table_free = s->next;
+	}
+	else {
+		ind = __table_size;
+		if(ind >= MYTHREAD_TABLE_CHUNK * MYTHREAD_TABLE_CHUNKS)
+			return -1;
+		if(!__table[ind / MYTHREAD_TABLE_CHUNK]) {
+			chunk = (struct mythread_slot *)calloc(MYTHREAD_TABLE_CHUNK, sizeof(struct mythread_slot));
+			if(!chunk)
+				return -1;
+			__table[ind / MYTHREAD_TABLE_CHUNK] = chunk;
+		}
+		s = table_slot(ind);
+		__atomic_store_n(&__table_size, ind + 1, __ATOMIC_RELEASE);
+	}
+	t->id = ((mythread_t)s->gen << 32) | (ind + 1);
+	__atomic_store_n(&s->thread, t, __ATOMIC_RELEASE);
+	return ind;
+}
+
+/* frees the slot of thread t, its id is not valid any more
+ * called with superlock held
+ */
+static void table_free(struct mythread_struct *t) {
+	int ind = (t->id & 0xffffffffUL) - 1;
+	struct mythread_slot *s = table_slot(ind);
+	__atomic_store_n(&s->gen, s->gen + 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&s->thread, NULL, __ATOMIC_RELEASE);
+	s->next = __table_free;
+	__table_free = ind;
+}
+
+/* takes a block from the cache list *list or mallocs a new one of given size
+ * the hit and miss counters of the list are updated
+ */
+static void *pool_get(void **list, int *n, unsigned long *hits, unsigned long *misses, size_t size) {
+	void *p = *list;
+	if(!p) {
+		(*misses)++;
+		return malloc(size);
+	}
+	*list = *(void **)p;
+	(*n)--;
+	(*hits)++;
+	return p;
+}
+
+/* gives a block back to the cache list *list, it is freed if the list
+ * is already full
+ */
+static void pool_put(void **list, int *n, void *p) {
+	if(*n >= __pool.cap) {
+		free(p);
+		return;
+	}
+	*(void **)p = *list;
+	*list = p;
+	(*n)++;
+}
+
+/* gives the stack and the structure of a collected thread back to the pool
+ * and frees its slot, so the thread id can not be used any more
+ * called with superlock held
+ */
+static void release_thread(struct mythread_struct *t) {
+	struct pending_signal_node *node, *next;
+	for(node = t->pending_signals.head; node; node = next) {
+		next = node->next;
+		free(node);
+	}
+	table_free(t);
+	pool_put(&__pool.stacks, &__pool.nstacks, t->thread_context.uc_stack.ss_sp);
+	pool_put(&__pool.descs, &__pool.ndescs, t);
+}
+
+/* the run queue locks are ticket locks like the superlock, so a worker
+ * pushing to its own queue is not starved by thieves
+ */
+static inline void runqueue_lock(struct mythread_runqueue *rq) {
+	ticket_lock(&rq->lock);
+}
+
+static inline int runqueue_trylock(struct mythread_runqueue *rq) {
+	return ticket_trylock(&rq->lock);
+}
+
+static inline void runqueue_unlock(struct mythread_runqueue *rq) {
+	ticket_unlock(&rq->lock);
+}
+
+/* adds the thread at the tail of the run queue of worker w, the caller
+ * must not be preemptible
+ */
+static void runqueue_push(struct mythread_worker *w, struct mythread_struct *t) {
+	t->next = NULL;
+	runqueue_lock(&w->rq);
+	if(w->rq.tail)
+		w->rq.tail->next = t;
+	else
+		w->rq.head = t;
+	w->rq.tail = t;
+	w->rq.len++;
+	runqueue_unlock(&w->rq);
+}
+
+/* removes the thread at the head of the run queue of worker w
+ */
+static struct mythread_struct *runqueue_pop(struct mythread_worker *w) {
+	struct mythread_struct *t;
+	if(!w->rq.len)
+		return NULL;
+	runqueue_lock(&w->rq);
+	t = w->rq.head;
+	if(t) {
+		w->rq.head = t->next;
+		if(!w->rq.head)
+			w->rq.tail = NULL;
+		w->rq.len--;
+	}
+	runqueue_unlock(&w->rq);
+	return t;
+}
+
+static inline int futex(volatile int *addr, int op, int val, const struct timespec *timeout) {
+	return syscall(SYS_futex, addr, op, val, timeout, NULL, 0);
+}
+
+/* wakes one sleeping worker (if any) after some work was added to a run
+ * queue so that it can steal it
+ */
+static void wake_idle_worker(void) {
+	__sync_synchronize();
+	if(__nidle) {
+		__sync_fetch_and_add(&__idle_seq, 1);
+		futex(&__idle_seq, FUTEX_WAKE_PRIVATE, 1, NULL);
+	}
+}
+
+/* values of park of a thread, a parking thread has marked itself but may
+ * still run until its worker switches away from it, a parked thread is in
+ * no run queue until it is unparked
+ */
+#define PARK_GOING 1
+#define PARK_DONE 2
+
+/* called by the scheduler after it switched away from a parking thread,
+ * it returns 1 if the thread stays out of the run queues (0 if it was
+ * unparked meanwhile and is requeued)
+ */
+static int park_done(struct mythread_struct *t) {
+	int parked;
+	superlock_acquire();
+	if((parked = t->park == PARK_GOING))
+		t->park = PARK_DONE;
+	superlock_release();
+	return parked;
+}
+
+/* puts the parked thread t back in the run queue of worker w (of worker 0
+ * if t is pinned), a thread which is still on its way out only loses its
+ * mark so the scheduler requeues it
+ * called with superlock held by a worker which can not be preempted
+ */
+static void unpark(struct mythread_struct *t, struct mythread_worker *w) {
+	if(t->park == PARK_DONE) {
+		t->ready = now_ns();
+		runqueue_push(t->pinned ? &__workers[0] : w, t);
+		wake_idle_worker();
+	}
+	t->park = 0;
+}
+
+/* tries to steal half of the run queue of some other worker, starting
+ * from a random victim, pinned threads are never taken
+ * the first stolen thread is returned and the others are added to the
+ * run queue of worker w
+ */
+static struct mythread_struct *steal(struct mythread_worker *w) {
+	struct mythread_worker *victim;
+	struct mythread_struct *t, *prev, *next, *head = NULL, *tail = NULL;
+	int i, start, want, got;
+	if(__nworkers < 2)
+		return NULL;
+	start = rand_r(&w->seed) % __nworkers;
+	for(i = 0; i < __nworkers && !head; i++) {
+		victim = &__workers[(start + i) % __nworkers];
+		if(victim == w || !victim->rq.len || !runqueue_trylock(&victim->rq))
+			continue;
+		want = (victim->rq.len + 1) / 2;
+		got = 0;
+		prev = NULL;
+		for(t = victim->rq.head; t && got < want; t = next) {
+			next = t->next;
+			if(t->pinned) {
+				prev = t;
+				continue;
+			}
+			if(prev)
+				prev->next = next;
+			else
+				victim->rq.head = next;
+			if(victim->rq.tail == t)
+				victim->rq.tail = prev;
+			t->next = NULL;
+			if(tail)
+				tail->next = t;
+			else
+				head = t;
+			tail = t;
+			got++;
+		}
+		victim->rq.len -= got;
+		runqueue_unlock(&victim->rq);
+	}
+	if(!head)
+		return NULL;
+	for(t = head->next; t; t = next) {
+		next = t->next;
+		runqueue_push(w, t);
+	}
+	return head;
+}
+
+/* puts the worker to sleep until some other worker adds work to its run
+ * queue, the timeout covers a wakeup which raced with going to sleep
+ */
+static void idle(struct mythread_worker *w) {
+	struct timespec ts = {0, 1000000};
+	int i, seq = __idle_seq;
+	unsigned long start;
+	__sync_fetch_and_add(&__nidle, 1);
+	for(i = 0; i < __nworkers; i++)
+		if(__workers[i].rq.len)
+			break;
+	if(i == __nworkers) {
+		start = now_ns();
+		futex(&__idle_seq, FUTEX_WAIT_PRIVATE, seq, &ts);
+		w->idle_ns += now_ns() - start;
+	}
+	__sync_fetch_and_sub(&__nidle, 1);
+}
+
+static void stats_export_tick(unsigned long now);
+
+/* the scheduler loop of every worker, it runs on a separate stack of the
+ * worker and is never preempted
+ * the thread which switched to the scheduler is put back in the run queue
+ * unless it is exiting, an exiting thread is marked terminated only here
+ * (after the worker left its stack) so that join can reuse the stack at
+ * once, then the next thread is taken from the local run queue (or
+ * stolen) and the worker switches to it
+ * worker 0 enters the loop for the first time from the main thread, so
+ * the main thread is requeued like any other thread
+ * the run and wait times of the threads are counted here, around every
+ * switch, and worker 0 also writes the periodic snapshot of the counters
+ * a detached thread which has exited is released here, as its stack is
+ * not used any more
+ */
+static void schedule(void) {
+	struct mythread_worker *w = current_worker();
+	struct mythread_struct *t;
+	unsigned long now;
+	while(1) {
+		t = w->current;
+		now = now_ns();
+		if(t) {
+			w->current = NULL;
+			t->stats.run_ns += now - t->running;
+			t->running = 0;
+			if(t->exiting) {
+				superlock_acquire();
+				if(t->state == THREAD_DETACHED)
+					release_thread(t);
+				else {
+					t->state = THREAD_TERMINATED;
+					if(t->joiner) {
+						unpark(t->joiner, w);
+						t->joiner = NULL;
+					}
+				}
+				__exited++;
+				superlock_release();
+			}
+			else {
+				t->stats.switches++;
+				w->switches++;
+				if(!t->park || !park_done(t)) {
+					t->ready = now;
+					runqueue_push(w, t);
+				}
+			}
+		}
+		if(!w->id && __export_interval && now >= __export_deadline)
+			stats_export_tick(now);
+		t = runqueue_pop(w);
+		if(!t)
+			t = steal(w);
+		if(!t) {
+			idle(w);
+			continue;
+		}
+		now = now_ns();
+		t->stats.wait_ns += now - t->ready;
+		t->running = now;
+		w->current = t;
+		trace(w, MYTHREAD_TRACE_SWITCH_IN, t->id, 0);
+		swapcontext(&w->sched_context, &t->thread_context);
+	}
+}
+
+/* adds a signal to a pending signal queue by creating a node containing
+ * signal number of the signal and adding it to the queue at the end
+ */
+static void addsignal(pending_signals_queue *q, int sig) {
+	if(q->head) {
+		q->tail->next = (struct pending_signal_node *)malloc(sizeof(struct pending_signal_node));
+		q->tail->next->sig = sig;
+		q->tail->next->next = NULL;
+		q->tail = q->tail->next;
+	}
+	else {
+		q->head = q->tail = (struct pending_signal_node *)malloc(sizeof(struct pending_signal_node));
+		q->head->sig = sig;
+		q->head->next = NULL;
+	}
+}
+
+/* calls the handler of thread t for signal sig, if the thread set its
+ * handler for that signal as SIG_DFL the handler the process had before
+ * the library installed its own is called instead
+ * it returns -1 if there is no function to call (the handler is SIG_DFL
+ * and so was the handler of the process)
+ */
+static int deliver_signal(struct mythread_struct *t, int sig) {
+	sighandler_t h = t->handlers[sig] == SIG_DFL ? sigdfls[sig] : t->handlers[sig];
+	if(h == SIG_IGN)
+		return 0;
+	if(h == SIG_DFL || h == SIG_ERR)
+		return -1;
+	t->stats.signals++;
+	trace(NULL, MYTHREAD_TRACE_SIGNAL, t->id, sig);
+	h(sig);
+	return 0;
+}
+
+/* a common signal handlers which will be activated when a
+ * signal occures and then it determines which thread is currently
+ * running on the worker which received it and activates the signal
+ * handler set by that thread
+ * signals received inside the scheduler loop are handled by the handlers
+ * of the main thread
+ */
+static void common_signal_handler(int sig) {
+	struct mythread_struct *t = current_thread();
+	deliver_signal(t ? t : &__mainthread, sig);
+}
+
+/* the program using this library for multi threading should call
+ * this function instead of default function 'signal'. This is essential
+ * to set proper adjustments so that the signal handler is set only for
+ * that thread and not for all program
+ */
+sighandler_t set_active_thread_signal(int signum, sighandler_t handler) {
+	sighandler_t *f, dflt;
+	if(signum >= 32)
+		return SIG_ERR;
+	superlock_lock();
+	f = current_thread()->handlers;
+	if(f[signum] == SIG_DFL || f[signum] == SIG_IGN) {
+		dflt = signal(signum, common_signal_handler);
+		if(dflt != common_signal_handler)	//another thread set a handler already
+			sigdfls[signum] = dflt;
+		dflt = sigdfls[signum];
+	}
+	else
+		dflt = f[signum];
+	f[signum] = handler;
+	superlock_unlock();
+	return dflt;
+}
+
+/* delivers the pending signals of thread t, it is called by the thread
+ * itself every time it comes back in running, so the handlers run on
+ * whichever worker the thread is running now
+ * only a signal without any handler (whose default action is taken by
+ * the kernel) is raised
+ */
+static void handle_pending_signals(struct mythread_struct *t) {
+	struct pending_signal_node *node, *previous;
+	if(!t->pending_signals.head)
+		return;
+	superlock_lock();
+	node = t->pending_signals.head;
+	t->pending_signals.head = t->pending_signals.tail = NULL;
+	superlock_unlock();
+	while(node) {
+		if(deliver_signal(t, node->sig) == -1)
+			raise(node->sig);
+		previous = node;
+		node = node->next;
+		free(previous);
+	}
+}
+
+/* switches from the calling thread back to the scheduler of the worker
+ * it is running on, the scheduler puts it back in the run queue (if it
+ * is still running) from where this or any other worker may resume it
+ * preempted is non zero if the tick switches it out
+ */
+static void thread_yield(int preempted) {
+	struct mythread_struct *t = current_thread();
+	t->nopreempt++;
+	trace(NULL, MYTHREAD_TRACE_SWITCH_OUT, t->id, preempted);
+	swapcontext(&t->thread_context, &current_worker()->sched_context);
+	t->nopreempt--;
+	handle_pending_signals(t);
+}
+
+/* parks the calling thread t, which holds superlock, until some worker
+ * unparks it, superlock is released and t switches to the scheduler,
+ * which leaves it out of the run queues
+ */
+static void thread_park(struct mythread_struct *t) {
+	t->park = PARK_GOING;
+	t->nopreempt++;
+	superlock_unlock();
+	thread_yield(0);
+	t->nopreempt--;
+}
+
+static void trace_atexit(void);
+
+/* dl_iterate_phdr callback which records the executable segments of libc,
+ * libpthread, the dynamic linker and any allocator library (an object
+ * whose name contains malloc, like jemalloc or tcmalloc)
+ */
+static int libc_text_add(struct dl_phdr_info *info, size_t size, void *data) {
+	static const char *names[] = {"libc.so", "libc-", "libpthread", "ld-linux", "malloc", NULL};
+	const char *base = info->dlpi_name ? strrchr(info->dlpi_name, '/') : NULL;
+	int i;
+	base = base ? base + 1 : info->dlpi_name;
+	if(!base || !base[0])
+		return 0;
+	for(i = 0; names[i] && !strstr(base, names[i]); i++)
+		;
+	if(!names[i])
+		return 0;
+	for(i = 0; i < info->dlpi_phnum && __nlibc_text < MYTHREAD_LIBC_RANGES; i++)
+		if(info->dlpi_phdr[i].p_type == PT_LOAD && (info->dlpi_phdr[i].p_flags & PF_X)) {
+			__libc_text[__nlibc_text].start = info->dlpi_addr + info->dlpi_phdr[i].p_vaddr;
+			__libc_text[__nlibc_text].end = __libc_text[__nlibc_text].start + info->dlpi_phdr[i].p_memsz;
+			__nlibc_text++;
+		}
+	return 0;
+}
+
+/* returns non zero if the tick described by ctx interrupted code of libc
+ * or of the allocator, a green thread switched out there could leave the
+ * per worker state of malloc (its tcache and arena) half updated for the
+ * next thread of the worker, or resume it on another worker
+ */
+static int in_libc(void *ctx) {
+	unsigned long pc;
+	int i;
+#if defined(__x86_64__)
+	pc = ((ucontext_t *)ctx)->uc_mcontext.gregs[REG_RIP];
+#elif defined(__i386__)
+	pc = ((ucontext_t *)ctx)->uc_mcontext.gregs[REG_EIP];
+#elif defined(__aarch64__)
+	pc = ((ucontext_t *)ctx)->uc_mcontext.pc;
+#else
+	return 0;
+#endif
+	for(i = 0; i < __nlibc_text; i++)
+		if(pc >= __libc_text[i].start && pc < __libc_text[i].end)
+			return 1;
+	return 0;
+}
+
+/* this function will be invoked after every alarm sent to a worker,
+ * it preempts the thread running on that worker unless the thread is
+ * in some critical section of the library or inside libc, then the tick
+ * is skipped and the thread is preempted by a later one
+ * errno belongs to the worker, so it is saved here and restored when the
+ * thread is switched in again, on whichever worker that is
+ */
+static void nextthread(int sig, siginfo_t *info, void *ctx) {
+	struct mythread_struct *t = current_thread();
+	int e;
+	if(sig == SIGALRM && t && !t->nopreempt && !in_libc(ctx)) {
+		e = errno;
+		t->stats.preempted++;
+		current_worker()->preemptions++;
+		thread_yield(1);
+		errno = e;
+	}
+}
+
+/* leaves the calling thread forever by switching to the scheduler which
+ * marks it as terminated, preemption stays disabled on the way so the
+ * thread is never put back in a run queue
+ */
+static void thread_terminate(struct mythread_struct *t) {
+	t->nopreempt++;
+	trace(NULL, MYTHREAD_TRACE_EXIT, t->id, 0);
+	trace(NULL, MYTHREAD_TRACE_SWITCH_OUT, t->id, 0);
+	t->exiting = 1;
+	setcontext(&current_worker()->sched_context);
+}
+
+/* creates and arms the timer of the calling worker, a CLOCK_MONOTONIC
+ * timer which sends SIGALRM every quantum to this worker only, so every
+ * worker preempts its own thread
+ */
+static void worker_timer(struct mythread_worker *w) {
+	struct sigevent sev;
+	struct itimerspec its;
+	memset(&sev, 0, sizeof(sev));
+	sev.sigev_notify = SIGEV_THREAD_ID;
+	sev.sigev_signo = SIGALRM;
+	sev.sigev_notify_thread_id = w->tid;
+	if(timer_create(CLOCK_MONOTONIC, &sev, &w->timer))
+		return;
+	its.it_value.tv_sec = its.it_interval.tv_sec = __quantum / 1000000;
+	its.it_value.tv_nsec = its.it_interval.tv_nsec = (__quantum % 1000000) * 1000;
+	timer_settime(w->timer, 0, &its, NULL);
+}
+
+/* the start function of all workers except worker 0 (which is the
+ * main thread of the process), every worker is a pthread so libc keeps
+ * its own state (errno, malloc arena and tcache, stdio locks) for it
+ */
+static void *worker_start(void *arg) {
+	struct mythread_worker *w = (struct mythread_worker *)arg;
+	set_thread_pointer(w);
+	worker_timer(w);
+	schedule();
+	return NULL;
+}
+
+/* this initialisation function is needed to be called
+ * before creating any thread and calling any other thread
+ * functions on that thread
+ * it starts one worker per online cpu (or MYTHREAD_WORKERS workers if
+ * that environment variable is set), the calling kernel thread becomes
+ * worker 0 and the main thread keeps running on it
+ * the time slice can be set with the environment variable
+ * MYTHREAD_QUANTUM (in microseconds)
+ * if the environment variable MYTHREAD_TRACE names a file, the tracer is
+ * started and the trace is written to that file at exit
+ */
+void mythread_init(void) {
+	int i, n;
+	char *env = getenv("MYTHREAD_WORKERS");
+	struct mythread_worker *w;
+	struct sigaction sa;
+	pthread_attr_t attr;
+	pthread_t pt;
+	n = env ? atoi(env) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+	if((env = getenv("MYTHREAD_POOL_CAP")))
+		__pool.cap = atoi(env);
+	if((env = getenv("MYTHREAD_QUANTUM")) && atol(env) > 0)
+		__quantum = atol(env);
+	if(n < 1)
+		n = 1;
+	if(n > MAX_WORKERS)
+		n = MAX_WORKERS;
+	for(i = 0; i < 32; i++)
+		sigdfls[i] = def_sig_handlers[i] = __mainthread.handlers[i] = SIG_DFL;
+	__mainthread.state = THREAD_RUNNING;
+	__mainthread.pinned = 1;
+	__mainthread.id = 0;
+	__mainthread.running = now_ns();
+	for(i = 0; i < n; i++) {
+		__workers[i].id = i;
+		__workers[i].seed = i * 2654435761u + 1;
+	}
+	w = &__workers[0];
+	set_thread_pointer(w);
+	w->current = &__mainthread;
+	w->stack = (char *)malloc(WORKER_STACK_SIZE);
+	getcontext(&w->sched_context);
+	w->sched_context.uc_stack.ss_sp = w->stack;
+	w->sched_context.uc_stack.ss_size = WORKER_STACK_SIZE;
+	w->sched_context.uc_link = NULL;
+	makecontext(&w->sched_context, schedule, 0);
+	__nworkers = n;
+	if((env = getenv("MYTHREAD_TRACE")) && strlen(env) < sizeof(__trace_path) && !mythread_trace_start(0)) {
+		strcpy(__trace_path, env);
+		atexit(trace_atexit);
+	}
+	dl_iterate_phdr(libc_text_add, NULL);
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_sigaction = nextthread;
+	sa.sa_flags = SA_SIGINFO | SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGALRM, &sa, NULL);
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, WORKER_STACK_SIZE);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	for(i = 1; i < n; i++)
+		if(pthread_create(&pt, &attr, worker_start, (void *)&__workers[i])) {
+			__nworkers = i;
+			break;
+		}
+	pthread_attr_destroy(&attr);
+	worker_timer(&__workers[0]);
+}
+
+/* returns the number of workers (kernel threads) running green threads
+ */
+int mythread_workers(void) {
+	return __nworkers;
+}
+
+/* wrapper function of type void (*f)(int) which is needed to be type
+ * casted in the form void (*f)(void) and passed to makecontext
+ * function
+ * it invokes the function of the thread, also stores the returned
+ * value in the mythread_struct
+ */
+void __mythread_wrapper(int ind) {
+	struct mythread_struct *t = table_slot(ind - 1)->thread;
+	t->nopreempt--;
+	t->returnval = t->fun(t->args);
+	thread_terminate(t);
+}
+
+/* it takes function and arguments and returns a structure of type
+ * mythread_struct which contains useful information of the current
+ * thread and can be passwed to function __mythread_wrapper
+ * the thread starts with preemption disabled as it is switched in
+ * by the scheduler, the wrapper enables it
+ * it returns NULL if the structure or the stack can not be allocated or
+ * the table is full
+ */
+struct mythread_struct *__mythread_fill(void *(*fun)(void *), void *args) {
+	struct mythread_struct *t;
+	char *stack;
+	if(!(t = (struct mythread_struct *)pool_get(&__pool.descs, &__pool.ndescs, &__pool.desc_hits, &__pool.desc_misses, sizeof(struct mythread_struct))))
+		return NULL;
+	if(!(stack = pool_get(&__pool.stacks, &__pool.nstacks, &__pool.stack_hits, &__pool.stack_misses, STACK_SIZE)) || table_alloc(t) == -1) {
+		if(stack)
+			pool_put(&__pool.stacks, &__pool.nstacks, stack);
+		pool_put(&__pool.descs, &__pool.ndescs, t);
+		return NULL;
+	}
+	getcontext(&(t->thread_context));
+	memcpy(t->handlers, def_sig_handlers, sizeof(def_sig_handlers));
+	t->fun = fun;
+	t->args = args;
+	t->thread_context.uc_stack.ss_sp = stack;
+	t->thread_context.uc_stack.ss_size = STACK_SIZE;
+	t->thread_context.uc_link = NULL;
+	t->returnval = NULL;
+	t->state = THREAD_NOT_STARTED;
+	t->pinned = 0;
+	t->exiting = 0;
+	t->nopreempt = 1;
+	t->park = 0;
+	t->joiner = NULL;
+	t->next = NULL;
+	t->pending_signals.head = t->pending_signals.tail = NULL;
+	memset(&t->stats, 0, sizeof(t->stats));
+	t->ready = now_ns();
+	t->running = 0;
+	return t;
+}
+
+/* creates a green thread and adds it to the run queue of the worker on
+ * which the caller is running, idle workers steal it from there
+ * it returns 0 on success and -1 on error
+ * the thread id is stored in the location pointed by mythread
+ */
+int mythread_create(mythread_t *mythread, void *(*fun)(void *), void *args) {
+	return mythread_create_attr(mythread, NULL, fun, args);
+}
+
+/* initialises the attributes attr with default values
+ */
+int mythread_attr_init(mythread_attr_t *attr) {
+	attr->detached = 0;
+	return 0;
+}
+
+/* makes a thread created with attr detached (see mythread_detach) if
+ * detached is non zero, it returns 0
+ */
+int mythread_attr_setdetached(mythread_attr_t *attr, int detached) {
+	attr->detached = detached != 0;
+	return 0;
+}
+
+/* same as mythread_create but the thread is created with attributes
+ * attr (default attributes if attr is NULL)
+ */
+int mythread_create_attr(mythread_t *mythread, const mythread_attr_t *attr, void *(*fun)(void *), void *args) {
+	struct mythread_struct *t;
+	superlock_lock();
+	t = __mythread_fill(fun, args);
+	if(!t) {
+		superlock_unlock();
+		return -1;
+	}
+	*mythread = t->id;
+	t->state = attr && attr->detached ? THREAD_DETACHED : THREAD_RUNNING;
+	__created++;
+	makecontext(&(t->thread_context), (void (*)())__mythread_wrapper, 1, (int)(t->id & 0xffffffff));
+	runqueue_push(current_worker(), t);
+	superlock_unlock();
+	trace(NULL, MYTHREAD_TRACE_CREATE, current_thread()->id, *mythread);
+	wake_idle_worker();
+	return 0;
+}
+
+/* gives the worker to other threads, the calling thread goes to the end
+ * of the run queue of its worker, it returns 0
+ */
+int mythread_yield(void) {
+	thread_yield(0);
+	return 0;
+}
+
+/* returns ID of the calling thread, if mythread_init is not called, then
+ * it returns -1
+ * if the thread calling it is main thread, then it returns 0
+ */
+mythread_t mythread_self(void) {
+	if(!__nworkers)
+		return -1;
+	return current_thread()->id;
+}
+
+/* waits for the thread mythread to complete
+ * it returns 0 on success, EINVAL on wrong thread_t argument, ESRCH
+ * if the thread with thread id mythread can not be found and EDEADLK if
+ * the calling thread joins itself
+ * the waiting thread is parked in the joined thread and takes no cpu
+ * until the scheduler which marks that thread terminated unparks it
+ * if returnval is not NULL, then stores the value returned by thread
+ * in the location pointed by function which was running by the thread
+ * the stack and structure of the collected thread go back to the pool
+ */
+int mythread_join(mythread_t mythread, void **returnval) {
+	int status = EINVAL;
+	struct mythread_struct *t, *self = current_thread();
+	superlock_lock();
+	if(!(t = table_lookup(mythread))) {
+		superlock_unlock();
+		return ESRCH;
+	}
+	switch(t->state) {
+		case THREAD_RUNNING:
+			if(t == self) {
+				superlock_unlock();
+				return EDEADLK;
+			}
+			t->state = THREAD_JOIN_CALLED;
+			t->joiner = self;
+			trace(NULL, MYTHREAD_TRACE_BLOCK, self->id, mythread);
+			while(t->state != THREAD_TERMINATED) {
+				thread_park(self);
+				superlock_lock();
+			}
+			trace(NULL, MYTHREAD_TRACE_WAKE, self->id, 0);
+			/* fall through */
+		case THREAD_TERMINATED:
+			if(returnval)
+				*returnval = t->returnval;
+			release_thread(t);
+			superlock_unlock();
+			status = 0;
+			break;
+		default:
+			superlock_unlock();
+			break;
+	}
+	return status;
+}
+
+/* detaches the thread mythread, it can not be joined any more and its
+ * stack and structure are released as soon as it has exited (at once if
+ * it has exited already)
+ * it returns 0 on success, ESRCH if the thread can not be found and
+ * EINVAL if it is detached already or some thread joins it
+ */
+int mythread_detach(mythread_t mythread) {
+	int status = 0;
+	struct mythread_struct *t;
+	superlock_lock();
+	if(!(t = table_lookup(mythread)))
+		status = ESRCH;
+	else if(t->state == THREAD_RUNNING)
+		t->state = THREAD_DETACHED;
+	else if(t->state == THREAD_TERMINATED)
+		release_thread(t);
+	else status = EINVAL;
+	superlock_unlock();
+	return status;
+}
+
+/* sends signal sig to the thread represented by
+ * mythread_t mythread
+ * the signal is stored in the thread's pending signals
+ * queue which will be processed on whichever worker the thread
+ * is running next time
+ */
+int mythread_kill(mythread_t mythread, int sig) {
+	struct mythread_struct *t;
+	superlock_lock();
+	if(!(t = table_lookup(mythread))) {
+		superlock_unlock();
+		return ESRCH;
+	}
+	addsignal(&(t->pending_signals), sig);
+	superlock_unlock();
+	return 0;
+}
+
+/* when called, the calling thread exits and its worker continues with
+ * the next thread, returnval is stored so that a thread calling join
+ * can collect it
+ */
+void mythread_exit(void *returnval) {
+	struct mythread_struct *t = current_thread();
+	if(t && t != &__mainthread) {
+		t->returnval = returnval;
+		thread_terminate(t);
+	}
+}
+
+/* sets the number of stacks (and of thread structures) kept in the pool
+ * for reuse, extra cached blocks are freed, it returns the previous limit
+ * the initial limit is MYTHREAD_POOL_CAP or the value of the environment
+ * variable MYTHREAD_POOL_CAP
+ */
+int mythread_pool_setcap(int cap) {
+	int old;
+	void *p;
+	if(cap < 0)
+		return -1;
+	superlock_lock();
+	old = __pool.cap;
+	__pool.cap = cap;
+	while(__pool.nstacks > cap) {
+		p = __pool.stacks;
+		__pool.stacks = *(void **)p;
+		__pool.nstacks--;
+		free(p);
+	}
+	while(__pool.ndescs > cap) {
+		p = __pool.descs;
+		__pool.descs = *(void **)p;
+		__pool.ndescs--;
+		free(p);
+	}
+	superlock_unlock();
+	return old;
+}
+
+/* copies the counters of the pool in the structure pointed by stats
+ */
+void mythread_pool_getstats(struct mythread_pool_stats *stats) {
+	superlock_lock();
+	stats->stack_hits = __pool.stack_hits;
+	stats->stack_misses = __pool.stack_misses;
+	stats->desc_hits = __pool.desc_hits;
+	stats->desc_misses = __pool.desc_misses;
+	stats->stacks = __pool.nstacks;
+	stats->descs = __pool.ndescs;
+	stats->cap = __pool.cap;
+	superlock_unlock();
+}
+
+/* copies the counters of thread t, the time it has been running on a
+ * worker so far is added to its run time
+ */
+static void stats_copy(struct mythread_struct *t, struct mythread_thread_stats *stats) {
+	unsigned long running = t->running;
+	*stats = t->stats;
+	stats->id = t->id;
+	stats->state = t->state;
+	if(running)
+		stats->run_ns += now_ns() - running;
+}
+
+/* copies the counters of the thread mythread (0 for the main thread) in
+ * stats, it returns ESRCH if there is no such thread
+ * the counters of a terminated thread stay until it is collected
+ */
+int mythread_stats(mythread_t mythread, struct mythread_thread_stats *stats) {
+	struct mythread_struct *t = &__mainthread;
+	superlock_lock();
+	if(mythread && !(t = table_lookup(mythread))) {
+		superlock_unlock();
+		return ESRCH;
+	}
+	stats_copy(t, stats);
+	superlock_unlock();
+	return 0;
+}
+
+/* sums the counters of all workers in stats, called with superlock held
+ */
+static void sched_stats(struct mythread_sched_stats *stats) {
+	struct mythread_worker *w;
+	int i;
+	memset(stats, 0, sizeof(struct mythread_sched_stats));
+	for(i = 0; i < __nworkers; i++) {
+		w = &__workers[i];
+		stats->switches += w->switches;
+		stats->preemptions += w->preemptions;
+		stats->idle_ns += w->idle_ns;
+		stats->runnable += w->rq.len + (w->current != NULL);
+	}
+	stats->created = __created;
+	stats->exited = __exited;
+	stats->threads = __created - __exited + 1;
+}
+
+/* copies the counters of the scheduler in stats
+ */
+void mythread_sched_stats(struct mythread_sched_stats *stats) {
+	superlock_lock();
+	sched_stats(stats);
+	superlock_unlock();
+}
+
+/* writes the snapshot of n threads and of the scheduler to path, first
+ * to a temporary file which is then renamed over path, so a reader (like
+ * a top of the threads) never sees a half written snapshot
+ * every line is a json object, the first one has the counters of the
+ * scheduler and every other one those of a thread
+ * it returns 0 or the errno of the failed call
+ */
+static int stats_write(const char *path, struct mythread_sched_stats *s, struct mythread_thread_stats *threads, int n) {
+	char tmp[sizeof(__export_path) + 8];
+	FILE *fp;
+	int i;
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	if(!(fp = fopen(tmp, "w")))
+		return errno;
+	fprintf(fp, "{\"pid\": %d, \"time_ns\": %lu, \"threads\": %d, \"runnable\": %d, \"switches\": %lu, "
+		"\"preemptions\": %lu, \"created\": %lu, \"exited\": %lu, \"idle_ns\": %lu}\n",
+		getpid(), now_ns(), s->threads, s->runnable, s->switches, s->preemptions, s->created, s->exited, s->idle_ns);
+	for(i = 0; i < n; i++)
+		fprintf(fp, "{\"id\": %lu, \"state\": %d, \"run_ns\": %lu, \"wait_ns\": %lu, \"lock_ns\": %lu, "
+			"\"switches\": %lu, \"preempted\": %lu, \"signals\": %lu}\n",
+			threads[i].id, threads[i].state, threads[i].run_ns, threads[i].wait_ns, threads[i].lock_ns,
+			threads[i].switches, threads[i].preempted, threads[i].signals);
+	if(fclose(fp) == EOF || rename(tmp, path) == -1)
+		return errno;
+	return 0;
+}
+
+/* takes a snapshot of all threads which are not collected and writes it
+ * to path, the counters are copied with superlock held and written
+ * without it
+ * it is called by the scheduler loop of worker 0 or by a thread which
+ * can not be preempted while it holds superlock
+ */
+static int stats_snapshot(const char *path) {
+	struct mythread_thread_stats *threads;
+	struct mythread_sched_stats s;
+	struct mythread_struct *t;
+	int i, n = 0, status;
+	superlock_acquire();
+	threads = (struct mythread_thread_stats *)malloc((__table_size + 1) * sizeof(struct mythread_thread_stats));
+	if(!threads) {
+		superlock_release();
+		return ENOMEM;
+	}
+	stats_copy(&__mainthread, &threads[n++]);
+	for(i = 0; i < __table_size; i++)
+		if((t = table_slot(i)->thread))
+			stats_copy(t, &threads[n++]);
+	sched_stats(&s);
+	superlock_release();
+	status = stats_write(path, &s, threads, n);
+	free(threads);
+	return status;
+}
+
+/* writes the periodic snapshot, called by the scheduler loop of worker 0
+ * once the deadline has passed, so the export needs no thread of its own
+ * and is late by at most one tick
+ */
+static void stats_export_tick(unsigned long now) {
+	char path[sizeof(__export_path)];
+	superlock_acquire();
+	memcpy(path, __export_path, sizeof(path));
+	__export_deadline = now + __export_interval * 1000000UL;
+	superlock_release();
+	stats_snapshot(path);
+}
+
+/* exports the counters of all threads and of the scheduler to the file
+ * path (for example in /dev/shm), so that other processes can watch them
+ * if interval_ms is positive the file is rewritten every interval_ms
+ * milliseconds (calling it again only changes path and interval), else
+ * the file is written once now, if path is NULL the periodic export stops
+ * it returns 0, ENAMETOOLONG if path is too long or the errno of writing
+ * the file
+ */
+int mythread_stats_export(const char *path, long interval_ms) {
+	struct mythread_struct *t = current_thread();
+	int status;
+	if(!path) {
+		__export_interval = 0;
+		return 0;
+	}
+	if(strlen(path) >= sizeof(__export_path))
+		return ENAMETOOLONG;
+	if(interval_ms <= 0) {
+		t->nopreempt++;
+		status = stats_snapshot(path);
+		t->nopreempt--;
+		return status;
+	}
+	superlock_lock();
+	strcpy(__export_path, path);
+	__export_deadline = now_ns();
+	__export_interval = interval_ms;
+	superlock_unlock();
+	return 0;
+}
+
+/* starts recording scheduler events in one ring per worker of events
+ * entries (rounded up to a power of two, MYTHREAD_TRACE_EVENTS if 0),
+ * when a ring is full its oldest events are overwritten
+ * the rings are allocated by the first call, later calls only clear them,
+ * so a thread recording while tracing is restarted never writes to freed
+ * memory
+ * it returns 0, ENOMEM or EINVAL if mythread_init was not called
+ */
+int mythread_trace_start(unsigned long events) {
+	unsigned long size = 1;
+	int i;
+	if(!__nworkers)
+		return EINVAL;
+	__tracing = 0;
+	if(!events)
+		events = MYTHREAD_TRACE_EVENTS;
+	while(size < events)
+		size <<= 1;
+	for(i = 0; i < __nworkers; i++) {
+		if(!__trace[i].events) {
+			__trace[i].events = (struct mythread_trace_event *)malloc(size * sizeof(struct mythread_trace_event));
+			if(!__trace[i].events)
+				return ENOMEM;
+			__trace[i].mask = size - 1;
+		}
+		__trace[i].head = 0;
+	}
+	__trace_ns = now_ns();
+	__trace_tsc = trace_clock();
+	__tracing = 1;
+	trace(NULL, MYTHREAD_TRACE_SWITCH_IN, current_thread() ? current_thread()->id : 0, 0);
+	return 0;
+}
+
+/* stops recording, the recorded events stay until the next start
+ */
+void mythread_trace_stop(void) {
+	__tracing = 0;
+}
+
+/* writes event e as a json object of the chrome trace event format,
+ * a thread runs between its switch in and switch out (a duration event
+ * on the track of the thread) and all other events are instants, us is
+ * the number of microseconds of one tick of the time stamp counter
+ */
+static void trace_write(FILE *fp, struct mythread_trace_event *e, double us, int first) {
+	static const char *names[] = {"create", "run", "run", "block", "wake", "signal", "exit"};
+	static const char phases[] = "iBEiiii";
+	if(e->type > MYTHREAD_TRACE_EXIT)
+		return;
+	fprintf(fp, "%s\n{\"name\": \"%s\", \"ph\": \"%c\", %s\"pid\": %d, \"tid\": %lu, \"ts\": %.3f, "
+		"\"args\": {\"cpu\": %u, \"arg\": %lu}}", first ? "" : ",", names[e->type], phases[e->type],
+		phases[e->type] == 'i' ? "\"s\": \"t\", " : "", getpid(), e->thread,
+		(double)(e->ts - __trace_tsc) * us, e->cpu, e->arg);
+}
+
+/* writes the recorded events of all workers to path in the chrome trace
+ * event format, which chrome://tracing and the perfetto ui can open, the
+ * time stamps are converted to microseconds since the start of the trace
+ * by comparing the time stamp counter with the monotonic clock
+ * it is best called after mythread_trace_stop, events recorded while it
+ * runs may be missing
+ * it returns 0, EINVAL if nothing was traced or the errno of writing
+ */
+int mythread_trace_dump(const char *path) {
+	unsigned long i, start, head, tsc = trace_clock(), ns = now_ns();
+	double us = tsc > __trace_tsc ? (double)(ns - __trace_ns) / (tsc - __trace_tsc) / 1000 : 0;
+	struct mythread_trace_ring *r;
+	FILE *fp;
+	int w, first = 1;
+	if(!__trace[0].events)
+		return EINVAL;
+	if(!(fp = fopen(path, "w")))
+		return errno;
+	fprintf(fp, "{\"traceEvents\": [");
+	for(w = 0; w < __nworkers && __trace[w].events; w++) {
+		r = &__trace[w];
+		head = r->head;
+		start = head > r->mask ? head - r->mask - 1 : 0;
+		for(i = start; i < head; i++, first = 0)
+			trace_write(fp, &r->events[i & r->mask], us, first);
+	}
+	fprintf(fp, "\n]}\n");
+	if(fclose(fp) == EOF)
+		return errno;
+	return 0;
+}
+
+/* dumps the trace started by MYTHREAD_TRACE when the process exits
+ */
+static void trace_atexit(void) {
+	mythread_trace_stop();
+	mythread_trace_dump(__trace_path);
+}
+
+/* runs part (out of f->nparts parts) of the loop f, the chunks of a
+ * static loop are fixed in advance (blocks of grain iterations dealt round
+ * robin, or one equal block per part if grain is 0), the other schedules
+ * take chunks from f->next: dynamic ones always grain iterations, guided
+ * ones a share of the remaining iterations which shrinks down to grain
+ */
+static void for_run(struct mythread_for *f, int part) {
+	long lo, chunk, n;
+	long grain = f->grain > 0 ? f->grain : 1;
+	switch(f->schedule) {
+		case MYTHREAD_FOR_STATIC:
+			if(f->grain <= 0) {
+				n = f->end - f->begin;
+				lo = f->begin + n * part / f->nparts;
+				if(lo < f->begin + n * (part + 1) / f->nparts)
+					f->fn(lo, f->begin + n * (part + 1) / f->nparts, f->ctx);
+				break;
+			}
+			for(lo = f->begin + part * grain; lo < f->end; lo += f->nparts * grain)
+				f->fn(lo, lo + grain < f->end ? lo + grain : f->end, f->ctx);
+			break;
+		case MYTHREAD_FOR_GUIDED:
+			lo = __atomic_load_n(&f->next, __ATOMIC_RELAXED);
+			while(lo < f->end) {
+				chunk = (f->end - lo) / (2 * f->nparts);
+				if(chunk < grain)
+					chunk = grain;
+				if(__atomic_compare_exchange_n(&f->next, &lo, lo + chunk, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+					f->fn(lo, lo + chunk < f->end ? lo + chunk : f->end, f->ctx);
+					lo = __atomic_load_n(&f->next, __ATOMIC_RELAXED);
+				}
+			}
+			break;
+		default:
+			while((lo = __atomic_fetch_add(&f->next, grain, __ATOMIC_RELAXED)) < f->end)
+				f->fn(lo, lo + grain < f->end ? lo + grain : f->end, f->ctx);
+			break;
+	}
+}
+
+/* calls fn(lo, hi, ctx) for chunks [lo, hi) which together cover the
+ * iterations [begin, end), the chunks are run in parallel with the dynamic
+ * schedule (grain iterations at a time), it returns when all chunks are
+ * done, 0 on success and EINVAL for a wrong schedule
+ */
+int mythread_parallel_for(long begin, long end, long grain, void (*fn)(long, long, void *), void *ctx) {
+	return mythread_parallel_for_sched(begin, end, grain, MYTHREAD_FOR_DYNAMIC, fn, ctx);
+}
+
+/* a part of a parallel loop run by a thread
+ */
+struct for_part {
+	struct mythread_for *f;
+	int part;
+};
+
+static void *for_thread(void *arg) {
+	for_run(((struct for_part *)arg)->f, ((struct for_part *)arg)->part);
+	return NULL;
+}
+
+/* same as mythread_parallel_for with the given schedule, the loop is split
+ * in one part per worker, part 0 is run by the calling thread and every
+ * other part by a new thread (which the idle workers steal), if a thread
+ * can not be created its part is run by the calling thread too
+ */
+int mythread_parallel_for_sched(long begin, long end, long grain, int schedule, void (*fn)(long, long, void *), void *ctx) {
+	struct mythread_for f;
+	struct for_part parts[MAX_WORKERS];
+	mythread_t threads[MAX_WORKERS];
+	int i;
+	if(schedule != MYTHREAD_FOR_STATIC && schedule != MYTHREAD_FOR_DYNAMIC && schedule != MYTHREAD_FOR_GUIDED)
+		return EINVAL;
+	if(begin >= end)
+		return 0;
+	f.begin = f.next = begin;
+	f.end = end;
+	f.grain = grain;
+	f.schedule = schedule;
+	f.fn = fn;
+	f.ctx = ctx;
+	f.nparts = __nworkers > 0 ? __nworkers : 1;
+	for(i = 1; i < f.nparts; i++) {
+		parts[i].f = &f;
+		parts[i].part = i;
+		if(mythread_create(&threads[i], for_thread, &parts[i]) != 0)
+			threads[i] = 0;
+	}
+	for_run(&f, 0);
+	for(i = 1; i < f.nparts; i++) {
+		if(threads[i])
+			mythread_join(threads[i], NULL);
+		else
+			for_run(&f, i);
+	}
+	return 0;
+}
+
+/* initialises the mythread_spinlock_t pointed by lock
+ */
+int mythread_spin_init(mythread_spinlock_t *lock) {
+	lock->owner = lock->next = 0;
+	return 0;
+}
+
+/* counts the time since start in the lock wait time of the calling
+ * thread (read again at the end, it may have moved to another worker)
+ */
+static inline void lock_waited(unsigned long start) {
+	struct mythread_struct *t;
+	if(__nworkers && (t = current_thread()))
+		t->stats.lock_ns += now_ns() - start;
+}
+
+/* aquires the lock on mythread_spinlock_t pointed by lock,
+ * if the lock is already held by another thread, then it waits for its
+ * turn, lockers get the lock in the order in which they called this
+ */
+int mythread_spin_lock(mythread_spinlock_t *lock) {
+	unsigned long start;
+	if(!lock)
+		return EINVAL;
+	if(!ticket_trylock(lock)) {
+		start = now_ns();
+		ticket_lock(lock);
+		lock_waited(start);
+	}
+	return 0;
+}
+
+/* frees the mythread_spinlock_t pointed by lock
+ */
+int mythread_spin_unlock(mythread_spinlock_t *lock) {
+	if(!lock || lock->owner == lock->next)
+		return EINVAL;
+	ticket_unlock(lock);
+	return 0;
+}
+
+/* same as mythread_spin_lock with the difference that if the lock is
+ * held by some another thread, it returns immediately with the error
+ * number EBUSY
+ */
+int mythread_spin_trylock(mythread_spinlock_t *lock) {
+	if(!lock)
+		return EINVAL;
+	return ticket_trylock(lock) ? 0 : EBUSY;
+}
+
+/* initialises the mythread_mcslock_t pointed by lock
+ */
+int mythread_mcs_init(mythread_mcslock_t *lock) {
+	lock->tail = NULL;
+	return 0;
+}
+
+/* aquires lock using node, which must be owned by the caller until it
+ * unlocks, the caller links node behind the current tail and spins on
+ * node->locked until its predecessor hands the lock over, yielding the
+ * cpu if that takes long
+ */
+int mythread_mcs_lock(mythread_mcslock_t *lock, mythread_mcsnode_t *node) {
+	mythread_mcsnode_t *prev;
+	unsigned int spins = 0;
+	unsigned long start;
+	if(!lock || !node)
+		return EINVAL;
+	node->next = NULL;
+	node->locked = 1;
+	prev = __atomic_exchange_n(&lock->tail, node, __ATOMIC_ACQ_REL);
+	if(!prev)
+		return 0;
+	start = now_ns();
+	__atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+	while(__atomic_load_n(&node->locked, __ATOMIC_ACQUIRE))
+		if(++spins < MYTHREAD_SPIN_YIELD * MYTHREAD_SPIN_BACKOFF)
+			cpu_relax();
+		else
+			spin_yield();
+	lock_waited(start);
+	return 0;
+}
+
+/* releases lock, which must have been aquired with node, to the next
+ * waiter, if a waiter has swapped the tail but not linked itself yet
+ * it waits for the link
+ */
+int mythread_mcs_unlock(mythread_mcslock_t *lock, mythread_mcsnode_t *node) {
+	mythread_mcsnode_t *next, *expected = node;
+	if(!lock || !node || !lock->tail)
+		return EINVAL;
+	if(!(next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE))) {
+		if(__atomic_compare_exchange_n(&lock->tail, &expected, NULL, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+			return 0;
+		while(!(next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE)))
+			spin_yield();
+	}
+	__atomic_store_n(&next->locked, 0, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/* same as mythread_mcs_lock but returns EBUSY if the lock is held
+ */
+int mythread_mcs_trylock(mythread_mcslock_t *lock, mythread_mcsnode_t *node) {
+	mythread_mcsnode_t *expected = NULL;
+	if(!lock || !node)
+		return EINVAL;
+	node->next = NULL;
+	node->locked = 0;
+	return __atomic_compare_exchange_n(&lock->tail, &expected, node, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED) ? 0 : EBUSY;
+}
@@ -0,0 +1,302 @@
+/*
+ * Mythread C threading library
+ * This is an implementation of hybrid
+ * many-many (M:N) threads in C
+ *
+ */
+
+#ifndef MYTHREAD_H
+
+#define MYTHREAD_H
+#define MYTHREAD_MANY_MANY
+
+#include <signal.h>
+#include <stddef.h>
+#include <time.h>
+#include <sys/ucontext.h>
+
+#define STACK_SIZE (1024 * 1024)
+#define WORKER_STACK_SIZE (64 * 1024)
+#define MAX_WORKERS 64
+#define MYTHREAD_QUANTUM 10000		//default time slice in microseconds
+#define MYTHREAD_LIBC_RANGES 16		//executable segments of libc and the allocator in which ticks are skipped
+#define MYTHREAD_POOL_CAP 64		//default number of stacks and structures cached for reuse
+#define MYTHREAD_TABLE_CHUNK 1024		//slots in one chunk of the thread table
+#define MYTHREAD_TABLE_CHUNKS 4096		//chunks in the thread table, so 4M threads can be alive at once
+
+/* a waiter of a ticket spinlock pauses MYTHREAD_SPIN_BACKOFF times for
+ * every waiter ahead of it before it looks at the lock again, up to
+ * MYTHREAD_SPIN_BACKOFF_MAX times, and yields after MYTHREAD_SPIN_YIELD
+ * such rounds
+ */
+#define MYTHREAD_SPIN_BACKOFF 32
+#define MYTHREAD_SPIN_BACKOFF_MAX 4096
+#define MYTHREAD_SPIN_YIELD 8			//rounds of backoff after which a waiter yields the cpu
+
+/* schedules of mythread_parallel_for_sched, like the schedules of openmp
+ * a static loop gives every part fixed chunks, a dynamic one hands out
+ * chunks of grain iterations on demand and a guided one hands out chunks
+ * which shrink from 1 / (2 * parts) of the remaining iterations to grain
+ */
+#define MYTHREAD_FOR_STATIC 0
+#define MYTHREAD_FOR_DYNAMIC 1
+#define MYTHREAD_FOR_GUIDED 2
+
+/* kinds of events recorded by the tracer, thread is the thread the event
+ * happened to and arg depends on the kind
+ */
+#define MYTHREAD_TRACE_CREATE 0			//thread created the thread arg
+#define MYTHREAD_TRACE_SWITCH_IN 1		//thread was switched in
+#define MYTHREAD_TRACE_SWITCH_OUT 2		//thread was switched out, arg is 1 if it was preempted
+#define MYTHREAD_TRACE_BLOCK 3			//thread stopped being runnable, arg is the thread it joins (if any)
+#define MYTHREAD_TRACE_WAKE 4			//thread became runnable again
+#define MYTHREAD_TRACE_SIGNAL 5			//the signal arg was delivered to thread
+#define MYTHREAD_TRACE_EXIT 6			//thread terminated
+#define MYTHREAD_TRACE_EVENTS 65536		//default size of a ring of MYTHREAD_TRACE
+
+/* these defines denote various states that a thread can
+ * have, an enumeration of these values will be equally
+ * efficient
+ */
+#define THREAD_RUNNING 0x0		//thread has started but not terminated
+#define THREAD_NOT_STARTED 0x1	//thread not started
+#define THREAD_TERMINATED 0x2	//thread terminated
+#define THREAD_JOIN_CALLED 0x3	//some other thread called join on that thread
+#define THREAD_COLLECTED 0x4	//the thread is already collected by some thread
+#define THREAD_DETACHED 0x5		//thread is running and will never be joined
+
+/* mythread_t stores the index of the slot of the thread in the thread
+ * table (plus one, so that 0 is the main thread) in its low 32 bits and
+ * the generation of that slot in its high 32 bits
+ */
+typedef unsigned long int mythread_t;
+
+/* a ticket spinlock, a locker takes the next ticket and waits until
+ * owner reaches it, so the lock is handed over in fifo order
+ * it is unlocked when owner equals next
+ */
+typedef struct mythread_spinlock {
+	volatile unsigned short owner, next;
+} mythread_spinlock_t;
+
+/* a queued (mcs) spinlock, every locker passes its own node which is
+ * linked behind tail and spins only on the locked flag of that node,
+ * so waiters do not share a cache line with each other or the lock
+ * the node must stay valid until mythread_mcs_unlock has returned
+ */
+typedef struct mythread_mcsnode {
+	struct mythread_mcsnode *volatile next;
+	volatile int locked;
+} __attribute__((aligned(64))) mythread_mcsnode_t;
+
+typedef struct mythread_mcslock {
+	mythread_mcsnode_t *volatile tail;
+} mythread_mcslock_t;
+
+#define MYTHREAD_SPINLOCK_INITIALIZER {0, 0}
+#define MYTHREAD_MCSLOCK_INITIALIZER {NULL}
+
+/* attributes of a new thread, initialise them with mythread_attr_init
+ * a detached thread can not be joined, it is released when it exits
+ */
+typedef struct mythread_attr {
+	int detached;
+} mythread_attr_t;
+
+/* pending signals to a thread for which the handler will
+ * be activated once that thread comes in running on some
+ * worker, same as in many-one model
+ */
+struct pending_signal_node {
+	int sig;
+	struct pending_signal_node *next;
+};
+
+typedef struct pending_signals_queue {
+	struct pending_signal_node *head, *tail;
+} pending_signals_queue;
+
+/* counters of one thread, returned by mythread_stats
+ * run_ns is the time the thread has run and wait_ns the time it was
+ * runnable while no worker ran it, lock_ns the time it waited for
+ * spinlocks
+ * switches counts the times it was switched out, preempted those of them
+ * forced by the tick (the others were voluntary: it yielded or waited),
+ * signals counts the signals delivered to its handlers
+ */
+struct mythread_thread_stats {
+	mythread_t id;
+	int state;
+	unsigned long run_ns, wait_ns, lock_ns;
+	unsigned long switches, preempted;
+	unsigned long signals;
+};
+
+/* counters of the whole scheduler, returned by mythread_sched_stats
+ * switches, preemptions and idle_ns are summed over all workers, idle_ns
+ * is the time workers slept as no thread was runnable, threads and
+ * runnable are the numbers of threads which have not terminated and of
+ * those which are running or ready to run
+ */
+struct mythread_sched_stats {
+	unsigned long switches, preemptions;
+	unsigned long created, exited;
+	unsigned long idle_ns;
+	int threads, runnable;
+};
+
+/* a structure which will store information about one thread
+ * only
+ * it is the many-one structure with a few additions: the id of
+ * the thread (as there is no single active list any more), a link
+ * for the run queue of the worker which will run it and a pinned
+ * flag which keeps the main thread on the kernel thread which
+ * started the process (it is never stolen by other workers)
+ * exiting is set by a finished thread before it leaves its stack, the
+ * scheduler then marks it terminated
+ * the preemption depth is kept per thread and not per worker because
+ * a thread may continue on another worker after every switch
+ * ready is the time when the thread last became runnable and running the
+ * time when a worker last switched to it (0 while it is not running)
+ */
+struct mythread_struct {
+	volatile int state, exiting;
+	int pinned;
+	volatile int nopreempt;			//preemption disable depth, the tick is ignored while non zero
+	volatile int park;				//PARK_GOING or PARK_DONE while the thread is parked, see thread_park
+	struct mythread_struct *joiner;	//thread parked in mythread_join until this one terminates
+	mythread_t id;
+	void *(*fun)(void *);
+	void *args;
+	void *returnval;
+	__sighandler_t handlers[32];
+	ucontext_t thread_context;
+	pending_signals_queue pending_signals;
+	struct mythread_struct *next;
+	struct mythread_thread_stats stats;
+	unsigned long ready;
+	volatile unsigned long running;
+};
+
+/* a slot of the thread table, gen is increased every time the slot is
+ * freed and next links the free slots
+ */
+struct mythread_slot {
+	struct mythread_struct *thread;
+	volatile unsigned int gen;
+	int next;
+};
+
+/* a local run queue of a worker, it is a simple linked list of
+ * runnable threads guarded by its own lock, so workers only
+ * contend with each other while stealing
+ */
+struct mythread_runqueue {
+	mythread_spinlock_t lock;
+	volatile int len;
+	struct mythread_struct *head, *tail;
+};
+
+/* one worker is one kernel thread (the process itself for worker 0
+ * and a clone() for all others) which runs the scheduler loop and
+ * switches to green threads from its own run queue, stealing from
+ * other workers when its queue is empty
+ * self must stay the first member, the thread pointer of the kernel
+ * thread points to this structure
+ */
+struct mythread_worker {
+	struct mythread_worker *self;
+	int id, tid;
+	unsigned int seed;						//seed for choosing a random victim while stealing
+	struct mythread_struct *current;		//green thread currently running on this worker
+	struct mythread_runqueue rq;
+	ucontext_t sched_context;				//context of the scheduler loop of this worker
+	char *stack;
+	timer_t timer;							//timer which sends SIGALRM to this worker only
+	unsigned long switches, preemptions, idle_ns;	//counters of mythread_sched_stats
+};
+
+/* counters of the pool of stacks and thread structures, hits are
+ * allocations served from the pool and misses are those which needed
+ * malloc
+ */
+struct mythread_pool_stats {
+	unsigned long stack_hits, stack_misses;
+	unsigned long desc_hits, desc_misses;
+	int stacks, descs, cap;
+};
+
+/* an event of the tracer, ts is the time stamp counter of the cpu (the
+ * tsc on x86) and cpu the ring in which it was recorded
+ */
+struct mythread_trace_event {
+	unsigned long ts;
+	mythread_t thread;
+	unsigned long arg;
+	unsigned int type, cpu;
+};
+
+/* a ring of trace events, head counts all events ever recorded in it and
+ * the event number i is kept in events[i & mask], so the ring always
+ * holds the last mask + 1 events
+ */
+struct mythread_trace_ring {
+	volatile unsigned long head __attribute__((aligned(64)));
+	struct mythread_trace_event *events;
+	unsigned long mask;
+};
+
+/* a loop of mythread_parallel_for, shared by the parts which run it,
+ * next is the first iteration not given to any part yet
+ */
+struct mythread_for {
+	long begin, end, grain;
+	long next;
+	int schedule, nparts;
+	void (*fn)(long, long, void *);
+	void *ctx;
+};
+
+/* static functions are not included/declared in header
+ */
+void __mythread_wrapper(int ind);
+struct mythread_struct *__mythread_fill(void *(*fun)(void *), void *args);
+
+/* the information about various functions is written in mythread.c
+ * file
+ * still, the functions mythread_xyz are similar in functioning
+ * to pthread_xyz
+ */
+void mythread_init(void);
+int mythread_create(mythread_t *mythread, void *(*fun)(void *), void *args);
+int mythread_create_attr(mythread_t *mythread, const mythread_attr_t *attr, void *(*fun)(void *), void *args);
+int mythread_attr_init(mythread_attr_t *attr);
+int mythread_attr_setdetached(mythread_attr_t *attr, int detached);
+int mythread_join(mythread_t mythread, void **returnval);
+int mythread_detach(mythread_t mythread);
+int mythread_kill(mythread_t mythread, int sig);
+void mythread_exit(void *returnval);
+__sighandler_t set_active_thread_signal(int signum, __sighandler_t handler);
+mythread_t mythread_self(void);
+int mythread_yield(void);
+int mythread_workers(void);
+int mythread_pool_setcap(int cap);
+void mythread_pool_getstats(struct mythread_pool_stats *stats);
+int mythread_stats(mythread_t mythread, struct mythread_thread_stats *stats);
+void mythread_sched_stats(struct mythread_sched_stats *stats);
+int mythread_stats_export(const char *path, long interval_ms);
+int mythread_trace_start(unsigned long events);
+void mythread_trace_stop(void);
+int mythread_trace_dump(const char *path);
+int mythread_parallel_for(long begin, long end, long grain, void (*fn)(long, long, void *), void *ctx);
+int mythread_parallel_for_sched(long begin, long end, long grain, int schedule, void (*fn)(long, long, void *), void *ctx);
+int mythread_spin_init(mythread_spinlock_t *lock);
+int mythread_spin_lock(mythread_spinlock_t *lock);
+int mythread_spin_unlock(mythread_spinlock_t *lock);
+int mythread_spin_trylock(mythread_spinlock_t *lock);
+int mythread_mcs_init(mythread_mcslock_t *lock);
+int mythread_mcs_lock(mythread_mcslock_t *lock, mythread_mcsnode_t *node);
+int mythread_mcs_unlock(mythread_mcslock_t *lock, mythread_mcsnode_t *node);
+int mythread_mcs_trylock(mythread_mcslock_t *lock, mythread_mcsnode_t *node);
+
+#endif
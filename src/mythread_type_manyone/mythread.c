@@ -2,89 +2,509 @@
 #define _GNU_SOURCE
 #endif
 
+#include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <signal.h>
 #include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
 #include <ucontext.h>
+#include <link.h>
+#include <sys/epoll.h>
 #include "mythread.h"
 
-/* a 2d array of pointers which will store addresses of all malloced 
- * thread structures during creating of threads
+/* the table of all threads, it is a two level array of slots which never
+ * moves: a chunk of MYTHREAD_TABLE_CHUNK slots is allocated only when all
+ * slots before it are in use and slots of collected threads are reused
+ * through a free list linked by slot index
+ * mythread_t keeps the index of the slot plus one in its low 32 bits (0 is
+ * the main thread) and the generation of the slot in its high 32 bits, the
+ * generation changes every time the slot is freed so an old id of a reused
+ * slot is rejected
  */
-static struct mythread_struct **__allthreads[16] = {0};
-static ucontext_t maincontext;				//context of main thread (main function)
-static int __ind = 0, __current = 0;		//counter of total threads and index of current thread in the 2d array
-static struct active_thread_node *active = NULL, *mainthread = NULL, *previous = NULL, *last = NULL;
-											//pointers to main thread active node, thread node currently in action
-											//thread previously in action (to change pointers), the last thread in the list
-static volatile int superlock = 0;			//a superlock for locking during changing some delicate data structures (used internally)
+static struct mythread_slot *__table[MYTHREAD_TABLE_CHUNKS];
+static int __table_size = 0, __table_free = -1;	//number of slots ever used and first free slot
+static struct mythread_context maincontext;	//context of main thread (main function)
+static sigset_t __sigmask;					//signal mask of the running thread as last seen by the library
+static int __current = 0;					//number of active threads (including main thread)
+static struct active_thread_node *active = NULL, *mainthread = NULL;
+											//thread node currently in action and main thread active node
+static struct active_thread_node **__runq = NULL;	//min heap of the runnable threads (except active) ordered by vruntime
+static int __runq_len = 0, __runq_cap = 0;
+static unsigned long __min_vruntime = 0;		//never decreasing minimum vruntime, new threads start from it
+static unsigned long __slice_start = 0;		//time when active was switched in
+static timer_t __timer;						//monotonic timer which sends SIGALRM to preempt the active thread
+static long __quantum = MYTHREAD_QUANTUM;		//time slice in microseconds (target latency in adaptive mode)
+static int __adaptive = 0;					//if non zero the slice is shortened when more threads are runnable
+static long __armed = 0;					//interval the timer is currently armed with, 0 if stopped
+static int __cooperative = 0;				//if non zero there is no timer, threads switch only when they yield or block
+static int __epfd = -1;						//epoll instance of the netpoller, created on first use
+static struct mythread_pollfd *__pollfds = NULL;	//netpoller state of file descriptors, indexed by fd
+static int __npollfds = 0, __npollers = 0;		//size of __pollfds and number of threads parked on i/o
+static struct active_thread_node *__wheel0[1 << MYTHREAD_WHEEL_BITS0];	//first level of the timer wheel, one slot per tick
+static struct active_thread_node *__wheel[MYTHREAD_WHEEL_LEVELS - 1][1 << MYTHREAD_WHEEL_BITS];	//higher levels
+static unsigned long __wheel_tick = 0;			//tick whose slot is due next, all earlier ones are done
+static int __ntimeouts = 0;					//parked threads with a timeout in the wheel
+static unsigned int __chan_selectrr = 0;		//first case tried by the next select
+static struct mythread_thread_stats __mainstats;	//counters of the main thread, which has no mythread_struct
+static struct mythread_sched_stats __stats;		//counters of the scheduler (threads and runnable are computed)
+static char __export_path[256];				//file written by the exporter thread
+static long __export_interval = 0;			//milliseconds between two snapshots, 0 if the export is stopped
+static int __exporting = 0;					//non zero while the exporter thread exists
+static struct mythread_struct *__reap = NULL;	//detached thread which has exited, released once its stack is left
+static struct mythread_trace_ring __trace;		//events of the tracer, there is only one cpu to record them on
+static volatile int __tracing = 0;			//non zero while events are recorded
+static unsigned long __trace_tsc, __trace_ns;	//time stamp counter and monotonic time when the trace started
+static char __trace_path[256];				//file the trace is dumped to at exit (MYTHREAD_TRACE)
+
+/* weights of the priorities MYTHREAD_PRIO_HIGHEST to MYTHREAD_PRIO_LOWEST,
+ * as for nice values every step is about 1.25 times the cpu share of the
+ * next one, the default priority 0 has weight 1024
+ */
+static const unsigned int prio_to_weight[40] = {
+	88761, 71755, 56483, 46273, 36291,
+	29154, 23254, 18705, 14949, 11916,
+	9548, 7620, 6100, 4904, 3906,
+	3121, 2501, 1991, 1586, 1277,
+	1024, 820, 655, 526, 423,
+	335, 272, 215, 172, 137,
+	110, 87, 70, 56, 45,
+	36, 29, 23, 18, 15
+};
+static mythread_spinlock_t superlock = MYTHREAD_SPINLOCK_INITIALIZER;	//a superlock for locking during changing some delicate data structures (used internally)
+static volatile int __resched = 0;			//set by a tick which found the superlock held, its holder schedules on unlock
 static sighandler_t def_sig_handlers[32], mainthread_sig_handlers[32], sigdfls[32];
 											//there 32 signals defined as per GNU, so these pointers will store
 											//pointers to default handlers, handlers set by main thread etc
+static struct {
+	unsigned long start, end;
+} __libc_text[MYTHREAD_LIBC_RANGES];		//code of libc and the allocator, a tick there does not switch
+static int __nlibc_text = 0;
+
+/* a bounded cache of stacks and thread structures of collected threads,
+ * new threads take them from here before calling malloc
+ * both lists are linked through the first word of the cached memory and
+ * are guarded by the superlock
+ */
+static struct {
+	void *stacks, *descs;
+	int nstacks, ndescs, cap;
+	unsigned long stack_hits, stack_misses, desc_hits, desc_misses;
+} __pool = {NULL, NULL, 0, 0, MYTHREAD_POOL_CAP, 0, 0, 0, 0};
+
+/* spins one round, pause tells the cpu that this is a busy wait loop, so
+ * it does not fill its pipeline with loads of the lock and leaves the
+ * core to the other hyperthread
+ */
+static inline void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+	__asm__ volatile("pause" ::: "memory");
+#elif defined(__aarch64__)
+	__asm__ volatile("yield" ::: "memory");
+#else
+	__asm__ volatile("" ::: "memory");
+#endif
+}
+
+/* gives the cpu away while a ticket lock is still not ours after
+ * MYTHREAD_SPIN_YIELD rounds, on one kernel thread the holder can only
+ * release the lock if it gets to run (the superlock is never waited on,
+ * the tick only tries it)
+ */
+static inline void spin_yield(void) {
+	mythread_yield();
+}
+
+/* the ticket lock behind mythread_spinlock_t and the superlock
+ * a waiter backs off in proportion to its distance from the owner, so
+ * the waiters do not all hammer the lock line at every handover
+ */
+static inline void ticket_lock(mythread_spinlock_t *lock) {
+	unsigned short ticket = __atomic_fetch_add(&lock->next, 1, __ATOMIC_RELAXED), owner;
+	unsigned int i, delay, rounds = 0;
+	while((owner = __atomic_load_n(&lock->owner, __ATOMIC_ACQUIRE)) != ticket) {
+		if(++rounds > MYTHREAD_SPIN_YIELD) {
+			spin_yield();
+			continue;
+		}
+		delay = (unsigned short)(ticket - owner) * MYTHREAD_SPIN_BACKOFF;
+		if(delay > MYTHREAD_SPIN_BACKOFF_MAX)
+			delay = MYTHREAD_SPIN_BACKOFF_MAX;
+		for(i = 0; i < delay; i++)
+			cpu_relax();
+	}
+}
+
+/* takes a ticket only if it is served right away, owner can not move
+ * past next, so if next is still the observed owner the lock is ours
+ */
+static inline int ticket_trylock(mythread_spinlock_t *lock) {
+	unsigned short owner = __atomic_load_n(&lock->owner, __ATOMIC_ACQUIRE);
+	return __atomic_compare_exchange_n(&lock->next, &owner, owner + 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+static inline void ticket_unlock(mythread_spinlock_t *lock) {
+	__atomic_store_n(&lock->owner, lock->owner + 1, __ATOMIC_RELEASE);
+}
 
 /* a static lock which will only be used internally by thread functions
  * this function locks the lock
  */
 static inline void superlock_lock() {
-	while(__sync_lock_test_and_set(&superlock, 1));
+	ticket_lock(&superlock);
 }
 
+static void schedule(int yield);
+
 /* unlocks the static superlock 
+ * a tick which came while it was held could not switch threads, so the
+ * switch it wanted is made now instead of being lost (a tick after the
+ * unlock takes the lock itself, so none is missed in between)
  */
 static inline void superlock_unlock() {
-	__sync_synchronize();
-	superlock = 0;
+	ticket_unlock(&superlock);
+	if(__builtin_expect(__resched, 0)) {
+		__resched = 0;
+		schedule(0);
+	}
 }
 
-/* similar like pthread_spin_trylock
+/* similar like pthread_spin_trylock, used by the tick which must never
+ * wait for the lock (it may have interrupted its holder, see __resched)
  */
 static inline short int superlock_trylock() {
-	return !__sync_lock_test_and_set(&superlock, 1);
+	return ticket_trylock(&superlock);
+}
+
+/* the context switch routine, __mythread_switch(from, to) pushes the
+ * callee saved registers (and the floating point control words) on the
+ * current stack, stores the stack pointer in *from, loads to as the stack
+ * pointer and pops the registers of the other thread from it
+ * everything else is saved by the caller as for any function call, so
+ * unlike swapcontext there is no system call for the signal mask
+ * a new thread starts in __mythread_trampoline which calls the function
+ * in rbx/x19 with the argument in r12/x20
+ */
+#if defined(__x86_64__)
+__asm__(
+	".pushsection .text\n"
+	".globl __mythread_switch\n"
+	".type __mythread_switch, @function\n"
+	"__mythread_switch:\n"
+	"	pushq %rbp\n"
+	"	pushq %rbx\n"
+	"	pushq %r12\n"
+	"	pushq %r13\n"
+	"	pushq %r14\n"
+	"	pushq %r15\n"
+	"	subq $8, %rsp\n"
+	"	stmxcsr (%rsp)\n"
+	"	fnstcw 4(%rsp)\n"
+	"	movq %rsp, (%rdi)\n"
+	"	movq %rsi, %rsp\n"
+	"	ldmxcsr (%rsp)\n"
+	"	fldcw 4(%rsp)\n"
+	"	addq $8, %rsp\n"
+	"	popq %r15\n"
+	"	popq %r14\n"
+	"	popq %r13\n"
+	"	popq %r12\n"
+	"	popq %rbx\n"
+	"	popq %rbp\n"
+	"	ret\n"
+	".size __mythread_switch, .-__mythread_switch\n"
+	".globl __mythread_trampoline\n"
+	".type __mythread_trampoline, @function\n"
+	"__mythread_trampoline:\n"
+	"	movq %r12, %rdi\n"
+	"	callq *%rbx\n"
+	"	ud2\n"
+	".size __mythread_trampoline, .-__mythread_trampoline\n"
+	".popsection\n"
+);
+#elif defined(__aarch64__)
+__asm__(
+	".pushsection .text\n"
+	".globl __mythread_switch\n"
+	".type __mythread_switch, %function\n"
+	"__mythread_switch:\n"
+	"	sub sp, sp, #176\n"
+	"	stp x19, x20, [sp, #0]\n"
+	"	stp x21, x22, [sp, #16]\n"
+	"	stp x23, x24, [sp, #32]\n"
+	"	stp x25, x26, [sp, #48]\n"
+	"	stp x27, x28, [sp, #64]\n"
+	"	stp x29, x30, [sp, #80]\n"
+	"	stp d8, d9, [sp, #96]\n"
+	"	stp d10, d11, [sp, #112]\n"
+	"	stp d12, d13, [sp, #128]\n"
+	"	stp d14, d15, [sp, #144]\n"
+	"	mrs x9, fpcr\n"
+	"	str x9, [sp, #160]\n"
+	"	mov x9, sp\n"
+	"	str x9, [x0]\n"
+	"	mov sp, x1\n"
+	"	ldp x19, x20, [sp, #0]\n"
+	"	ldp x21, x22, [sp, #16]\n"
+	"	ldp x23, x24, [sp, #32]\n"
+	"	ldp x25, x26, [sp, #48]\n"
+	"	ldp x27, x28, [sp, #64]\n"
+	"	ldp x29, x30, [sp, #80]\n"
+	"	ldp d8, d9, [sp, #96]\n"
+	"	ldp d10, d11, [sp, #112]\n"
+	"	ldp d12, d13, [sp, #128]\n"
+	"	ldp d14, d15, [sp, #144]\n"
+	"	ldr x9, [sp, #160]\n"
+	"	msr fpcr, x9\n"
+	"	add sp, sp, #176\n"
+	"	ret\n"
+	".size __mythread_switch, .-__mythread_switch\n"
+	".globl __mythread_trampoline\n"
+	".type __mythread_trampoline, %function\n"
+	"__mythread_trampoline:\n"
+	"	mov x0, x20\n"
+	"	blr x19\n"
+	"	brk #0\n"
+	".size __mythread_trampoline, .-__mythread_trampoline\n"
+	".popsection\n"
+);
+#endif
+
+/* prepares context c so that switching to it calls fun(arg) on the given
+ * stack, the frame built here is the one __mythread_switch pops
+ * fun must never return, it switches away at its end
+ */
+void __mythread_context_make(struct mythread_context *c, void *stack, size_t size, void (*fun)(int), int arg) {
+	sigprocmask(SIG_SETMASK, NULL, &c->mask);
+#if defined(__x86_64__)
+	unsigned long *sp = (unsigned long *)(((unsigned long)stack + size) & ~15UL) - 10;
+	memset(sp, 0, 10 * sizeof(unsigned long));
+	sp[0] = 0x1f80 | (0x037fUL << 32);	//default mxcsr and x87 control word
+	sp[4] = arg;						//r12
+	sp[5] = (unsigned long)fun;			//rbx
+	sp[7] = (unsigned long)__mythread_trampoline;
+	c->sp = sp;
+#elif defined(__aarch64__)
+	unsigned long *sp = (unsigned long *)(((unsigned long)stack + size) & ~15UL) - 22;
+	memset(sp, 0, 22 * sizeof(unsigned long));
+	sp[0] = (unsigned long)fun;			//x19
+	sp[1] = arg;						//x20
+	sp[11] = (unsigned long)__mythread_trampoline;	//x30
+	c->sp = sp;
+#else
+	getcontext(&c->uc);
+	c->uc.uc_stack.ss_sp = stack;
+	c->uc.uc_stack.ss_size = size;
+	c->uc.uc_link = NULL;
+	makecontext(&c->uc, (void (*)())fun, 1, arg);
+#endif
+}
+
+/* saves the running thread in from and continues the thread saved in to
+ * the signal mask is changed only if the two threads have different
+ * masks, __sigmask must hold the current mask: it is taken from the
+ * signal frame on every tick and kept up to date by the switches, so a
+ * thread which changes its mask with sigprocmask keeps it from the next
+ * tick on
+ * only the first _NSIG bits of a sigset_t are used by the kernel (the rest
+ * of the sigset_t in a signal frame is not a part of the mask)
+ */
+void __mythread_context_switch(struct mythread_context *from, struct mythread_context *to) {
+#ifdef MYTHREAD_FAST_SWITCH
+	from->mask = __sigmask;
+	if(memcmp(&to->mask, &__sigmask, _NSIG / 8)) {
+		sigprocmask(SIG_SETMASK, &to->mask, NULL);
+		__sigmask = to->mask;
+	}
+	__mythread_switch(&from->sp, to->sp);
+#else
+	swapcontext(&from->uc, &to->uc);
+#endif
+}
+
+/* returns the slot with index ind
+ */
+static inline struct mythread_slot *table_slot(unsigned long ind) {
+	return &__table[ind / MYTHREAD_TABLE_CHUNK][ind % MYTHREAD_TABLE_CHUNK];
+}
+
+/* finds the thread with id mythread, it returns NULL if there is no such
+ * thread or it is already collected
+ * lookups only read the table (which never moves), so no lock is taken
+ * the thread is loaded before the generation is checked, both with
+ * acquire paired with the release stores of table_alloc and table_free,
+ * so a thread which got the slot after the old id was freed is never
+ * returned for it
+ */
+static inline struct mythread_struct *table_lookup(mythread_t mythread) {
+	unsigned long ind = (mythread & 0xffffffffUL) - 1;
+	struct mythread_slot *s;
+	struct mythread_struct *t;
+	if(ind >= (unsigned long)__atomic_load_n(&__table_size, __ATOMIC_ACQUIRE))
+		return NULL;
+	s = table_slot(ind);
+	t = __atomic_load_n(&s->thread, __ATOMIC_ACQUIRE);
+	if(__atomic_load_n(&s->gen, __ATOMIC_ACQUIRE) != (unsigned int)(mythread >> 32))
+		return NULL;
+	return t;
 }
 
-/* adds a signal to a pending signal queue by creating a node containing
- * signal number of the signal and adding it to the queue at the end
+/* gives a slot (a freed one if possible) to thread t and sets its id,
+ * it returns -1 if the table is full
+ * called with superlock held
  */
-static void addsignal(pending_signals_queue *q, int sig) {
-	if(q->head) {
-		q->tail->next = (struct pending_signal_node *)malloc(sizeof(struct pending_signal_node));
-		q->tail->next->sig = sig;
-		q->tail->next->next = NULL;
-		q->tail = q->tail->next;
+static int table_alloc(struct mythread_struct *t) {
+	int ind;
+	struct mythread_slot *s, *chunk;
+	if(__table_free != -1) {
+		ind = __table_free;
+		s = table_slot(ind);
+		__table_free = s->next;
 	}
 	else {
-		q->head = q->tail = (struct pending_signal_node *)malloc(sizeof(struct pending_signal_node));
-		q->head->sig = sig;
-		q->head->next = NULL;
+		ind = __table_size;
+		if(ind >= MYTHREAD_TABLE_CHUNK * MYTHREAD_TABLE_CHUNKS)
+			return -1;
+		if(!__table[ind / MYTHREAD_TABLE_CHUNK]) {
+			chunk = (struct mythread_slot *)calloc(MYTHREAD_TABLE_CHUNK, sizeof(struct mythread_slot));
+			if(!chunk)
+				return -1;
+			__table[ind / MYTHREAD_TABLE_CHUNK] = chunk;
+		}
+		s = table_slot(ind);
+		__atomic_store_n(&__table_size, ind + 1, __ATOMIC_RELEASE);
+	}
+	t->id = ((mythread_t)s->gen << 32) | (ind + 1);
+	__atomic_store_n(&s->thread, t, __ATOMIC_RELEASE);
+	return ind;
+}
+
+/* frees the slot of thread t, its id is not valid any more
+ * called with superlock held
+ */
+static void table_free(struct mythread_struct *t) {
+	int ind = (t->id & 0xffffffffUL) - 1;
+	struct mythread_slot *s = table_slot(ind);
+	__atomic_store_n(&s->gen, s->gen + 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&s->thread, NULL, __ATOMIC_RELEASE);
+	s->next = __table_free;
+	__table_free = ind;
+}
+
+/* takes a block from the cache list *list or mallocs a new one of given size
+ * the hit and miss counters of the list are updated
+ */
+static void *pool_get(void **list, int *n, unsigned long *hits, unsigned long *misses, size_t size) {
+	void *p = *list;
+	if(!p) {
+		(*misses)++;
+		return malloc(size);
+	}
+	*list = *(void **)p;
+	(*n)--;
+	(*hits)++;
+	return p;
+}
+
+/* gives a block back to the cache list *list, it is freed if the list
+ * is already full
+ */
+static void pool_put(void **list, int *n, void *p) {
+	if(*n >= __pool.cap) {
+		free(p);
+		return;
 	}
+	*(void **)p = *list;
+	*list = p;
+	(*n)++;
+}
+
+/* gives the stack and the structure of a collected thread back to the pool
+ * and frees its slot, so the thread id can not be used any more
+ * called with superlock held
+ */
+static void release_thread(struct mythread_struct *t) {
+	table_free(t);
+	pool_put(&__pool.stacks, &__pool.nstacks, t->stack);
+	pool_put(&__pool.descs, &__pool.ndescs, t);
+}
+
+/* returns the monotonic time in nanoseconds
+ */
+static inline unsigned long now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+/* reads the time stamp counter of the cpu, which is much cheaper than
+ * clock_gettime, it is converted to time only when the trace is dumped
+ */
+static inline unsigned long trace_clock() {
+#if defined(__x86_64__) || defined(__i386__)
+	unsigned int lo, hi;
+	__asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+	return ((unsigned long)hi << 32) | lo;
+#elif defined(__aarch64__)
+	unsigned long t;
+	__asm__ volatile("mrs %0, cntvct_el0" : "=r"(t));
+	return t;
+#else
+	return now_ns();
+#endif
+}
+
+/* records an event in the ring, the slot is claimed with an atomic add
+ * on head, so a signal handler recording in between takes the next slot
+ * and no lock is needed
+ */
+static void trace_record(unsigned int type, mythread_t thread, unsigned long arg) {
+	unsigned long i = __atomic_fetch_add(&__trace.head, 1, __ATOMIC_RELAXED);
+	struct mythread_trace_event *e = &__trace.events[i & __trace.mask];
+	e->ts = trace_clock();
+	e->thread = thread;
+	e->arg = arg;
+	e->type = type;
+	e->cpu = 0;
+}
+
+/* records an event if tracing is on, while it is off this is a single
+ * well predicted branch
+ */
+static inline void trace(unsigned int type, mythread_t thread, unsigned long arg) {
+	if(__builtin_expect(__tracing, 0))
+		trace_record(type, thread, arg);
+}
+
+/* calls the handler of the active thread for signal sig, the handlers f
+ * of the thread are passed by the caller
+ * if that thread later set its handler for a certain signal as SIG_DFL
+ * then it also activates the default signal handler for that signal
+ * it returns -1 if there is no function to call (the handler is SIG_DFL
+ * and so was the handler of the process)
+ */
+static int deliver_signal(sighandler_t *f, int sig) {
+	sighandler_t h = f[sig] == SIG_DFL ? sigdfls[sig] : f[sig];
+	if(h == SIG_IGN)
+		return 0;
+	if(h == SIG_DFL || h == SIG_ERR)
+		return -1;
+	active->stats->signals++;
+	trace(MYTHREAD_TRACE_SIGNAL, active->thread, sig);
+	h(sig);
+	return 0;
 }
 
 /* a common signal handlers which will be activated when a 
  * signal occures and then it intelligently determines which thread is 
  * currently in action and activates the signal handler set by that 
  * thread 
- * if that thread later set its handler for a certain signal as SIG_DFL
- * then it also activates the default signal handler for that signal
  */
 static void common_signal_handler(int sig) {
-	int thread, cur, locind;
-	thread = active->thread - 1;
-	cur = thread / 16;
-	locind = thread % 16;
-	if(thread == -1) {
-		if(mainthread_sig_handlers[sig] == SIG_DFL)
-			sigdfls[sig](sig);
-		else
-			mainthread_sig_handlers[sig](sig);
-	}
-	else {
-		if(__allthreads[cur][locind]->handlers[sig] == SIG_DFL)
-			sigdfls[sig](sig);
-		else
-			__allthreads[cur][locind]->handlers[sig](sig);
-	}
+	struct mythread_struct *t = table_lookup(active->thread);
+	deliver_signal(t ? t->handlers : mainthread_sig_handlers, sig);
 }
 
 /* the program using this library for multi threading should call
@@ -94,20 +514,18 @@ static void common_signal_handler(int sig) {
  */
 sighandler_t set_active_thread_signal(int signum, sighandler_t handler) {
 	sighandler_t *f, dflt;
-	int cur, locind, thread;
+	struct mythread_struct *t;
 	if(signum >= 32) 
 		return SIG_ERR;
 	superlock_lock();
-	if(active->thread == 0) 
-		f = mainthread_sig_handlers;
-	else {
-		thread = active->thread - 1;
-		cur = thread / 16;
-		locind = thread % 16;
-		f = __allthreads[cur][locind]->handlers;
+	t = table_lookup(active->thread);
+	f = t ? t->handlers : mainthread_sig_handlers;
+	if(f[signum] == SIG_DFL || f[signum] == SIG_IGN) {
+		dflt = signal(signum, common_signal_handler);
+		if(dflt != common_signal_handler)	//another thread set a handler already
+			sigdfls[signum] = dflt;
+		dflt = sigdfls[signum];
 	}
-	if(f[signum] == SIG_DFL || f[signum] == SIG_IGN) 
-		dflt = sigdfls[signum] = signal(signum, common_signal_handler);
 	else
 		dflt = f[signum];
 	f[signum] = handler;
@@ -116,125 +534,730 @@ sighandler_t set_active_thread_signal(int signum, sighandler_t handler) {
 }
 
 /* this function when called determines the active thread and then 
- * checks if there are any pending signals to that thread by checking 
- * data structures (pending_signals_queue) and finally raises those
- * signals so that any handler (set manually or default) will get 
- * activated
+ * takes all signals pending to that thread from its mask at once and
+ * calls their handlers directly, lowest signal number first
+ * only a signal without any handler (whose default action is taken by
+ * the kernel) is raised
  */
 static void handle_pending_signals() {
-	int thread, cur, locind;
-	thread = active->thread - 1;
-	cur = thread / 16;
-	locind = thread % 16;
-	struct pending_signal_node *node, *previous;
-	if(thread == -1)
+	struct mythread_struct *t = table_lookup(active->thread);
+	unsigned int pending;
+	int sig;
+	if(!t || !t->pending)
+		return;
+	pending = __atomic_exchange_n(&t->pending, 0, __ATOMIC_ACQUIRE);
+	while(pending) {
+		sig = __builtin_ctz(pending);
+		pending &= pending - 1;
+		if(deliver_signal(t->handlers, sig) == -1)
+			raise(sig);
+	}
+}
+
+/* arms the preemption timer for the current number of runnable threads,
+ * the timer is stopped while only one thread is runnable and no thread
+ * waits for i/o or a timeout (the netpoller and the timeouts are checked
+ * on ticks)
+ * in adaptive mode the quantum is a target latency shared by all runnable
+ * threads, so the slice is quantum / runnable but not less than
+ * MYTHREAD_MIN_SLICE
+ * the timer is only changed when the slice changes
+ * called with superlock held
+ */
+static void timer_update() {
+	struct itimerspec its;
+	int runnable = __runq_len + 1;
+	long slice = __quantum;
+	if(__cooperative)
+		return;
+	if(runnable == 1 && !__npollers && !__ntimeouts)
+		slice = 0;
+	else if(__adaptive) {
+		slice = __quantum / runnable;
+		if(slice < MYTHREAD_MIN_SLICE)
+			slice = MYTHREAD_MIN_SLICE;
+	}
+	if(slice == __armed)
+		return;
+	__armed = slice;
+	its.it_value.tv_sec = its.it_interval.tv_sec = slice / 1000000;
+	its.it_value.tv_nsec = its.it_interval.tv_nsec = (slice % 1000000) * 1000;
+	timer_settime(__timer, 0, &its, NULL);
+}
+
+/* the run queue is a binary min heap of active thread nodes ordered by
+ * vruntime, the thread which got the least cpu time (scaled by its weight)
+ * is at the top
+ * every node in the heap keeps its index in runqi, so a given node is
+ * found (and taken out) without a scan
+ * all runq functions are called with superlock held
+ */
+static inline void runq_set(int i, struct active_thread_node *node) {
+	__runq[i] = node;
+	node->runqi = i;
+}
+
+static void runq_push(struct active_thread_node *node) {
+	int i = __runq_len++, parent;
+	while(i > 0) {
+		parent = (i - 1) / 2;
+		if(__runq[parent]->vruntime <= node->vruntime)
+			break;
+		runq_set(i, __runq[parent]);
+		i = parent;
+	}
+	runq_set(i, node);
+}
+
+/* takes the thread at index i out of the run queue, the last thread of
+ * the heap fills the hole and moves up or down to its place
+ */
+static struct active_thread_node *runq_take(int i) {
+	struct active_thread_node *taken = __runq[i], *node = __runq[--__runq_len];
+	int child, parent;
+	if(i == __runq_len)
+		return taken;
+	while(i > 0) {
+		parent = (i - 1) / 2;
+		if(__runq[parent]->vruntime <= node->vruntime)
+			break;
+		runq_set(i, __runq[parent]);
+		i = parent;
+	}
+	while((child = 2 * i + 1) < __runq_len) {
+		if(child + 1 < __runq_len && __runq[child + 1]->vruntime < __runq[child]->vruntime)
+			child++;
+		if(node->vruntime <= __runq[child]->vruntime)
+			break;
+		runq_set(i, __runq[child]);
+		i = child;
+	}
+	runq_set(i, node);
+	return taken;
+}
+
+/* returns the index of node in the run queue, or -1 if it is not in it
+ * (runqi of a node out of the heap is stale, so the slot is checked)
+ */
+static inline int runq_index(struct active_thread_node *node) {
+	int i = node->runqi;
+	return i >= 0 && i < __runq_len && __runq[i] == node ? i : -1;
+}
+
+static struct active_thread_node *runq_pop() {
+	return runq_take(0);
+}
+
+/* makes room in the run queue for one more thread, so that all active
+ * threads always fit in it, it returns -1 if there is no memory
+ */
+static int runq_reserve() {
+	struct active_thread_node **q;
+	int cap;
+	if(__current < __runq_cap)
+		return 0;
+	cap = __runq_cap ? 2 * __runq_cap : 16;
+	q = (struct active_thread_node **)realloc(__runq, cap * sizeof(struct active_thread_node *));
+	if(!q)
+		return -1;
+	__runq = q;
+	__runq_cap = cap;
+	return 0;
+}
+
+/* charges the time active has run since it was switched in to its
+ * vruntime, scaled by its weight so that threads of higher priority age
+ * slower and get a larger share of cpu
+ * it also moves the minimum vruntime forward and counts the time in the
+ * run time of active
+ */
+static void update_vruntime() {
+	unsigned long t = now_ns(), min;
+	active->vruntime += (t - __slice_start) * prio_to_weight[MYTHREAD_PRIO_DEFAULT - MYTHREAD_PRIO_HIGHEST] / active->weight;
+	active->stats->run_ns += t - __slice_start;
+	__slice_start = t;
+	min = active->vruntime;
+	if(__runq_len && __runq[0]->vruntime < min)
+		min = __runq[0]->vruntime;
+	if(min > __min_vruntime)
+		__min_vruntime = min;
+}
+
+/* switches from active to next, called with superlock held
+ * the superlock is unlocked by the thread which continues (in schedule()
+ * or at the start of __mythread_wrapper)
+ * active becomes runnable from now on, unless it is parked (then unpark
+ * sets ready again), preempted is non zero if the tick switches it out
+ */
+static void switch_to(struct active_thread_node *next, int preempted) {
+	struct active_thread_node *prev = active;
+	active = next;
+	__resched = 0;
+	__slice_start = now_ns();
+	prev->ready = __slice_start;
+	prev->stats->switches++;
+	next->stats->wait_ns += __slice_start - next->ready;
+	__stats.switches++;
+	if(preempted) {
+		prev->stats->preempted++;
+		__stats.preemptions++;
+	}
+	trace(MYTHREAD_TRACE_SWITCH_OUT, prev->thread, preempted);
+	trace(MYTHREAD_TRACE_SWITCH_IN, next->thread, 0);
+	__mythread_context_switch(prev->c, next->c);
+}
+
+/* makes a parked thread runnable again, a thread which was parked for
+ * long does not keep its old small vruntime (it would get the cpu for
+ * too long), it starts from the minimum vruntime
+ * called with superlock held
+ */
+static void unpark(struct active_thread_node *node) {
+	if(node->vruntime < __min_vruntime)
+		node->vruntime = __min_vruntime;
+	node->ready = now_ns();
+	runq_push(node);
+	timer_update();
+	trace(MYTHREAD_TRACE_WAKE, node->thread, 0);
+}
+
+/* the netpoller waits for readiness of file descriptors with epoll, every
+ * fd is registered once (edge triggered, for reading and writing) and a
+ * thread which gets EAGAIN parks until the next edge
+ * an edge for which no thread waits is remembered in rready/wready, so a
+ * thread does not park after it was already missed
+ * it waits at most timeout milliseconds (-1 blocks) and unparks the
+ * threads whose fds became ready
+ * called with superlock held
+ */
+static void netpoll(int timeout) {
+	struct epoll_event events[64];
+	struct mythread_pollfd *p;
+	int i, n;
+	if(__epfd == -1)
 		return;
+	n = epoll_wait(__epfd, events, 64, timeout);
+	for(i = 0; i < n; i++) {
+		p = &__pollfds[events[i].data.fd];
+		if(events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+			if(p->rd) {
+				unpark(p->rd);
+				p->rd = NULL;
+				__npollers--;
+			}
+			else
+				p->rready = 1;
+		}
+		if(events[i].events & (EPOLLOUT | EPOLLHUP | EPOLLERR)) {
+			if(p->wr) {
+				unpark(p->wr);
+				p->wr = NULL;
+				__npollers--;
+			}
+			else
+				p->wready = 1;
+		}
+	}
+}
+
+/* a wait queue is a fifo list of parked threads linked through their
+ * active nodes, a thread can be in one wait queue at a time and also in
+ * the list of timeouts if it waits with a timeout
+ * all waitq and timeout functions are called with superlock held
+ */
+static void waitq_push(struct mythread_waitq *q, struct active_thread_node *node) {
+	node->next = NULL;
+	node->waitq = q;
+	if(q->tail)
+		q->tail->next = node;
 	else
-		node = __allthreads[cur][locind]->pending_signals.head;
-	while(node) {
-		raise(node->sig);
-		previous = node;
-		node = node->next;
-		free(previous);
+		q->head = node;
+	q->tail = node;
+}
+
+static void waitq_remove(struct mythread_waitq *q, struct active_thread_node *node) {
+	struct active_thread_node **p, *prev = NULL;
+	for(p = &q->head; *p && *p != node; p = &(*p)->next)
+		prev = *p;
+	if(!*p)
+		return;
+	*p = node->next;
+	if(q->tail == node)
+		q->tail = prev;
+	node->waitq = NULL;
+}
+
+/* returns the slot of the timer wheel for a deadline in tick, a tick
+ * which has passed already goes to the slot due next
+ * the level is chosen by the distance from __wheel_tick, a deadline
+ * beyond the last level waits in its farthest slot
+ */
+static struct active_thread_node **wheel_slot(unsigned long tick) {
+	unsigned long delta;
+	int level, shift;
+	if(tick < __wheel_tick)
+		tick = __wheel_tick;
+	delta = tick - __wheel_tick;
+	if(delta < 1UL << MYTHREAD_WHEEL_BITS0)
+		return &__wheel0[tick & ((1 << MYTHREAD_WHEEL_BITS0) - 1)];
+	for(level = 0; level < MYTHREAD_WHEEL_LEVELS - 2; level++)
+		if(delta < 1UL << (MYTHREAD_WHEEL_BITS0 + (level + 1) * MYTHREAD_WHEEL_BITS))
+			break;
+	shift = MYTHREAD_WHEEL_BITS0 + level * MYTHREAD_WHEEL_BITS;
+	if(delta >= 1UL << (shift + MYTHREAD_WHEEL_BITS))
+		tick = __wheel_tick + (1UL << (shift + MYTHREAD_WHEEL_BITS)) - 1;
+	return &__wheel[level][(tick >> shift) & ((1 << MYTHREAD_WHEEL_BITS) - 1)];
+}
+
+static void wheel_insert(struct active_thread_node **slot, struct active_thread_node *node) {
+	node->tnext = *slot;
+	if(*slot)
+		(*slot)->tprev = &node->tnext;
+	node->tprev = slot;
+	*slot = node;
+}
+
+static void wheel_remove(struct active_thread_node *node) {
+	*node->tprev = node->tnext;
+	if(node->tnext)
+		node->tnext->tprev = node->tprev;
+}
+
+/* takes node out of the timer wheel if it has a timeout, in constant time
+ */
+static void timeout_cancel(struct active_thread_node *node) {
+	if(!node->deadline)
+		return;
+	wheel_remove(node);
+	__ntimeouts--;
+	node->deadline = 0;
+}
+
+/* takes the first thread out of wait queue q (and cancels its timeout),
+ * it returns NULL if q is empty
+ */
+static struct active_thread_node *waitq_pop(struct mythread_waitq *q) {
+	struct active_thread_node *node = q->head;
+	if(node) {
+		waitq_remove(q, node);
+		timeout_cancel(node);
 	}
-	__allthreads[cur][locind]->pending_signals.head = __allthreads[cur][locind]->pending_signals.tail = NULL;
+	return node;
 }
 
-/* this function will be invoked after every alarm sent to program
- * this changes the current context between active thread and the 
- * thread next to it
- */
-static void nextthread(int sig) {
-	if(sig == SIGALRM && __current > 1 && superlock_trylock()) {
-		previous = active;
-		active = active->next;
-		swapcontext(previous->c, active->c);
+/* adds node to the timer wheel, deadline is in monotonic nanoseconds
+ * (not 0), this takes constant time however many threads wait
+ * a wheel which was empty has not been turned, so it starts at now
+ */
+static void timeout_add(struct active_thread_node *node, unsigned long deadline) {
+	if(!__ntimeouts++)
+		__wheel_tick = now_ns() >> MYTHREAD_WHEEL_SHIFT;
+	node->deadline = deadline;
+	wheel_insert(wheel_slot(deadline >> MYTHREAD_WHEEL_SHIFT), node);
+}
+
+/* wakes node whose deadline has passed, it is taken out of the wait
+ * queue it waits in and finds timedout set
+ */
+static void timeout_expire(struct active_thread_node *node) {
+	wheel_remove(node);
+	__ntimeouts--;
+	node->deadline = 0;
+	node->timedout = 1;
+	if(node->waitq)
+		waitq_remove(node->waitq, node);
+	unpark(node);
+}
+
+/* called when __wheel_tick has reached the end of a turn of the first
+ * level, the slots of the higher levels which are due are emptied into
+ * the lower levels, highest level first
+ */
+static void wheel_cascade() {
+	struct active_thread_node *node, *next;
+	int level, shift;
+	for(level = MYTHREAD_WHEEL_LEVELS - 2; level >= 0; level--) {
+		shift = MYTHREAD_WHEEL_BITS0 + level * MYTHREAD_WHEEL_BITS;
+		if(__wheel_tick & ((1UL << shift) - 1))
+			continue;
+		node = __wheel[level][(__wheel_tick >> shift) & ((1 << MYTHREAD_WHEEL_BITS) - 1)];
+		__wheel[level][(__wheel_tick >> shift) & ((1 << MYTHREAD_WHEEL_BITS) - 1)] = NULL;
+		for(; node; node = next) {
+			next = node->tnext;
+			wheel_insert(wheel_slot(node->deadline >> MYTHREAD_WHEEL_SHIFT), node);
+		}
+	}
+}
+
+/* turns the timer wheel up to now and unparks the threads whose deadline
+ * has passed, every slot of the first level holds only deadlines of its
+ * own tick, so the slots of past ticks are emptied whole and only the
+ * slot of the current tick is looked at thread by thread
+ */
+static void timeouts_expire() {
+	struct active_thread_node **slot;
+	unsigned long t = now_ns(), tick = t >> MYTHREAD_WHEEL_SHIFT;
+	while(__ntimeouts && __wheel_tick < tick) {
+		slot = &__wheel0[__wheel_tick & ((1 << MYTHREAD_WHEEL_BITS0) - 1)];
+		while(*slot)
+			timeout_expire(*slot);
+		if(!(++__wheel_tick & ((1 << MYTHREAD_WHEEL_BITS0) - 1)))
+			wheel_cascade();
+	}
+	if(!__ntimeouts) {
+		__wheel_tick = tick;
+		return;
+	}
+	for(slot = &__wheel0[tick & ((1 << MYTHREAD_WHEEL_BITS0) - 1)]; *slot; )
+		if((*slot)->deadline <= t)
+			timeout_expire(*slot);
+		else slot = &(*slot)->tnext;
+}
+
+/* returns the time until which no timeout can expire: the first deadline
+ * in the first occupied slot of the first level, or the end of its turn
+ * (when the next cascade is due) if it is empty
+ */
+static unsigned long timeouts_next() {
+	struct active_thread_node *node;
+	unsigned long tick, deadline = 0;
+	for(tick = __wheel_tick; tick == __wheel_tick || tick & ((1 << MYTHREAD_WHEEL_BITS0) - 1); tick++) {
+		for(node = __wheel0[tick & ((1 << MYTHREAD_WHEEL_BITS0) - 1)]; node; node = node->tnext)
+			if(!deadline || node->deadline < deadline)
+				deadline = node->deadline;
+		if(deadline)
+			return deadline;
+	}
+	return tick << MYTHREAD_WHEEL_SHIFT;
+}
+
+/* waits until some thread becomes runnable, called with superlock held
+ * when the run queue is empty and the active thread can not continue
+ * it sleeps in epoll if threads wait for i/o and not longer than the
+ * first timeout, if no thread waits for i/o or a timeout nothing can
+ * wake any thread, so the process just waits for a signal
+ */
+static void idle() {
+	struct timespec ts;
+	long wait = -1, t;
+	unsigned long start = now_ns();
+	if(__ntimeouts) {
+		t = timeouts_next() - now_ns();
+		wait = t > 0 ? t : 0;
+	}
+	if(__npollers)
+		netpoll(wait < 0 ? -1 : (wait + 999999) / 1000000);
+	else if(wait > 0) {
+		ts.tv_sec = wait / 1000000000;
+		ts.tv_nsec = wait % 1000000000;
+		nanosleep(&ts, NULL);
+	}
+	else if(wait < 0)
+		pause();
+	__stats.idle_ns += now_ns() - start;
+	if(__ntimeouts)
+		timeouts_expire();
+}
+
+/* takes the active thread off the run queue until some unpark() and
+ * switches to the next runnable thread, it returns (still with superlock
+ * held) when the thread is unparked and runs again
+ * called with superlock held, joined is the thread it waits for in
+ * mythread_join (0 if none) and is only recorded in the trace
+ */
+static void thread_park(mythread_t joined) {
+	struct active_thread_node *next;
+	trace(MYTHREAD_TRACE_BLOCK, active->thread, joined);
+	update_vruntime();
+	while(!__runq_len)
+		idle();
+	next = runq_pop();
+	timer_update();
+	if(next == active) {
+		__slice_start = now_ns();
+		active->stats->wait_ns += __slice_start - active->ready;
+		return;
+	}
+	switch_to(next, 0);
+	handle_pending_signals();
+}
+
+/* picks the thread to run next, the active thread is switched out on a
+ * tick only if some runnable thread has a smaller vruntime, so threads
+ * which use little cpu (interactive ones) run first whenever they are
+ * runnable and cpu hogs share the rest according to their weights
+ * if yield is non zero the active thread gives up the cpu to the best
+ * other thread even if its own vruntime is smaller
+ * if the superlock is held (the tick interrupted its holder) the decision
+ * is left to the holder, which schedules when it unlocks
+ */
+static void schedule(int yield) {
+	struct active_thread_node *next;
+	if(__current <= 1)
+		return;
+	if(!superlock_trylock()) {
+		__resched = 1;
+		return;
+	}
+	update_vruntime();
+	if(__npollers)
+		netpoll(0);
+	if(__ntimeouts)
+		timeouts_expire();
+	if(__runq_len && (yield || __runq[0]->vruntime < active->vruntime)) {
+		next = runq_pop();
+		runq_push(active);
+		switch_to(next, !yield);
 		handle_pending_signals();
-		superlock_unlock();
 	}
+	superlock_unlock();
+}
+
+/* removes the active thread, which has terminated, from scheduling and
+ * switches to the next thread, it never returns
+ * called with superlock held, if no thread is runnable it waits for one
+ * a detached thread is still on its stack here, so it is released by the
+ * next thread which terminates or is created, it stays THREAD_DETACHED
+ * until then so join and detach refuse it instead of releasing it
+ */
+static void thread_terminate(struct mythread_struct *t) {
+	struct active_thread_node *node = active, *next;
+	if(__reap)
+		release_thread(__reap);
+	__reap = NULL;
+	if(t->state == THREAD_DETACHED)
+		__reap = t;
+	else
+		t->state = THREAD_TERMINATED;
+	t->node = NULL;
+	while((next = waitq_pop(&t->joiners)))
+		unpark(next);
+	__current--;
+	__stats.exited++;
+	update_vruntime();
+	while(!__runq_len)
+		idle();
+	active = runq_pop();
+	timer_update();
+	__slice_start = now_ns();
+	active->stats->wait_ns += __slice_start - active->ready;
+	trace(MYTHREAD_TRACE_EXIT, node->thread, 0);
+	trace(MYTHREAD_TRACE_SWITCH_OUT, node->thread, 0);
+	trace(MYTHREAD_TRACE_SWITCH_IN, active->thread, 0);
+	free(node);
+	__mythread_context_switch(&t->thread_context, active->c);
+}
+
+static void trace_atexit();
+
+/* dl_iterate_phdr callback which records the executable segments of libc,
+ * libpthread, the dynamic linker and any allocator library (an object
+ * whose name contains malloc, like jemalloc or tcmalloc)
+ */
+static int libc_text_add(struct dl_phdr_info *info, size_t size, void *data) {
+	static const char *names[] = {"libc.so", "libc-", "libpthread", "ld-linux", "malloc", NULL};
+	const char *base = info->dlpi_name ? strrchr(info->dlpi_name, '/') : NULL;
+	int i;
+	base = base ? base + 1 : info->dlpi_name;
+	if(!base || !base[0])
+		return 0;
+	for(i = 0; names[i] && !strstr(base, names[i]); i++)
+		;
+	if(!names[i])
+		return 0;
+	for(i = 0; i < info->dlpi_phnum && __nlibc_text < MYTHREAD_LIBC_RANGES; i++)
+		if(info->dlpi_phdr[i].p_type == PT_LOAD && (info->dlpi_phdr[i].p_flags & PF_X)) {
+			__libc_text[__nlibc_text].start = info->dlpi_addr + info->dlpi_phdr[i].p_vaddr;
+			__libc_text[__nlibc_text].end = __libc_text[__nlibc_text].start + info->dlpi_phdr[i].p_memsz;
+			__nlibc_text++;
+		}
+	return 0;
+}
+
+/* returns non zero if the tick described by ctx interrupted code of libc
+ * or of the allocator, libc sees a single thread and takes no locks, so
+ * a thread switched out in the middle of malloc leaves the heap half
+ * updated for the next one
+ */
+static int in_libc(void *ctx) {
+	unsigned long pc;
+	int i;
+#if defined(__x86_64__)
+	pc = ((ucontext_t *)ctx)->uc_mcontext.gregs[REG_RIP];
+#elif defined(__i386__)
+	pc = ((ucontext_t *)ctx)->uc_mcontext.gregs[REG_EIP];
+#elif defined(__aarch64__)
+	pc = ((ucontext_t *)ctx)->uc_mcontext.pc;
+#else
+	return 0;
+#endif
+	for(i = 0; i < __nlibc_text; i++)
+		if(pc >= __libc_text[i].start && pc < __libc_text[i].end)
+			return 1;
+	return 0;
+}
+
+/* this function will be invoked after every alarm sent to program
+ * the handler runs with SA_NODEFER and an empty sa_mask, so the mask in
+ * the signal frame is exactly the current signal mask and no system call
+ * is needed to know it (a tick during a switch fails to take the superlock
+ * and returns)
+ * a tick which interrupted libc is skipped, the thread is switched out by
+ * a later one, errno is saved as the next thread may change it
+ */
+static void nextthread(int sig, siginfo_t *info, void *ctx) {
+	int e;
+	if(in_libc(ctx))
+		return;
+#ifdef MYTHREAD_FAST_SWITCH
+	memcpy(&__sigmask, &((ucontext_t *)ctx)->uc_sigmask, _NSIG / 8);
+#endif
+	e = errno;
+	schedule(0);
+	errno = e;
 }
 
 /* this initialisation function is needed to be called 
  * before creating any thread and calling any other thread
  * functions on that thread
- * this function does the necessary setup and sets custom 
- * alarm by ualarm()
+ * it initialises the library in preemptive mode, or in cooperative mode
+ * if the environment variable MYTHREAD_COOPERATIVE is set to non zero
  */
 void mythread_init() {
+	char *env = getenv("MYTHREAD_COOPERATIVE");
+	mythread_init_mode(env && atoi(env) ? MYTHREAD_COOPERATIVE : MYTHREAD_PREEMPTIVE);
+}
+
+/* initialises the library in the given mode
+ * in MYTHREAD_PREEMPTIVE mode it does the necessary setup and creates the
+ * preemption timer which is armed once there are threads to switch between
+ * the quantum and the adaptive mode can also be set with the environment
+ * variables MYTHREAD_QUANTUM (in microseconds) and MYTHREAD_ADAPTIVE
+ * if the environment variable MYTHREAD_TRACE names a file, the tracer is
+ * started and the trace is written to that file at exit
+ * in MYTHREAD_COOPERATIVE mode no timer and no SIGALRM handler are set,
+ * a thread runs until it calls mythread_yield, joins, exits or waits
+ * for i/o, so there is no signal delivery and no thread is ever switched
+ * out in the middle of a libc call
+ */
+void mythread_init_mode(int mode) {
 	int i;
+	struct sigaction sa;
+	struct sigevent sev;
+	char *env = getenv("MYTHREAD_POOL_CAP");
+	if(env)
+		__pool.cap = atoi(env);
+	if((env = getenv("MYTHREAD_QUANTUM")) && atol(env) > 0)
+		__quantum = atol(env);
+	if((env = getenv("MYTHREAD_ADAPTIVE")))
+		__adaptive = atoi(env);
 	active = (struct active_thread_node *)malloc(sizeof(struct active_thread_node));
 	active->thread = 0;
 	active->c = &maincontext;
-	active->next = active;
-	last = mainthread = active;
+	active->stats = &__mainstats;
+	active->vruntime = 0;
+	active->priority = MYTHREAD_PRIO_DEFAULT;
+	active->weight = prio_to_weight[MYTHREAD_PRIO_DEFAULT - MYTHREAD_PRIO_HIGHEST];
+	active->waitq = NULL;
+	active->deadline = 0;
+	mainthread = active;
 	__current = 1;
+	runq_reserve();
+	__slice_start = now_ns();
+	if((env = getenv("MYTHREAD_TRACE")) && strlen(env) < sizeof(__trace_path) && !mythread_trace_start(0)) {
+		strcpy(__trace_path, env);
+		atexit(trace_atexit);
+	}
 	for(i = 0; i < 32; i++) 
 		sigdfls[i] = def_sig_handlers[i] = mainthread_sig_handlers[i] = SIG_DFL;
-	signal(SIGALRM, nextthread);	
+	sigemptyset(&__sigmask);
+	sigprocmask(SIG_SETMASK, NULL, &__sigmask);
+	__cooperative = mode == MYTHREAD_COOPERATIVE;
+	if(__cooperative)
+		return;
+	dl_iterate_phdr(libc_text_add, NULL);
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_sigaction = nextthread;
+	sa.sa_flags = SA_SIGINFO | SA_NODEFER | SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGALRM, &sa, NULL);
+	memset(&sev, 0, sizeof(sev));
+	sev.sigev_notify = SIGEV_SIGNAL;
+	sev.sigev_signo = SIGALRM;
+	timer_create(CLOCK_MONOTONIC, &sev, &__timer);
 }
 
-/* wrapper function of type void (*f)(int) which is needed to be type
- * casted in the form void (*f)(void) and passed to makecontext
- * function
+/* wrapper function of type void (*f)(int) which is the first function
+ * run on the stack of a new thread (see __mythread_context_make)
  * it invokes the function of the thread, also stores the returned
  * value in the mythread_struct
+ * the superlock is kept locked while switching to the next thread for the
+ * last time, which continues in schedule() and unlocks it, so the tick
+ * can never switch away from a terminated thread and its stack can be
+ * reused as soon as it is collected
  */
 void __mythread_wrapper(int ind) {
-	int cur, locind;
-	ind--;
-	cur = ind / 16;
-	locind = ind % 16;
+	struct mythread_struct *t = table_slot(ind - 1)->thread;
 	superlock_unlock();
 	//set_active_thread_signal(SIGALRM, nextthread);
-	__allthreads[cur][locind]->returnval = __allthreads[cur][locind]->fun(__allthreads[cur][locind]->args);
-	if(ind >= 0) {
-		superlock_lock();
-		__allthreads[cur][locind]->state = THREAD_TERMINATED;
-		if(active->next == mainthread)
-			last = previous;
-		previous->next = active->next;
-		free(active);
-		active = mainthread;
-		previous = last;
-		__current--;
-		if(__current == 1)
-			ualarm(0, 0);
-		superlock_unlock();
-	}
-}
-
-/* if any error occures, then this function removes the newly allocated
- * thread and decrements the index __ind by one 
- */
-void __mythread_removelastfilled(void) {
-	__ind--;
-	int cur = __ind / 16;
-	int locind = __ind % 16;
-	free(__allthreads[cur][locind]);
+	t->returnval = t->fun(t->args);
+	superlock_lock();
+	thread_terminate(t);
 }
 
 /* it takes function and arguments and returns a structure of type
  * mythread_struct which contains useful information of the current 
  * thread and can be passwed to function __mythread_wrapper
+ * it returns NULL if the structure or the stack can not be allocated or
+ * the table is full
  */
 struct mythread_struct *__mythread_fill(void *(*fun)(void *), void *args) {
-	int cur = __ind / 16;
-	int locind = __ind % 16;
-	if(!__allthreads[cur])
-		__allthreads[cur] = (struct mythread_struct **)malloc(sizeof(struct mythread_struct *) * 16);
-	__allthreads[cur][locind] = (struct mythread_struct *)malloc(sizeof(struct mythread_struct));
-	getcontext(&(__allthreads[cur][locind]->thread_context));
-	memcpy(__allthreads[cur][locind]->handlers, def_sig_handlers, sizeof(def_sig_handlers));
-	__allthreads[cur][locind]->fun = fun;
-	__allthreads[cur][locind]->args = args;
-	__allthreads[cur][locind]->thread_context.uc_stack.ss_sp = malloc(STACK_SIZE);
-	__allthreads[cur][locind]->thread_context.uc_stack.ss_size = STACK_SIZE;
-	__allthreads[cur][locind]->thread_context.uc_link = &maincontext;
-	__allthreads[cur][locind]->returnval = NULL;
-	__allthreads[cur][locind]->state = THREAD_NOT_STARTED;
-	__allthreads[cur][locind]->pending_signals.head = __allthreads[cur][locind]->pending_signals.tail = NULL;
-	__ind++;
-	return __allthreads[cur][locind];
+	struct mythread_struct *t;
+	char *stack;
+	if(!(t = (struct mythread_struct *)pool_get(&__pool.descs, &__pool.ndescs, &__pool.desc_hits, &__pool.desc_misses, sizeof(struct mythread_struct))))
+		return NULL;
+	if(!(stack = pool_get(&__pool.stacks, &__pool.nstacks, &__pool.stack_hits, &__pool.stack_misses, STACK_SIZE)) || table_alloc(t) == -1) {
+		if(stack)
+			pool_put(&__pool.stacks, &__pool.nstacks, stack);
+		pool_put(&__pool.descs, &__pool.ndescs, t);
+		return NULL;
+	}
+	memcpy(t->handlers, def_sig_handlers, sizeof(def_sig_handlers));
+	t->fun = fun;
+	t->args = args;
+	t->stack = stack;
+	t->returnval = NULL;
+	t->state = THREAD_NOT_STARTED;
+	t->pending = 0;
+	t->joiners.head = t->joiners.tail = NULL;
+	memset(&t->stats, 0, sizeof(t->stats));
+	return t;
+}
+
+/* initialises the attributes attr with default values
+ */
+int mythread_attr_init(mythread_attr_t *attr) {
+	attr->priority = MYTHREAD_PRIO_DEFAULT;
+	attr->detached = 0;
+	return 0;
+}
+
+/* makes a thread created with attr detached (see mythread_detach) if
+ * detached is non zero, it returns 0
+ */
+int mythread_attr_setdetached(mythread_attr_t *attr, int detached) {
+	attr->detached = detached != 0;
+	return 0;
+}
+
+/* sets the priority in attributes attr, it returns EINVAL if priority
+ * is not between MYTHREAD_PRIO_HIGHEST and MYTHREAD_PRIO_LOWEST
+ */
+int mythread_attr_setpriority(mythread_attr_t *attr, int priority) {
+	if(priority < MYTHREAD_PRIO_HIGHEST || priority > MYTHREAD_PRIO_LOWEST)
+		return EINVAL;
+	attr->priority = priority;
+	return 0;
 }
 
 /* creates a many one thread and starts it for given function and given
@@ -244,107 +1267,273 @@ struct mythread_struct *__mythread_fill(void *(*fun)(void *), void *args) {
  * if any error occures, it frees the allocated structure
  */
 int mythread_create(mythread_t *mythread, void *(*fun)(void *), void *args) {
+	return mythread_create_attr(mythread, NULL, fun, args);
+}
+
+/* same as mythread_create but the thread is created with attributes
+ * attr (default attributes if attr is NULL)
+ * a new thread starts with the minimum vruntime, so it runs soon but can
+ * not take more than its share from older threads
+ */
+int mythread_create_attr(mythread_t *mythread, const mythread_attr_t *attr, void *(*fun)(void *), void *args) {
 	struct mythread_struct *t; 
 	struct active_thread_node *newthread;
-	if(__current == 1)
-		ualarm(50000, 50000);
+	int priority = attr ? attr->priority : MYTHREAD_PRIO_DEFAULT;
+	if(priority < MYTHREAD_PRIO_HIGHEST || priority > MYTHREAD_PRIO_LOWEST)
+		return -1;
 	superlock_lock();
-	t = __mythread_fill(fun, args);
-	*mythread = __ind;
-	if(t)
-		t->state = THREAD_RUNNING;
-	else {
+	if(__reap) {
+		release_thread(__reap);
+		__reap = NULL;
+	}
+	newthread = (struct active_thread_node *)malloc(sizeof(struct active_thread_node));
+	if(!newthread || runq_reserve() == -1 || !(t = __mythread_fill(fun, args))) {
+		free(newthread);
 		superlock_unlock();
 		return -1;
 	}
-	makecontext(&(t->thread_context), (void (*)())__mythread_wrapper, 1, __ind);
-	newthread = (struct active_thread_node *)malloc(sizeof(struct active_thread_node));
+	t->state = attr && attr->detached ? THREAD_DETACHED : THREAD_RUNNING;
+	*mythread = t->id;
+	__mythread_context_make(&(t->thread_context), t->stack, STACK_SIZE, __mythread_wrapper, (int)(t->id & 0xffffffff));
 	newthread->thread = *mythread;
 	newthread->c = &(t->thread_context);
-	newthread->next = mainthread->next;
-	mainthread->next = newthread;
+	newthread->stats = &t->stats;
+	newthread->ready = now_ns();
+	newthread->priority = priority;
+	newthread->weight = prio_to_weight[priority - MYTHREAD_PRIO_HIGHEST];
+	newthread->vruntime = __min_vruntime;
+	newthread->waitq = NULL;
+	newthread->deadline = 0;
+	t->node = newthread;
+	runq_push(newthread);
 	__current++;
-	if(newthread->next == mainthread)
-		last = newthread;
+	__stats.created++;
+	trace(MYTHREAD_TRACE_CREATE, active->thread, t->id);
+	timer_update();
 	superlock_unlock();
 	return 0;
 }
 
-/* returns ID of the calling thread, if mythread_init is not called, then 
- * it returns -1
- * if the thread calling it is main thread, then it returns 0
+/* sets the priority of thread mythread (0 for the main thread), it takes
+ * effect from the next scheduling decision
+ * it returns 0 on success, EINVAL if priority is out of range and ESRCH
+ * if the thread does not exist or has terminated
  */
-mythread_t mythread_self(void) {
-	mythread_t t;
+int mythread_setpriority(mythread_t mythread, int priority) {
+	struct active_thread_node *node;
+	struct mythread_struct *t;
+	if(priority < MYTHREAD_PRIO_HIGHEST || priority > MYTHREAD_PRIO_LOWEST)
+		return EINVAL;
 	superlock_lock();
-	if(active)
-		t = active->thread;
-	else t = -1;
-	superlock_unlock();
-	return t;
+	if(mythread == 0)
+		node = mainthread;
+	else
+		node = (t = table_lookup(mythread)) ? t->node : NULL;
+	if(!node) {
+		superlock_unlock();
+		return ESRCH;
+	}
+	node->priority = priority;
+	node->weight = prio_to_weight[priority - MYTHREAD_PRIO_HIGHEST];
+	superlock_unlock();
+	return 0;
+}
+
+/* stores the priority of thread mythread (0 for the main thread) in
+ * *priority, it returns 0 on success and ESRCH if the thread does not
+ * exist or has terminated
+ */
+int mythread_getpriority(mythread_t mythread, int *priority) {
+	struct active_thread_node *node;
+	struct mythread_struct *t;
+	superlock_lock();
+	if(mythread == 0)
+		node = mainthread;
+	else
+		node = (t = table_lookup(mythread)) ? t->node : NULL;
+	if(node)
+		*priority = node->priority;
+	superlock_unlock();
+	return node ? 0 : ESRCH;
+}
+
+/* gives up the cpu to the runnable thread with the smallest vruntime,
+ * the calling thread stays runnable and continues when it is picked
+ * again, it returns 0
+ */
+int mythread_yield(void) {
+	schedule(1);
+	return 0;
+}
+
+/* gives the cpu directly to the thread mythread if it is runnable, the
+ * calling thread stays runnable and continues when it is picked again
+ * the picked thread does not have to wait for its turn in the run queue,
+ * which is what a thread waiting for a lock held by it wants
+ * if mythread is not runnable (it is parked or it is the calling thread)
+ * it works like mythread_yield
+ * it returns 0, or ESRCH if there is no thread with id mythread
+ */
+int mythread_yield_to(mythread_t mythread) {
+	struct mythread_struct *t = NULL;
+	struct active_thread_node *node, *next = NULL;
+	int i;
+	superlock_lock();
+	if(mythread)
+		node = (t = table_lookup(mythread)) ? t->node : NULL;
+	else
+		node = mainthread;
+	if(node && node != active && (i = runq_index(node)) != -1)
+		next = runq_take(i);
+	if(!next) {
+		superlock_unlock();
+		schedule(1);
+		return (mythread && !t) ? ESRCH : 0;
+	}
+	update_vruntime();
+	runq_push(active);
+	switch_to(next, 0);
+	handle_pending_signals();
+	superlock_unlock();
+	return 0;
+}
+
+/* parks the calling thread on the timer wheel for at least ns
+ * nanoseconds, unlike usleep the other threads keep running and the
+ * sleeping thread takes no cpu until its deadline, it returns 0
+ * before mythread_init it just sleeps
+ */
+int mythread_sleep_ns(unsigned long ns) {
+	struct timespec ts;
+	if(!active) {
+		ts.tv_sec = ns / 1000000000;
+		ts.tv_nsec = ns % 1000000000;
+		nanosleep(&ts, NULL);
+		return 0;
+	}
+	superlock_lock();
+	active->timedout = 0;
+	timeout_add(active, now_ns() + (ns ? ns : 1));
+	thread_park(0);
+	superlock_unlock();
+	return 0;
+}
+
+/* returns ID of the calling thread, if mythread_init is not called, then 
+ * it returns -1
+ * if the thread calling it is main thread, then it returns 0
+ * it takes no lock, active only changes under the calling thread while it
+ * is switched out and is the same again when it runs
+ */
+mythread_t mythread_self(void) {
+	return active ? active->thread : -1;
+}
+
+/* waits for the thread mythread to complete until deadline (in monotonic
+ * nanoseconds, 0 waits forever), it returns ETIMEDOUT if the thread is
+ * still running then and it can be joined again later
+ * while the target runs the joiner is parked in its joiners and takes no
+ * cpu, thread_terminate wakes it
+ * a thread joining itself would park forever, it gets EDEADLK instead
+ */
+static int thread_join(mythread_t mythread, void **returnval, unsigned long deadline) {
+	int status = EINVAL;
+	struct mythread_struct *t;
+	superlock_lock();
+	if(!(t = table_lookup(mythread))) {
+		superlock_unlock();
+		return ESRCH;
+	}
+	if(t->node == active) {
+		superlock_unlock();
+		return EDEADLK;
+	}
+	switch(t->state) {
+		case THREAD_RUNNING:
+			t->state = THREAD_JOIN_CALLED;
+			active->timedout = 0;
+			waitq_push(&t->joiners, active);
+			if(deadline)
+				timeout_add(active, deadline);
+			thread_park(mythread);
+			if(t->state != THREAD_TERMINATED) {
+				t->state = THREAD_RUNNING;
+				superlock_unlock();
+				return ETIMEDOUT;
+			}
+			/* fall through */
+		case THREAD_TERMINATED:
+			if(returnval)
+				*returnval = t->returnval;
+			release_thread(t);
+			superlock_unlock();
+			status = 0;
+			break;
+		default:
+			superlock_unlock();
+			break;
+	}
+	return status;
 }
 
 /* waits for the thread mythread to complete 
  * it returns 0 on success and EINVAL on wrong thread_t argument and ESRCH
- * if the thread with thread id mythread can not be found
+ * if the thread with thread id mythread can not be found, EDEADLK if it
+ * is the calling thread
  * if returnval is not NULL, then stores the value returned by thread 
  * in the location pointed by function which was running by the thread
+ * the stack and structure of the collected thread go back to the pool
  */
 int mythread_join(mythread_t mythread, void **returnval) {
-	int cur, locind, status = EINVAL;
-	mythread--;
-	cur = mythread / 16;
-	locind = mythread % 16;
-	superlock_lock();
-	if(mythread < __ind) {
-		switch(__allthreads[cur][locind]->state) {
-			case THREAD_RUNNING:
-				__allthreads[cur][locind]->state = THREAD_JOIN_CALLED;
-				superlock_unlock();
-				while(__allthreads[cur][locind]->state != THREAD_TERMINATED)
-					nextthread(SIGALRM);
-				superlock_lock();
-				__allthreads[cur][locind]->state = THREAD_COLLECTED;
-				superlock_unlock();
-				if(returnval)
-					*returnval = __allthreads[cur][locind]->returnval;
-				status = 0;
-				break;
-			case THREAD_NOT_STARTED:
-			case THREAD_COLLECTED:
-			case THREAD_JOIN_CALLED:
-				superlock_unlock();
-				break;
-			case THREAD_TERMINATED:
-				superlock_unlock();
-				if(returnval)
-					*returnval = __allthreads[cur][locind]->returnval;
-				status = 0;
-				break;
-			default:
-				superlock_unlock();
-				break;
-		}
-	}
+	return thread_join(mythread, returnval, 0);
+}
+
+/* same as mythread_join but it waits at most ns nanoseconds, it returns
+ * ETIMEDOUT if the thread has not completed by then
+ */
+int mythread_join_timed(mythread_t mythread, void **returnval, unsigned long ns) {
+	return thread_join(mythread, returnval, now_ns() + (ns ? ns : 1));
+}
+
+/* detaches the thread mythread, it can not be joined any more and its
+ * stack and structure are released as soon as it has exited (at once if
+ * it has exited already)
+ * it returns 0 on success, ESRCH if the thread can not be found and
+ * EINVAL if it is detached already or some thread joins it
+ */
+int mythread_detach(mythread_t mythread) {
+	int status = 0;
+	struct mythread_struct *t;
+	superlock_lock();
+	if(!(t = table_lookup(mythread)))
+		status = ESRCH;
+	else if(t->state == THREAD_RUNNING)
+		t->state = THREAD_DETACHED;
+	else if(t->state == THREAD_TERMINATED)
+		release_thread(t);
+	else status = EINVAL;
+	superlock_unlock();
 	return status;
 }
 
 /* sends signal sig to the thread represented by
  * mythread_t mythread
- * the signal is stored in the thread's pending signals 
- * queue which will be later processed when the thread is running
- * the scheduler will check if the queue is empty of not, if not empty
- * each signal in queue will be processed in the order in which 
- * it was received
+ * the signal is set in the pending mask of the thread, which the
+ * scheduler checks whenever it switches to that thread, like a standard
+ * signal it is delivered once even if it was sent several times meanwhile
+ * nothing is allocated and no lock is taken, so it may also be called
+ * from a signal handler
+ * it returns 0 on success, ESRCH if the thread can not be found and
+ * EINVAL if sig is not a valid signal (0 only checks the thread)
  */
 int mythread_kill(mythread_t mythread, int sig) {
-	int cur, locind;
-	mythread--;
-	cur = mythread / 16;
-	locind = mythread % 16;
-	superlock_lock();
-	addsignal(&(__allthreads[cur][locind]->pending_signals), sig);
-	superlock_unlock();
+	struct mythread_struct *t;
+	if(sig < 0 || sig >= 32)
+		return EINVAL;
+	if(!(t = table_lookup(mythread)))
+		return ESRCH;
+	if(sig)
+		__atomic_fetch_or(&t->pending, 1U << sig, __ATOMIC_RELEASE);
 	return 0;
 }
 
@@ -353,60 +1542,1155 @@ int mythread_kill(mythread_t mythread, int sig) {
  * location pointed by returnval
  */
 void mythread_exit(void *returnval) {	
-	int ind = active->thread - 1;
-	int cur = ind / 16, locind = ind % 16;
-	ucontext_t *thiscontext;
-	if(ind >= 0) {
+	struct mythread_struct *t = table_lookup(active->thread);
+	if(t) {
+		superlock_lock();
+		t->returnval = returnval;
+		thread_terminate(t);
+	}
+}
+
+/* prepares fd for the netpoller: registers it with epoll and puts it in
+ * non blocking mode, it returns -1 if fd can not be polled (like a regular
+ * file), the wrappers then just call the blocking function
+ */
+static int netpoll_open(int fd) {
+	struct mythread_pollfd *p;
+	struct epoll_event ev;
+	int n, status = -1;
+	if(fd < 0)
+		return -1;
+	superlock_lock();
+	if(fd >= __npollfds) {
+		n = fd + 1 > 2 * __npollfds ? fd + 1 : 2 * __npollfds;
+		p = (struct mythread_pollfd *)realloc(__pollfds, n * sizeof(struct mythread_pollfd));
+		if(!p)
+			goto out;
+		memset(p + __npollfds, 0, (n - __npollfds) * sizeof(struct mythread_pollfd));
+		__pollfds = p;
+		__npollfds = n;
+	}
+	p = &__pollfds[fd];
+	if(!p->registered) {
+		if(__epfd == -1 && (__epfd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+			goto out;
+		ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+		ev.data.fd = fd;
+		if(epoll_ctl(__epfd, EPOLL_CTL_ADD, fd, &ev) == -1 && errno != EEXIST)
+			goto out;
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+		p->registered = 1;
+		p->rready = p->wready = 0;
+	}
+	status = 0;
+out:
+	superlock_unlock();
+	return status;
+}
+
+/* parks the calling thread until fd is readable (write is 0) or writable,
+ * it returns at once if such an edge came after the last wait
+ */
+static void netpoll_wait(int fd, int write) {
+	struct mythread_pollfd *p;
+	char *ready;
+	superlock_lock();
+	p = &__pollfds[fd];
+	ready = write ? &p->wready : &p->rready;
+	if(*ready)
+		*ready = 0;
+	else {
+		if(write)
+			p->wr = active;
+		else
+			p->rd = active;
+		__npollers++;
+		timer_update();
+		thread_park(0);
+	}
+	superlock_unlock();
+}
+
+/* same as read, but only the calling thread waits for data, other threads
+ * keep running
+ * mythread_write, mythread_accept and mythread_connect are the same for
+ * write, accept and connect
+ * the fd is put in non blocking mode and stays so, it has to be closed
+ * with mythread_close
+ */
+ssize_t mythread_read(int fd, void *buf, size_t count) {
+	ssize_t n;
+	if(netpoll_open(fd) == -1)
+		return read(fd, buf, count);
+	while((n = read(fd, buf, count)) == -1 && errno == EAGAIN)
+		netpoll_wait(fd, 0);
+	return n;
+}
+
+ssize_t mythread_write(int fd, const void *buf, size_t count) {
+	ssize_t n;
+	if(netpoll_open(fd) == -1)
+		return write(fd, buf, count);
+	while((n = write(fd, buf, count)) == -1 && errno == EAGAIN)
+		netpoll_wait(fd, 1);
+	return n;
+}
+
+int mythread_accept(int fd, struct sockaddr *addr, socklen_t *addrlen) {
+	int n;
+	if(netpoll_open(fd) == -1)
+		return accept(fd, addr, addrlen);
+	while((n = accept(fd, addr, addrlen)) == -1 && errno == EAGAIN)
+		netpoll_wait(fd, 0);
+	return n;
+}
+
+/* a non blocking connect returns EINPROGRESS, connect is called again
+ * whenever the socket becomes writable until it returns EISCONN (connected)
+ * or the error of the connection
+ */
+int mythread_connect(int fd, const struct sockaddr *addr, socklen_t addrlen) {
+	if(netpoll_open(fd) == -1)
+		return connect(fd, addr, addrlen);
+	while(connect(fd, addr, addrlen) == -1) {
+		if(errno == EISCONN)
+			return 0;
+		if(errno != EINPROGRESS && errno != EALREADY)
+			return -1;
+		netpoll_wait(fd, 1);
+	}
+	return 0;
+}
+
+/* removes fd from the netpoller and closes it, threads still waiting on
+ * fd are woken up (their next call fails with EBADF)
+ */
+int mythread_close(int fd) {
+	struct mythread_pollfd *p;
+	superlock_lock();
+	if(fd >= 0 && fd < __npollfds && __pollfds[fd].registered) {
+		p = &__pollfds[fd];
+		epoll_ctl(__epfd, EPOLL_CTL_DEL, fd, NULL);
+		if(p->rd) {
+			unpark(p->rd);
+			__npollers--;
+		}
+		if(p->wr) {
+			unpark(p->wr);
+			__npollers--;
+		}
+		memset(p, 0, sizeof(struct mythread_pollfd));
+	}
+	superlock_unlock();
+	return close(fd);
+}
+
+/* initialises the mutex m, a mutex can also be initialised with
+ * MYTHREAD_MUTEX_INITIALIZER
+ */
+int mythread_mutex_init(mythread_mutex_t *m) {
+	m->locked = 0;
+	m->waiters.head = m->waiters.tail = NULL;
+	return 0;
+}
+
+/* returns EBUSY if the mutex m is locked
+ */
+int mythread_mutex_destroy(mythread_mutex_t *m) {
+	return m->locked ? EBUSY : 0;
+}
+
+/* locks the mutex m, if it is locked the calling thread is parked in
+ * the wait queue of m and takes no cpu until it gets the mutex
+ * the mutex is handed over by the unlocking thread directly to the first
+ * waiter, so waiters get it in fifo order
+ */
+int mythread_mutex_lock(mythread_mutex_t *m) {
+	unsigned long start;
+	superlock_lock();
+	if(!m->locked)
+		m->locked = 1;
+	else {
+		start = now_ns();
+		waitq_push(&m->waiters, active);
+		thread_park(0);
+		active->stats->lock_ns += now_ns() - start;
+	}
+	superlock_unlock();
+	return 0;
+}
+
+/* converts abstime (of CLOCK_REALTIME, as for the pthread timed waits)
+ * into a deadline in monotonic nanoseconds
+ */
+static unsigned long abstime_deadline(const struct timespec *abstime) {
+	struct timespec ts;
+	long wait;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	wait = (abstime->tv_sec - ts.tv_sec) * 1000000000L + abstime->tv_nsec - ts.tv_nsec;
+	return now_ns() + (wait > 0 ? wait : 1);
+}
+
+/* same as mythread_mutex_lock but the calling thread waits only until
+ * abstime (of CLOCK_REALTIME), then it returns ETIMEDOUT
+ */
+int mythread_mutex_timedlock(mythread_mutex_t *m, const struct timespec *abstime) {
+	unsigned long start;
+	int timedout = 0;
+	superlock_lock();
+	if(!m->locked)
+		m->locked = 1;
+	else {
+		start = now_ns();
+		active->timedout = 0;
+		waitq_push(&m->waiters, active);
+		timeout_add(active, abstime_deadline(abstime));
+		thread_park(0);
+		timedout = active->timedout;
+		active->stats->lock_ns += now_ns() - start;
+	}
+	superlock_unlock();
+	return timedout ? ETIMEDOUT : 0;
+}
+
+/* same as mythread_mutex_lock but it returns EBUSY if m is locked
+ */
+int mythread_mutex_trylock(mythread_mutex_t *m) {
+	int status = EBUSY;
+	superlock_lock();
+	if(!m->locked) {
+		m->locked = 1;
+		status = 0;
+	}
+	superlock_unlock();
+	return status;
+}
+
+/* unlocks m or hands it over to its first waiter, called with superlock
+ * held
+ */
+static void mutex_release(mythread_mutex_t *m) {
+	struct active_thread_node *node = waitq_pop(&m->waiters);
+	if(node)
+		unpark(node);
+	else
+		m->locked = 0;
+}
+
+/* unlocks the mutex m, it returns EPERM if m is not locked
+ */
+int mythread_mutex_unlock(mythread_mutex_t *m) {
+	superlock_lock();
+	if(!m->locked) {
+		superlock_unlock();
+		return EPERM;
+	}
+	mutex_release(m);
+	superlock_unlock();
+	return 0;
+}
+
+/* initialises the condition variable c, it can also be initialised with
+ * MYTHREAD_COND_INITIALIZER
+ */
+int mythread_cond_init(mythread_cond_t *c) {
+	c->waiters.head = c->waiters.tail = NULL;
+	return 0;
+}
+
+/* returns EBUSY if some thread waits on c
+ */
+int mythread_cond_destroy(mythread_cond_t *c) {
+	return c->waiters.head ? EBUSY : 0;
+}
+
+/* unlocks m and parks the calling thread on c (atomically, no signal can
+ * be missed in between), when the thread is woken it locks m again
+ * if abstime is not NULL the thread is also woken at that time (of
+ * CLOCK_REALTIME, as for pthread_cond_timedwait) and ETIMEDOUT is returned
+ */
+int mythread_cond_timedwait(mythread_cond_t *c, mythread_mutex_t *m, const struct timespec *abstime) {
+	int timedout;
+	superlock_lock();
+	if(!m->locked) {
+		superlock_unlock();
+		return EPERM;
+	}
+	active->timedout = 0;
+	waitq_push(&c->waiters, active);
+	if(abstime)
+		timeout_add(active, abstime_deadline(abstime));
+	mutex_release(m);
+	thread_park(0);
+	timedout = active->timedout;
+	superlock_unlock();
+	mythread_mutex_lock(m);
+	return timedout ? ETIMEDOUT : 0;
+}
+
+int mythread_cond_wait(mythread_cond_t *c, mythread_mutex_t *m) {
+	return mythread_cond_timedwait(c, m, NULL);
+}
+
+/* wakes the first thread waiting on c, if any
+ */
+int mythread_cond_signal(mythread_cond_t *c) {
+	struct active_thread_node *node;
+	superlock_lock();
+	if((node = waitq_pop(&c->waiters)))
+		unpark(node);
+	superlock_unlock();
+	return 0;
+}
+
+/* wakes all threads waiting on c
+ */
+int mythread_cond_broadcast(mythread_cond_t *c) {
+	struct active_thread_node *node;
+	superlock_lock();
+	while((node = waitq_pop(&c->waiters)))
+		unpark(node);
+	superlock_unlock();
+	return 0;
+}
+
+/* channels, the ring buffer itself is lock free (see mythread.h), a cell
+ * is the sequence number followed by the element, rounded up to keep the
+ * sequence numbers aligned
+ */
+static inline char *chan_cell(mythread_chan_t *ch, unsigned long pos) {
+	return ch->cells + (pos & ch->mask) * ch->stride;
+}
+
+/* copies elem into the cell at the tail of ch, it returns EAGAIN if ch is
+ * full
+ */
+static int chan_push(mythread_chan_t *ch, const void *elem) {
+	unsigned long pos = __atomic_load_n(&ch->tail, __ATOMIC_RELAXED), seq;
+	char *cell;
+	long diff;
+	for(;;) {
+		cell = chan_cell(ch, pos);
+		seq = __atomic_load_n((unsigned long *)cell, __ATOMIC_ACQUIRE);
+		diff = (long)(seq - pos);
+		if(diff == 0) {
+			if(__atomic_compare_exchange_n(&ch->tail, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		}
+		else if(diff < 0)
+			return EAGAIN;
+		else
+			pos = __atomic_load_n(&ch->tail, __ATOMIC_RELAXED);
+	}
+	memcpy(cell + sizeof(unsigned long), elem, ch->elemsize);
+	__atomic_store_n((unsigned long *)cell, pos + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/* copies the element at the head of ch into elem and frees its cell for
+ * the sender one lap later, it returns EAGAIN if ch is empty
+ */
+static int chan_pop(mythread_chan_t *ch, void *elem) {
+	unsigned long pos = __atomic_load_n(&ch->head, __ATOMIC_RELAXED), seq;
+	char *cell;
+	long diff;
+	for(;;) {
+		cell = chan_cell(ch, pos);
+		seq = __atomic_load_n((unsigned long *)cell, __ATOMIC_ACQUIRE);
+		diff = (long)(seq - (pos + 1));
+		if(diff == 0) {
+			if(__atomic_compare_exchange_n(&ch->head, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		}
+		else if(diff < 0)
+			return EAGAIN;
+		else
+			pos = __atomic_load_n(&ch->head, __ATOMIC_RELAXED);
+	}
+	memcpy(elem, cell + sizeof(unsigned long), ch->elemsize);
+	__atomic_store_n((unsigned long *)cell, pos + ch->mask + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/* initialises the channel ch for elements of elemsize bytes, cap (rounded
+ * up to a power of two) elements can be sent before a sender blocks
+ * it returns EINVAL if cap is 0 and ENOMEM if there is no memory
+ */
+int mythread_chan_init(mythread_chan_t *ch, size_t elemsize, unsigned int cap) {
+	unsigned long n = 1, i;
+	if(!ch || !cap)
+		return EINVAL;
+	while(n < cap)
+		n <<= 1;
+	ch->stride = sizeof(unsigned long) + (elemsize + sizeof(unsigned long) - 1) / sizeof(unsigned long) * sizeof(unsigned long);
+	if(!(ch->cells = (char *)malloc(n * ch->stride)))
+		return ENOMEM;
+	for(i = 0; i < n; i++)
+		*(unsigned long *)(ch->cells + i * ch->stride) = i;
+	ch->head = ch->tail = 0;
+	ch->mask = n - 1;
+	ch->elemsize = elemsize;
+	ch->closed = 0;
+	ch->senders.head = ch->senders.tail = NULL;
+	ch->receivers.head = ch->receivers.tail = NULL;
+	ch->selecters = NULL;
+	return 0;
+}
+
+/* frees the buffer of ch, it returns EBUSY if some thread is parked on ch
+ * (also in a select with a case of ch)
+ */
+int mythread_chan_destroy(mythread_chan_t *ch) {
+	if(ch->senders.head || ch->receivers.head || ch->selecters)
+		return EBUSY;
+	free(ch->cells);
+	ch->cells = NULL;
+	return 0;
+}
+
+/* a select parked until one of the channels of its cases changes, woken
+ * is set while it runs so that it is unparked only once even if more of
+ * its channels change (or one channel is in more of its cases)
+ */
+struct chan_selecter {
+	struct active_thread_node *node;
+	int woken;
+};
+
+/* unparks the first thread of q (all of them if all is non zero) and the
+ * threads parked in mythread_chan_select with a case of ch
+ * all chan functions below are called with superlock held
+ */
+static void chan_wake(mythread_chan_t *ch, struct mythread_waitq *q, int all) {
+	struct active_thread_node *node;
+	struct chan_selecter *sel;
+	mythread_chan_case_t *c;
+	while((node = waitq_pop(q))) {
+		unpark(node);
+		if(!all)
+			break;
+	}
+	for(c = ch->selecters; c; c = c->next) {
+		sel = (struct chan_selecter *)c->waiter;
+		if(!sel->woken) {
+			sel->woken = 1;
+			unpark(sel->node);
+		}
+	}
+}
+
+static int chan_send(mythread_chan_t *ch, const void *elem) {
+	if(ch->closed)
+		return EPIPE;
+	if(chan_push(ch, elem))
+		return EAGAIN;
+	chan_wake(ch, &ch->receivers, 0);
+	return 0;
+}
+
+static int chan_recv(mythread_chan_t *ch, void *elem) {
+	if(chan_pop(ch, elem))
+		return ch->closed ? EPIPE : EAGAIN;
+	chan_wake(ch, &ch->senders, 0);
+	return 0;
+}
+
+/* sends a copy of elem on ch without blocking, it returns EAGAIN if ch is
+ * full and EPIPE if ch is closed
+ */
+int mythread_chan_try_send(mythread_chan_t *ch, const void *elem) {
+	int status;
+	superlock_lock();
+	status = chan_send(ch, elem);
+	superlock_unlock();
+	return status;
+}
+
+/* receives an element of ch into elem without blocking, it returns EAGAIN
+ * if ch is empty and EPIPE if ch is also closed (elements sent before the
+ * channel was closed are still received)
+ */
+int mythread_chan_try_recv(mythread_chan_t *ch, void *elem) {
+	int status;
+	superlock_lock();
+	status = chan_recv(ch, elem);
+	superlock_unlock();
+	return status;
+}
+
+/* sends a copy of elem on ch, a sender which finds ch full is parked
+ * until a receiver makes room
+ * it returns 0, or EPIPE if ch is closed
+ */
+int mythread_chan_send(mythread_chan_t *ch, const void *elem) {
+	int status;
+	superlock_lock();
+	while((status = chan_send(ch, elem)) == EAGAIN) {
+		waitq_push(&ch->senders, active);
+		thread_park(0);
+	}
+	superlock_unlock();
+	return status;
+}
+
+/* receives an element of ch into elem, a receiver which finds ch empty is
+ * parked until a sender sends something
+ * it returns 0, or EPIPE if ch is closed and empty
+ */
+int mythread_chan_recv(mythread_chan_t *ch, void *elem) {
+	int status;
+	superlock_lock();
+	while((status = chan_recv(ch, elem)) == EAGAIN) {
+		waitq_push(&ch->receivers, active);
+		thread_park(0);
+	}
+	superlock_unlock();
+	return status;
+}
+
+/* closes ch, sends fail from now on and receives fail once ch is empty,
+ * all parked senders and receivers are woken
+ * it returns EINVAL if ch is already closed
+ */
+int mythread_chan_close(mythread_chan_t *ch) {
+	superlock_lock();
+	if(ch->closed) {
+		superlock_unlock();
+		return EINVAL;
+	}
+	ch->closed = 1;
+	chan_wake(ch, &ch->senders, 1);
+	chan_wake(ch, &ch->receivers, 1);
+	superlock_unlock();
+	return 0;
+}
+
+/* links the cases of the select sel into the selecters of their channels
+ * (or unlinks them if link is 0)
+ */
+static void chan_select_link(mythread_chan_case_t *cases, int n, struct chan_selecter *sel, int link) {
+	mythread_chan_case_t **p;
+	int i;
+	for(i = 0; i < n; i++) {
+		if(!cases[i].ch)
+			continue;
+		if(link) {
+			cases[i].waiter = sel;
+			cases[i].next = cases[i].ch->selecters;
+			cases[i].ch->selecters = &cases[i];
+			continue;
+		}
+		for(p = &cases[i].ch->selecters; *p && *p != &cases[i]; p = &(*p)->next)
+			;
+		if(*p)
+			*p = cases[i].next;
+	}
+}
+
+/* waits until one of the n cases can be done (like select of go), does it
+ * and returns its index, if more cases are ready one of them is chosen
+ * in round robin
+ * if block is 0 it returns -1 at once when no case is ready
+ * a blocked select links its cases into their channels and is parked
+ * until one of these channels (and no other) changes
+ */
+int mythread_chan_select(mythread_chan_case_t *cases, int n, int block) {
+	struct chan_selecter sel;
+	int i = -1, k, status, linked = 0;
+	superlock_lock();
+	__chan_selectrr++;
+	sel.node = active;
+	sel.woken = 1;
+	for(;;) {
+		for(k = 0; k < n; k++) {
+			i = (__chan_selectrr + k) % n;
+			if(!cases[i].ch)
+				continue;
+			if(cases[i].op == MYTHREAD_CHAN_SEND)
+				status = chan_send(cases[i].ch, cases[i].elem);
+			else
+				status = chan_recv(cases[i].ch, cases[i].elem);
+			if(status != EAGAIN) {
+				cases[i].status = status;
+				break;
+			}
+		}
+		if(k < n || !block) {
+			if(k == n)
+				i = -1;
+			break;
+		}
+		if(!linked) {
+			chan_select_link(cases, n, &sel, 1);
+			linked = 1;
+		}
+		sel.woken = 0;
+		thread_park(0);
+		sel.woken = 1;
+	}
+	if(linked)
+		chan_select_link(cases, n, &sel, 0);
+	superlock_unlock();
+	return i;
+}
+
+/* sets the time slice of threads to usec microseconds (the target latency
+ * in adaptive mode), it returns the previous quantum or -1 if usec is not
+ * positive
+ */
+long mythread_timer_setquantum(long usec) {
+	long old;
+	if(usec <= 0)
+		return -1;
+	superlock_lock();
+	old = __quantum;
+	__quantum = usec;
+	timer_update();
+	superlock_unlock();
+	return old;
+}
+
+/* turns the adaptive mode on (adaptive non zero) or off, it returns the
+ * previous mode
+ */
+int mythread_timer_setadaptive(int adaptive) {
+	int old;
+	superlock_lock();
+	old = __adaptive;
+	__adaptive = adaptive;
+	timer_update();
+	superlock_unlock();
+	return old;
+}
+
+/* sets the number of stacks (and of thread structures) kept in the pool
+ * for reuse, extra cached blocks are freed, it returns the previous limit
+ * the initial limit is MYTHREAD_POOL_CAP or the value of the environment
+ * variable MYTHREAD_POOL_CAP
+ */
+int mythread_pool_setcap(int cap) {
+	int old;
+	void *p;
+	if(cap < 0)
+		return -1;
+	superlock_lock();
+	old = __pool.cap;
+	__pool.cap = cap;
+	while(__pool.nstacks > cap) {
+		p = __pool.stacks;
+		__pool.stacks = *(void **)p;
+		__pool.nstacks--;
+		free(p);
+	}
+	while(__pool.ndescs > cap) {
+		p = __pool.descs;
+		__pool.descs = *(void **)p;
+		__pool.ndescs--;
+		free(p);
+	}
+	superlock_unlock();
+	return old;
+}
+
+/* copies the counters of the pool in the structure pointed by stats
+ */
+void mythread_pool_getstats(struct mythread_pool_stats *stats) {
+	superlock_lock();
+	stats->stack_hits = __pool.stack_hits;
+	stats->stack_misses = __pool.stack_misses;
+	stats->desc_hits = __pool.desc_hits;
+	stats->desc_misses = __pool.desc_misses;
+	stats->stacks = __pool.nstacks;
+	stats->descs = __pool.ndescs;
+	stats->cap = __pool.cap;
+	superlock_unlock();
+}
+
+/* copies the counters of thread t (the main thread if t is NULL) in
+ * stats, the run time of the active thread includes its current slice
+ * called with superlock held
+ */
+static void stats_copy(struct mythread_struct *t, struct mythread_thread_stats *stats) {
+	*stats = t ? t->stats : __mainstats;
+	stats->id = t ? t->id : 0;
+	stats->state = t ? t->state : THREAD_RUNNING;
+	if((t ? t->node : mainthread) == active)
+		stats->run_ns += now_ns() - __slice_start;
+}
+
+/* copies the counters of the thread mythread (0 for the main thread) in
+ * stats, it returns ESRCH if there is no such thread
+ * the counters of a terminated thread stay until it is collected
+ */
+int mythread_stats(mythread_t mythread, struct mythread_thread_stats *stats) {
+	struct mythread_struct *t = NULL;
+	superlock_lock();
+	if(mythread && !(t = table_lookup(mythread))) {
+		superlock_unlock();
+		return ESRCH;
+	}
+	stats_copy(t, stats);
+	superlock_unlock();
+	return 0;
+}
+
+static void sched_stats(struct mythread_sched_stats *stats) {
+	*stats = __stats;
+	stats->threads = __current;
+	stats->runnable = __runq_len + 1;
+}
+
+/* copies the counters of the scheduler in stats
+ */
+void mythread_sched_stats(struct mythread_sched_stats *stats) {
+	superlock_lock();
+	sched_stats(stats);
+	superlock_unlock();
+}
+
+/* writes the snapshot of n threads and of the scheduler to path, first
+ * to a temporary file which is then renamed over path, so a reader (like
+ * a top of the threads) never sees a half written snapshot
+ * every line is a json object, the first one has the counters of the
+ * scheduler and every other one those of a thread
+ * it returns 0 or the errno of the failed call
+ */
+static int stats_write(const char *path, struct mythread_sched_stats *s, struct mythread_thread_stats *threads, int n) {
+	char tmp[sizeof(__export_path) + 8];
+	FILE *fp;
+	int i;
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	if(!(fp = fopen(tmp, "w")))
+		return errno;
+	fprintf(fp, "{\"pid\": %d, \"time_ns\": %lu, \"threads\": %d, \"runnable\": %d, \"switches\": %lu, "
+		"\"preemptions\": %lu, \"created\": %lu, \"exited\": %lu, \"idle_ns\": %lu}\n",
+		getpid(), now_ns(), s->threads, s->runnable, s->switches, s->preemptions, s->created, s->exited, s->idle_ns);
+	for(i = 0; i < n; i++)
+		fprintf(fp, "{\"id\": %lu, \"state\": %d, \"run_ns\": %lu, \"wait_ns\": %lu, \"lock_ns\": %lu, "
+			"\"switches\": %lu, \"preempted\": %lu, \"signals\": %lu}\n",
+			threads[i].id, threads[i].state, threads[i].run_ns, threads[i].wait_ns, threads[i].lock_ns,
+			threads[i].switches, threads[i].preempted, threads[i].signals);
+	if(fclose(fp) == EOF || rename(tmp, path) == -1)
+		return errno;
+	return 0;
+}
+
+/* takes a snapshot of all threads which are not collected and writes it
+ * to path, the counters are copied with superlock held and written
+ * without it
+ */
+static int stats_snapshot(const char *path) {
+	struct mythread_thread_stats *threads;
+	struct mythread_sched_stats s;
+	struct mythread_struct *t;
+	int i, n = 0, status;
+	superlock_lock();
+	threads = (struct mythread_thread_stats *)malloc((__table_size + 1) * sizeof(struct mythread_thread_stats));
+	if(!threads) {
+		superlock_unlock();
+		return ENOMEM;
+	}
+	stats_copy(NULL, &threads[n++]);
+	for(i = 0; i < __table_size; i++)
+		if((t = table_slot(i)->thread))
+			stats_copy(t, &threads[n++]);
+	sched_stats(&s);
+	superlock_unlock();
+	status = stats_write(path, &s, threads, n);
+	free(threads);
+	return status;
+}
+
+/* the exporter thread writes a snapshot every __export_interval
+ * milliseconds until the export is stopped, meanwhile it is parked with a
+ * timeout and takes no cpu
+ */
+static void *stats_exporter(void *arg) {
+	char path[sizeof(__export_path)];
+	while(1) {
 		superlock_lock();
-		thiscontext = active->c;
-		__allthreads[cur][locind]->state = THREAD_TERMINATED;
-		__allthreads[cur][locind]->returnval = returnval;
-		if(active->next == mainthread)
-			last = previous;
-		previous->next = active->next;
-		free(active);
-		active = mainthread;
-		previous = last;
-		__current--;
-		if(__current == 1)
-			ualarm(0, 0);
-		swapcontext(thiscontext, &maincontext);
+		if(!__export_interval) {
+			__exporting = 0;
+			superlock_unlock();
+			break;
+		}
+		memcpy(path, __export_path, sizeof(path));
 		superlock_unlock();
+		stats_snapshot(path);
+		mythread_sleep_ns(__export_interval * 1000000UL);
+	}
+	return NULL;
+}
+
+/* exports the counters of all threads and of the scheduler to the file
+ * path (for example in /dev/shm), so that other processes can watch them
+ * if interval_ms is positive a thread rewrites the file every interval_ms
+ * milliseconds (calling it again only changes path and interval), else
+ * the file is written once now, if path is NULL the periodic export stops
+ * it returns 0, ENAMETOOLONG if path is too long, EAGAIN if the exporter
+ * thread can not be created or the errno of writing the file
+ */
+int mythread_stats_export(const char *path, long interval_ms) {
+	mythread_t exporter;
+	mythread_attr_t attr;
+	int start;
+	if(!path) {
+		superlock_lock();
+		__export_interval = 0;
+		superlock_unlock();
+		return 0;
+	}
+	if(strlen(path) >= sizeof(__export_path))
+		return ENAMETOOLONG;
+	if(interval_ms <= 0)
+		return stats_snapshot(path);
+	superlock_lock();
+	start = !__exporting;
+	__exporting = 1;
+	strcpy(__export_path, path);
+	__export_interval = interval_ms;
+	superlock_unlock();
+	mythread_attr_init(&attr);
+	mythread_attr_setdetached(&attr, 1);
+	if(start && mythread_create_attr(&exporter, &attr, stats_exporter, NULL) == -1) {
+		superlock_lock();
+		__exporting = 0;
+		__export_interval = 0;
+		superlock_unlock();
+		return EAGAIN;
+	}
+	return 0;
+}
+
+/* starts recording scheduler events in a ring of events entries (rounded
+ * up to a power of two, MYTHREAD_TRACE_EVENTS if 0), when the ring is
+ * full the oldest events are overwritten
+ * the ring is allocated by the first call, later calls only clear it, so
+ * a thread recording while tracing is restarted never writes to freed
+ * memory
+ * it returns 0 or ENOMEM
+ */
+int mythread_trace_start(unsigned long events) {
+	unsigned long size = 1;
+	__tracing = 0;
+	if(!__trace.events) {
+		if(!events)
+			events = MYTHREAD_TRACE_EVENTS;
+		while(size < events)
+			size <<= 1;
+		__trace.events = (struct mythread_trace_event *)malloc(size * sizeof(struct mythread_trace_event));
+		if(!__trace.events)
+			return ENOMEM;
+		__trace.mask = size - 1;
+	}
+	__trace.head = 0;
+	__trace_ns = now_ns();
+	__trace_tsc = trace_clock();
+	__tracing = 1;
+	trace(MYTHREAD_TRACE_SWITCH_IN, active ? active->thread : 0, 0);
+	return 0;
+}
+
+/* stops recording, the recorded events stay until the next start
+ */
+void mythread_trace_stop(void) {
+	__tracing = 0;
+}
+
+/* writes event e as a json object of the chrome trace event format,
+ * a thread runs between its switch in and switch out (a duration event
+ * on the track of the thread) and all other events are instants, us is
+ * the number of microseconds of one tick of the time stamp counter
+ */
+static void trace_write(FILE *fp, struct mythread_trace_event *e, double us, int first) {
+	static const char *names[] = {"create", "run", "run", "block", "wake", "signal", "exit"};
+	static const char phases[] = "iBEiiii";
+	if(e->type > MYTHREAD_TRACE_EXIT)
+		return;
+	fprintf(fp, "%s\n{\"name\": \"%s\", \"ph\": \"%c\", %s\"pid\": %d, \"tid\": %lu, \"ts\": %.3f, "
+		"\"args\": {\"cpu\": %u, \"arg\": %lu}}", first ? "" : ",", names[e->type], phases[e->type],
+		phases[e->type] == 'i' ? "\"s\": \"t\", " : "", getpid(), e->thread,
+		(double)(e->ts - __trace_tsc) * us, e->cpu, e->arg);
+}
+
+/* writes the recorded events to path in the chrome trace event format,
+ * which chrome://tracing and the perfetto ui can open, the time stamps
+ * are converted to microseconds since the start of the trace by
+ * comparing the time stamp counter with the monotonic clock
+ * it is best called after mythread_trace_stop, events recorded while it
+ * runs may be missing
+ * it returns 0, EINVAL if nothing was traced or the errno of writing
+ */
+int mythread_trace_dump(const char *path) {
+	unsigned long i, start, head = __trace.head, tsc = trace_clock(), ns = now_ns();
+	double us = tsc > __trace_tsc ? (double)(ns - __trace_ns) / (tsc - __trace_tsc) / 1000 : 0;
+	FILE *fp;
+	if(!__trace.events)
+		return EINVAL;
+	if(!(fp = fopen(path, "w")))
+		return errno;
+	start = head > __trace.mask ? head - __trace.mask - 1 : 0;
+	fprintf(fp, "{\"traceEvents\": [");
+	for(i = start; i < head; i++)
+		trace_write(fp, &__trace.events[i & __trace.mask], us, i == start);
+	fprintf(fp, "\n]}\n");
+	if(fclose(fp) == EOF)
+		return errno;
+	return 0;
+}
+
+/* dumps the trace started by MYTHREAD_TRACE when the process exits
+ */
+static void trace_atexit() {
+	mythread_trace_stop();
+	mythread_trace_dump(__trace_path);
+}
+
+/* runs part (out of f->nparts parts) of the loop f, the chunks of a
+ * static loop are fixed in advance (blocks of grain iterations dealt round
+ * robin, or one equal block per part if grain is 0), the other schedules
+ * take chunks from f->next: dynamic ones always grain iterations, guided
+ * ones a share of the remaining iterations which shrinks down to grain
+ */
+static void for_run(struct mythread_for *f, int part) {
+	long lo, chunk, n;
+	long grain = f->grain > 0 ? f->grain : 1;
+	switch(f->schedule) {
+		case MYTHREAD_FOR_STATIC:
+			if(f->grain <= 0) {
+				n = f->end - f->begin;
+				lo = f->begin + n * part / f->nparts;
+				if(lo < f->begin + n * (part + 1) / f->nparts)
+					f->fn(lo, f->begin + n * (part + 1) / f->nparts, f->ctx);
+				break;
+			}
+			for(lo = f->begin + part * grain; lo < f->end; lo += f->nparts * grain)
+				f->fn(lo, lo + grain < f->end ? lo + grain : f->end, f->ctx);
+			break;
+		case MYTHREAD_FOR_GUIDED:
+			lo = __atomic_load_n(&f->next, __ATOMIC_RELAXED);
+			while(lo < f->end) {
+				chunk = (f->end - lo) / (2 * f->nparts);
+				if(chunk < grain)
+					chunk = grain;
+				if(__atomic_compare_exchange_n(&f->next, &lo, lo + chunk, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+					f->fn(lo, lo + chunk < f->end ? lo + chunk : f->end, f->ctx);
+					lo = __atomic_load_n(&f->next, __ATOMIC_RELAXED);
+				}
+			}
+			break;
+		default:
+			while((lo = __atomic_fetch_add(&f->next, grain, __ATOMIC_RELAXED)) < f->end)
+				f->fn(lo, lo + grain < f->end ? lo + grain : f->end, f->ctx);
+			break;
 	}
 }
 
+/* calls fn(lo, hi, ctx) for chunks [lo, hi) which together cover the
+ * iterations [begin, end), the chunks are run in parallel with the dynamic
+ * schedule (grain iterations at a time), it returns when all chunks are
+ * done, 0 on success and EINVAL for a wrong schedule
+ */
+int mythread_parallel_for(long begin, long end, long grain, void (*fn)(long, long, void *), void *ctx) {
+	return mythread_parallel_for_sched(begin, end, grain, MYTHREAD_FOR_DYNAMIC, fn, ctx);
+}
+
+/* same as mythread_parallel_for with the given schedule
+ * all many-one threads share one kernel thread, so more threads would not
+ * make the loop faster: it is run as a single part by the calling thread
+ */
+int mythread_parallel_for_sched(long begin, long end, long grain, int schedule, void (*fn)(long, long, void *), void *ctx) {
+	struct mythread_for f;
+	if(schedule != MYTHREAD_FOR_STATIC && schedule != MYTHREAD_FOR_DYNAMIC && schedule != MYTHREAD_FOR_GUIDED)
+		return EINVAL;
+	if(begin >= end)
+		return 0;
+	f.begin = f.next = begin;
+	f.end = end;
+	f.grain = grain;
+	f.schedule = schedule;
+	f.fn = fn;
+	f.ctx = ctx;
+	f.nparts = 1;
+	for_run(&f, 0);
+	return 0;
+}
+
 /* initialises the mythread_spinlock_t pointed by lock
  */
-inline int mythread_spin_init(mythread_spinlock_t *lock) {
-	*lock = 0;
+int mythread_spin_init(mythread_spinlock_t *lock) {
+	lock->owner = lock->next = 0;
+	lock->holder = 0;
+	lock->waiters = NULL;
 	return 0;
 }
 
-/* aquires the lock on mythread_spinlock_t pointed by lock, 
- * if the lock is already held by another thread, then it continuously
- * loops until lock is freed again
+/* returns the id of the calling thread without taking the superlock, only
+ * the calling thread switches active away from itself
  */
-inline int mythread_spin_lock(mythread_spinlock_t *lock) {
-	if(*lock != 0 || *lock != 1)
+static inline mythread_t lock_holder() {
+	return active ? active->thread : 0;
+}
+
+/* counts the time since start in the lock wait time of the calling thread
+ */
+static inline void lock_waited(unsigned long start) {
+	if(active)
+		active->stats->lock_ns += now_ns() - start;
+}
+
+/* aquires the lock on mythread_spinlock_t pointed by lock,
+ * if the lock is held the caller takes a ticket, so waiters get the lock
+ * in the order they came, and while its ticket is not served it gives the
+ * cpu to the holder of the lock, so the holder gets to release the lock
+ * after a single switch instead of after the waiter has spun for its
+ * whole time slice
+ */
+int mythread_spin_lock(mythread_spinlock_t *lock) {
+	struct mythread_spinwaiter w, **p;
+	unsigned long start;
+	if(!lock)
 		return EINVAL;
-	while(__sync_lock_test_and_set(lock, 1));
+	if(ticket_trylock(lock)) {
+		lock->holder = lock_holder();
+		return 0;
+	}
+	start = now_ns();
+	superlock_lock();
+	w.thread = lock_holder();
+	w.ticket = __atomic_fetch_add(&lock->next, 1, __ATOMIC_RELAXED);
+	w.next = lock->waiters;
+	lock->waiters = &w;
+	superlock_unlock();
+	while(__atomic_load_n(&lock->owner, __ATOMIC_ACQUIRE) != w.ticket)
+		mythread_yield_to(lock->holder);
+	superlock_lock();
+	for(p = &lock->waiters; *p != &w; p = &(*p)->next)
+		;
+	*p = w.next;
+	superlock_unlock();
+	lock->holder = w.thread;
+	lock_waited(start);
 	return 0;
 }
 
+/* makes the waiter with ticket (if there is one) the holder of lock
+ * called with superlock held
+ */
+static void spin_handover(mythread_spinlock_t *lock, unsigned short ticket) {
+	struct mythread_spinwaiter *w;
+	for(w = lock->waiters; w && w->ticket != ticket; w = w->next)
+		;
+	if(w)
+		lock->holder = w->thread;
+}
+
 /* frees the mythread_spinlock_t pointed by lock
+ * if some thread waits, the one with the next ticket becomes the holder
+ * right away, so the other waiters give the cpu to it and not to the
+ * thread which has left
+ * a waiter may link itself after waiters was found empty, so it is read
+ * again after the unlock and the holder is fixed then (under superlock
+ * owner can not move, the waiter with ticket owner is the holder)
  */
-inline int mythread_spin_unlock(mythread_spinlock_t *lock) {
-	if(*lock != 1)
+int mythread_spin_unlock(mythread_spinlock_t *lock) {
+	if(!lock || lock->owner == lock->next)
 		return EINVAL;
-	__sync_synchronize();
-	*lock = 0;
+	if(!lock->waiters) {
+		ticket_unlock(lock);
+		if(!__atomic_load_n(&lock->waiters, __ATOMIC_ACQUIRE))
+			return 0;
+		superlock_lock();
+		spin_handover(lock, lock->owner);
+		superlock_unlock();
+		return 0;
+	}
+	superlock_lock();
+	spin_handover(lock, lock->owner + 1);
+	ticket_unlock(lock);
+	superlock_unlock();
 	return 0;
 }
 
-/* same as mythread_spin_lock with the difference that if the lock is 
+/* same as mythread_spin_lock with the difference that if the lock is
  * held by some another thread, it returns immediately with the error
  * number EBUSY
  */
-inline int mythread_spin_trylock(mythread_spinlock_t *lock) {
-	return __sync_lock_test_and_set(lock, 1) ? EBUSY : 0;
+int mythread_spin_trylock(mythread_spinlock_t *lock) {
+	if(!lock)
+		return EINVAL;
+	if(!ticket_trylock(lock))
+		return EBUSY;
+	lock->holder = lock_holder();
+	return 0;
+}
+
+/* initialises the mythread_mcslock_t pointed by lock
+ */
+int mythread_mcs_init(mythread_mcslock_t *lock) {
+	lock->tail = NULL;
+	lock->holder = 0;
+	return 0;
+}
+
+/* aquires lock using node, which must be owned by the caller until it
+ * unlocks, the caller links node behind the current tail and waits until
+ * its predecessor hands the lock over, giving the cpu to the holder of
+ * the lock meanwhile (like mythread_spin_lock)
+ */
+int mythread_mcs_lock(mythread_mcslock_t *lock, mythread_mcsnode_t *node) {
+	mythread_mcsnode_t *prev;
+	unsigned long start;
+	if(!lock || !node)
+		return EINVAL;
+	node->next = NULL;
+	node->locked = 1;
+	node->thread = lock_holder();
+	prev = __atomic_exchange_n(&lock->tail, node, __ATOMIC_ACQ_REL);
+	if(prev) {
+		__atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+		start = now_ns();
+		while(__atomic_load_n(&node->locked, __ATOMIC_ACQUIRE))
+			mythread_yield_to(lock->holder);
+		lock_waited(start);
+		return 0;
+	}
+	lock->holder = node->thread;
+	return 0;
+}
+
+/* releases lock, which must have been aquired with node, to the next
+ * waiter, if a waiter has swapped the tail but not linked itself yet
+ * it waits for the link
+ * the next waiter becomes the holder right away, so the other waiters
+ * give the cpu to it and not to the thread which has left
+ */
+int mythread_mcs_unlock(mythread_mcslock_t *lock, mythread_mcsnode_t *node) {
+	mythread_mcsnode_t *next, *expected = node;
+	if(!lock || !node || !lock->tail)
+		return EINVAL;
+	if(!(next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE))) {
+		if(__atomic_compare_exchange_n(&lock->tail, &expected, NULL, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+			return 0;
+		while(!(next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE)))
+			spin_yield();
+	}
+	lock->holder = next->thread;
+	__atomic_store_n(&next->locked, 0, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/* same as mythread_mcs_lock but returns EBUSY if the lock is held
+ */
+int mythread_mcs_trylock(mythread_mcslock_t *lock, mythread_mcsnode_t *node) {
+	mythread_mcsnode_t *expected = NULL;
+	if(!lock || !node)
+		return EINVAL;
+	node->next = NULL;
+	node->locked = 0;
+	node->thread = lock_holder();
+	if(!__atomic_compare_exchange_n(&lock->tail, &expected, node, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return EBUSY;
+	lock->holder = lock_holder();
+	return 0;
 }
@@ -11,9 +11,82 @@
 #define MYTHREAD_MANY_ONE
 
 #include <signal.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <time.h>
 #include <sys/ucontext.h>
 
 #define STACK_SIZE (1024 * 1024)
+#define MYTHREAD_QUANTUM 10000		//default time slice in microseconds
+#define MYTHREAD_MIN_SLICE 1000		//shortest slice in microseconds in adaptive mode
+#define MYTHREAD_LIBC_RANGES 16		//executable segments of libc and the allocator in which ticks are skipped
+#define MYTHREAD_POOL_CAP 64		//default number of stacks and structures cached for reuse
+#define MYTHREAD_TABLE_CHUNK 1024		//slots in one chunk of the thread table
+#define MYTHREAD_TABLE_CHUNKS 4096		//chunks in the thread table, so 4M threads can be alive at once
+
+/* the timer wheel which wakes sleeping threads and timeouts counts in
+ * ticks of 2^MYTHREAD_WHEEL_SHIFT nanoseconds, its first level has a slot
+ * for each of the next 2^MYTHREAD_WHEEL_BITS0 ticks and every further
+ * level has 2^MYTHREAD_WHEEL_BITS slots, each as long as a whole turn of
+ * the level below, so 4 levels cover about 19 hours (later deadlines
+ * wait in the last level until they come within range)
+ */
+#define MYTHREAD_WHEEL_SHIFT 20			//a tick of the wheel is about 1 ms
+#define MYTHREAD_WHEEL_BITS0 8
+#define MYTHREAD_WHEEL_BITS 6
+#define MYTHREAD_WHEEL_LEVELS 4
+
+/* a waiter of a ticket spinlock pauses MYTHREAD_SPIN_BACKOFF times for
+ * every waiter ahead of it before it looks at the lock again, up to
+ * MYTHREAD_SPIN_BACKOFF_MAX times, and yields after MYTHREAD_SPIN_YIELD
+ * such rounds
+ */
+#define MYTHREAD_SPIN_BACKOFF 32
+#define MYTHREAD_SPIN_BACKOFF_MAX 4096
+#define MYTHREAD_SPIN_YIELD 8			//rounds of backoff after which a waiter yields the cpu
+
+/* on x86-64 and aarch64 threads are switched by __mythread_switch which
+ * only saves the callee saved registers, other architectures fall back
+ * to swapcontext
+ */
+#if defined(__x86_64__) || defined(__aarch64__)
+#define MYTHREAD_FAST_SWITCH
+#endif
+
+/* modes of mythread_init_mode, in cooperative mode threads are switched
+ * only when they yield or block
+ */
+#define MYTHREAD_PREEMPTIVE 0
+#define MYTHREAD_COOPERATIVE 1
+
+/* priorities of threads, like nice values a smaller number means a
+ * higher priority (a larger share of cpu)
+ */
+#define MYTHREAD_PRIO_HIGHEST (-20)
+#define MYTHREAD_PRIO_LOWEST 19
+#define MYTHREAD_PRIO_DEFAULT 0
+
+/* schedules of mythread_parallel_for_sched, like the schedules of openmp
+ * a static loop gives every part fixed chunks, a dynamic one hands out
+ * chunks of grain iterations on demand and a guided one hands out chunks
+ * which shrink from 1 / (2 * parts) of the remaining iterations to grain
+ */
+#define MYTHREAD_FOR_STATIC 0
+#define MYTHREAD_FOR_DYNAMIC 1
+#define MYTHREAD_FOR_GUIDED 2
+
+/* kinds of events recorded by the tracer, thread is the thread the event
+ * happened to and arg depends on the kind
+ */
+#define MYTHREAD_TRACE_CREATE 0			//thread created the thread arg
+#define MYTHREAD_TRACE_SWITCH_IN 1		//thread was switched in
+#define MYTHREAD_TRACE_SWITCH_OUT 2		//thread was switched out, arg is 1 if it was preempted
+#define MYTHREAD_TRACE_BLOCK 3			//thread stopped being runnable, arg is the thread it joins (if any)
+#define MYTHREAD_TRACE_WAKE 4			//thread became runnable again
+#define MYTHREAD_TRACE_SIGNAL 5			//the signal arg was delivered to thread
+#define MYTHREAD_TRACE_EXIT 6			//thread terminated
+#define MYTHREAD_TRACE_EVENTS 65536		//default size of a ring of MYTHREAD_TRACE
 
 /* these defines denote various states that a thread can 
  * have, an enumeration of these values will be equally 
@@ -24,34 +97,103 @@
 #define THREAD_TERMINATED 0x2	//thread terminated
 #define THREAD_JOIN_CALLED 0x3	//some other thread called join on that thread
 #define THREAD_COLLECTED 0x4	//the thread is already collected by some thread
+#define THREAD_DETACHED 0x5		//thread is running and will never be joined
 
-/* mythread_t stores the index of the thread in the 2d 
- * array of thread pointers
- * for this, just one unsigned number storage is enough
- * same for spinlock type mythread_spinlock_t which will
- * only take values 0 and 1
+/* mythread_t stores the index of the slot of the thread in the thread
+ * table (plus one, so that 0 is the main thread) in its low 32 bits and
+ * the generation of that slot in its high 32 bits
  */
 typedef unsigned long int mythread_t;
-typedef volatile unsigned short int mythread_spinlock_t;
 
-/* pending signals to a thread for which the handler will
- * be activated once that thread comes in running (its context
- * is currently in action)
- * it also contains a pointers to the next structure along with 
- * the signal number to form a queue data structure
+/* a ticket spinlock, a locker takes the next ticket and waits until
+ * owner reaches it, so the lock is handed over in fifo order
+ * it is unlocked when owner equals next
+ * holder is the thread which holds the lock, a waiter does not spin (the
+ * holder can not run meanwhile on the only kernel thread) but gives the
+ * cpu directly to the holder
+ * a thread which has to wait takes its ticket with superlock held and
+ * links itself in waiters, so the unlocker knows whose ticket is next and
+ * makes it the holder right away (like mythread_mcs_unlock)
  */
-struct pending_signal_node {	
-	int sig;
-	struct pending_signal_node *next;
+struct mythread_spinwaiter {
+	mythread_t thread;
+	unsigned short ticket;
+	struct mythread_spinwaiter *next;
 };
 
-/* a queue data structure which holds head and tail pointers 
- * to the node structures containing signal numbers of the signals
- * which are pending to a thread
+typedef struct mythread_spinlock {
+	volatile unsigned short owner, next;
+	volatile mythread_t holder;
+	struct mythread_spinwaiter *waiters;	//threads waiting for their ticket (used internally)
+} mythread_spinlock_t;
+
+/* a queued (mcs) spinlock, every locker passes its own node which is
+ * linked behind tail and spins only on the locked flag of that node,
+ * so waiters do not share a cache line with each other or the lock
+ * the node must stay valid until mythread_mcs_unlock has returned
  */
-typedef struct pending_signals_queue {
-	struct pending_signal_node *head, *tail;
-} pending_signals_queue;
+typedef struct mythread_mcsnode {
+	struct mythread_mcsnode *volatile next;
+	volatile int locked;
+	mythread_t thread;				//the waiting thread, it becomes the holder at handover
+} __attribute__((aligned(64))) mythread_mcsnode_t;
+
+typedef struct mythread_mcslock {
+	mythread_mcsnode_t *volatile tail;
+	volatile mythread_t holder;
+} mythread_mcslock_t;
+
+#define MYTHREAD_SPINLOCK_INITIALIZER {0, 0, 0, NULL}
+#define MYTHREAD_MCSLOCK_INITIALIZER {NULL, 0}
+
+/* saved state of a thread which is not running
+ * with the fast switch it is only the stack pointer, the registers are
+ * pushed on the stack of the thread itself
+ * mask is the signal mask the thread had when it was switched out, it is
+ * set again only if it differs from the mask of the thread switching to it
+ */
+struct mythread_context {
+#ifdef MYTHREAD_FAST_SWITCH
+	void *sp;
+#else
+	ucontext_t uc;
+#endif
+	sigset_t mask;
+};
+
+/* counters of one thread, returned by mythread_stats
+ * run_ns is the time the thread has run and wait_ns the time it was
+ * runnable while other threads ran, lock_ns the time it waited for
+ * mutexes and spinlocks
+ * switches counts the times it was switched out, preempted those of them
+ * forced by the tick (the others were voluntary: it yielded, blocked or
+ * waited), signals counts the signals delivered to its handlers
+ */
+struct mythread_thread_stats {
+	mythread_t id;
+	int state;
+	unsigned long run_ns, wait_ns, lock_ns;
+	unsigned long switches, preempted;
+	unsigned long signals;
+};
+
+/* counters of the whole scheduler, returned by mythread_sched_stats
+ * idle_ns is the time in which no thread was runnable, threads and
+ * runnable are the numbers of threads which have not terminated and of
+ * those which are running or ready to run
+ */
+struct mythread_sched_stats {
+	unsigned long switches, preemptions;
+	unsigned long created, exited;
+	unsigned long idle_ns;
+	int threads, runnable;
+};
+
+/* a fifo queue of parked threads
+ */
+struct mythread_waitq {
+	struct active_thread_node *head, *tail;
+};
 
 /* a structure which will store information about one thread
  * only
@@ -64,30 +206,180 @@ typedef struct pending_signals_queue {
  */
 struct mythread_struct {
 	int state;
+	mythread_t id;
 	void *(*fun)(void *);
 	void *args;
 	void *returnval;
 	__sighandler_t handlers[32];
-	ucontext_t thread_context;
-	pending_signals_queue pending_signals;
+	struct mythread_context thread_context;
+	void *stack;
+	volatile unsigned int pending;		//signals sent to the thread and not yet delivered, one bit per signal
+	struct active_thread_node *node;	//node of the thread while it is active
+	struct mythread_thread_stats stats;
+	struct mythread_waitq joiners;		//threads parked in mythread_join until this one terminates
+};
+
+/* a slot of the thread table, gen is increased every time the slot is
+ * freed and next links the free slots
+ */
+struct mythread_slot {
+	struct mythread_struct *thread;
+	volatile unsigned int gen;
+	int next;
 };
 
 /* those threads which have completed their execution need not be 
  * included in context switching when SIGALRM is received
- * so maintaining a different list of active threads is necessary 
- * still all threads which were created will NOT be freed as 
- * user may still call functions on them
+ * so maintaining a different set of active threads is necessary 
+ * the mythread_struct of a thread is kept until it is joined (or until
+ * it has exited if it is detached) as user may still call functions on it
+ * vruntime is the cpu time used by the thread in nanoseconds, scaled by
+ * the weight of its priority, the scheduler runs the thread with the
+ * smallest vruntime
+ * a parked thread may wait in a wait queue (linked by next) and with a
+ * timeout (linked by tnext in a slot of the timer wheel, tprev points to
+ * the link to it, deadline is 0 if there is no timeout)
+ * stats points to the counters of the thread (they outlive the node) and
+ * ready is the time when the thread last became runnable
  */
 struct active_thread_node {
 	mythread_t thread;
-	ucontext_t *c;
-	struct active_thread_node *next;
+	struct mythread_context *c;
+	struct mythread_thread_stats *stats;
+	unsigned long ready;
+	unsigned long vruntime;
+	unsigned int weight;
+	int priority;
+	int runqi;								//index of the node in the run queue heap while it is in it
+	struct active_thread_node *next, *tnext, **tprev;
+	struct mythread_waitq *waitq;
+	unsigned long deadline;
+	int timedout;
+};
+
+/* a blocking mutex, threads which wait for it are parked in waiters and
+ * take no cpu
+ */
+typedef struct mythread_mutex {
+	int locked;
+	struct mythread_waitq waiters;
+} mythread_mutex_t;
+
+/* a condition variable, waiters are parked in its wait queue
+ */
+typedef struct mythread_cond {
+	struct mythread_waitq waiters;
+} mythread_cond_t;
+
+#define MYTHREAD_MUTEX_INITIALIZER {0, {NULL, NULL}}
+#define MYTHREAD_COND_INITIALIZER {{NULL, NULL}}
+
+/* operations of a case of mythread_chan_select
+ */
+#define MYTHREAD_CHAN_SEND 0
+#define MYTHREAD_CHAN_RECV 1
+
+/* a bounded channel of elements of elemsize bytes, its buffer is a ring of
+ * mask + 1 cells (a power of two) and every cell starts with a sequence
+ * number, a cell is free for the sender of position pos when it is pos and
+ * full for the receiver of pos when it is pos + 1, so senders and receivers
+ * claim positions with a compare and swap of tail or head without a lock
+ * head and tail are on cache lines of their own, so senders and receivers
+ * do not slow each other down
+ */
+typedef struct mythread_chan {
+	volatile unsigned long head __attribute__((aligned(64)));	//next position to receive from
+	volatile unsigned long tail __attribute__((aligned(64)));	//next position to send to
+	char *cells __attribute__((aligned(64)));
+	unsigned long mask;
+	size_t elemsize, stride;
+	volatile int closed;
+	struct mythread_waitq senders, receivers;	//threads parked until they can send or receive
+	struct mythread_chan_case *selecters;		//cases of parked selects which wait for this channel
+} mythread_chan_t;
+
+/* a case of mythread_chan_select, elem is sent to ch or received from it
+ * depending on op, status is set to 0 or EPIPE when the case is chosen
+ * a case with ch NULL is never chosen
+ * next and waiter are used by the library while the select is parked
+ */
+typedef struct mythread_chan_case {
+	mythread_chan_t *ch;
+	int op;
+	void *elem;
+	int status;
+	struct mythread_chan_case *next;	//next case in the selecters of ch
+	void *waiter;						//the parked select
+} mythread_chan_case_t;
+
+/* state of a file descriptor in the netpoller, rd and wr are the threads
+ * parked until it is readable or writable, rready and wready remember
+ * an edge which came while no thread was waiting for it
+ */
+struct mythread_pollfd {
+	struct active_thread_node *rd, *wr;
+	char registered, rready, wready;
+};
+
+/* attributes of a new thread, initialise them with mythread_attr_init
+ * a detached thread can not be joined, it is released when it exits
+ */
+typedef struct mythread_attr {
+	int priority;
+	int detached;
+} mythread_attr_t;
+
+/* counters of the pool of stacks and thread structures, hits are
+ * allocations served from the pool and misses are those which needed
+ * malloc
+ */
+struct mythread_pool_stats {
+	unsigned long stack_hits, stack_misses;
+	unsigned long desc_hits, desc_misses;
+	int stacks, descs, cap;
+};
+
+/* an event of the tracer, ts is the time stamp counter of the cpu (the
+ * tsc on x86) and cpu the ring in which it was recorded
+ */
+struct mythread_trace_event {
+	unsigned long ts;
+	mythread_t thread;
+	unsigned long arg;
+	unsigned int type, cpu;
+};
+
+/* a ring of trace events, head counts all events ever recorded in it and
+ * the event number i is kept in events[i & mask], so the ring always
+ * holds the last mask + 1 events
+ */
+struct mythread_trace_ring {
+	volatile unsigned long head __attribute__((aligned(64)));
+	struct mythread_trace_event *events;
+	unsigned long mask;
+};
+
+/* a loop of mythread_parallel_for, shared by the parts which run it,
+ * next is the first iteration not given to any part yet
+ */
+struct mythread_for {
+	long begin, end, grain;
+	long next;
+	int schedule, nparts;
+	void (*fn)(long, long, void *);
+	void *ctx;
 };
 
 /* static functions are not included/declared in header
  */
 void __mythread_wrapper(int ind);
 void __mythreadfill(void *(*fun)(void *), void *args);
+void __mythread_context_make(struct mythread_context *c, void *stack, size_t size, void (*fun)(int), int arg);
+void __mythread_context_switch(struct mythread_context *from, struct mythread_context *to);
+#ifdef MYTHREAD_FAST_SWITCH
+void __mythread_switch(void **from, void *to);
+void __mythread_trampoline(void);
+#endif
 
 /* the information about various functions is written in mythread.c
  * file
@@ -95,15 +387,68 @@ void __mythreadfill(void *(*fun)(void *), void *args);
  * to pthread_xyz
  */
 void mythread_init();
+void mythread_init_mode(int mode);
 int mythread_create(mythread_t *mythread, void *(*fun)(void *), void *args);
+int mythread_create_attr(mythread_t *mythread, const mythread_attr_t *attr, void *(*fun)(void *), void *args);
+int mythread_attr_init(mythread_attr_t *attr);
+int mythread_attr_setpriority(mythread_attr_t *attr, int priority);
+int mythread_attr_setdetached(mythread_attr_t *attr, int detached);
+int mythread_setpriority(mythread_t mythread, int priority);
+int mythread_getpriority(mythread_t mythread, int *priority);
 int mythread_join(mythread_t mythread, void **returnval);
+int mythread_join_timed(mythread_t mythread, void **returnval, unsigned long ns);
+int mythread_detach(mythread_t mythread);
 int mythread_kill(mythread_t mythread, int sig);
 void mythread_exit(void *returnval);
 __sighandler_t set_active_thread_signal(int signum, __sighandler_t handler);
 mythread_t mythread_self(void);
+int mythread_yield(void);
+int mythread_yield_to(mythread_t mythread);
+int mythread_sleep_ns(unsigned long ns);
+ssize_t mythread_read(int fd, void *buf, size_t count);
+ssize_t mythread_write(int fd, const void *buf, size_t count);
+int mythread_accept(int fd, struct sockaddr *addr, socklen_t *addrlen);
+int mythread_connect(int fd, const struct sockaddr *addr, socklen_t addrlen);
+int mythread_close(int fd);
+long mythread_timer_setquantum(long usec);
+int mythread_timer_setadaptive(int adaptive);
+int mythread_pool_setcap(int cap);
+void mythread_pool_getstats(struct mythread_pool_stats *stats);
+int mythread_stats(mythread_t mythread, struct mythread_thread_stats *stats);
+void mythread_sched_stats(struct mythread_sched_stats *stats);
+int mythread_stats_export(const char *path, long interval_ms);
+int mythread_trace_start(unsigned long events);
+void mythread_trace_stop(void);
+int mythread_trace_dump(const char *path);
+int mythread_parallel_for(long begin, long end, long grain, void (*fn)(long, long, void *), void *ctx);
+int mythread_parallel_for_sched(long begin, long end, long grain, int schedule, void (*fn)(long, long, void *), void *ctx);
+int mythread_mutex_init(mythread_mutex_t *m);
+int mythread_mutex_destroy(mythread_mutex_t *m);
+int mythread_mutex_lock(mythread_mutex_t *m);
+int mythread_mutex_trylock(mythread_mutex_t *m);
+int mythread_mutex_timedlock(mythread_mutex_t *m, const struct timespec *abstime);
+int mythread_mutex_unlock(mythread_mutex_t *m);
+int mythread_cond_init(mythread_cond_t *c);
+int mythread_cond_destroy(mythread_cond_t *c);
+int mythread_cond_wait(mythread_cond_t *c, mythread_mutex_t *m);
+int mythread_cond_timedwait(mythread_cond_t *c, mythread_mutex_t *m, const struct timespec *abstime);
+int mythread_cond_signal(mythread_cond_t *c);
+int mythread_cond_broadcast(mythread_cond_t *c);
+int mythread_chan_init(mythread_chan_t *ch, size_t elemsize, unsigned int cap);
+int mythread_chan_destroy(mythread_chan_t *ch);
+int mythread_chan_send(mythread_chan_t *ch, const void *elem);
+int mythread_chan_recv(mythread_chan_t *ch, void *elem);
+int mythread_chan_try_send(mythread_chan_t *ch, const void *elem);
+int mythread_chan_try_recv(mythread_chan_t *ch, void *elem);
+int mythread_chan_close(mythread_chan_t *ch);
+int mythread_chan_select(mythread_chan_case_t *cases, int n, int block);
 int mythread_spin_init(mythread_spinlock_t *lock);
 int mythread_spin_lock(mythread_spinlock_t *lock);
 int mythread_spin_unlock(mythread_spinlock_t *lock);
 int mythread_spin_trylock(mythread_spinlock_t *lock);
+int mythread_mcs_init(mythread_mcslock_t *lock);
+int mythread_mcs_lock(mythread_mcslock_t *lock, mythread_mcsnode_t *node);
+int mythread_mcs_unlock(mythread_mcslock_t *lock, mythread_mcsnode_t *node);
+int mythread_mcs_trylock(mythread_mcslock_t *lock, mythread_mcsnode_t *node);
 
 #endif
@@ -2,264 +2,2081 @@
 #define _GNU_SOURCE
 #endif
 
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sched.h>
 #include <errno.h>
+#include <signal.h>
 #include <unistd.h>
+#include <limits.h>
+#include <pthread.h>
 #include <sys/types.h>
-#include <sys/wait.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <linux/mempolicy.h>
+#ifdef __x86_64__
+#include <asm/prctl.h>
+#endif
 #include "mythread.h"
 
-/* all threads will be malloced and addresses stored in pointers in this 2d array 
- * of thread pointers __allthreads and even after this thread terminates, these pointers
- * will NOT be freed, because anyone can call join on these threads, also can use functions
- * on these threads or order for returned value from these threads, so it is better to keep 
- * all this information like state of thread, return value etc
+/* the table of all threads, it is a two level array of slots which never
+ * moves: a chunk of MYTHREAD_TABLE_CHUNK slots is allocated only when all
+ * slots before it are in use and slots of collected threads are reused
+ * through a free list linked by slot index, a thread keeps its slot
+ * until it is joined because anyone can call join on it
+ * mythread_t keeps the index of the slot plus one in its low 32 bits (0 is
+ * the main thread) and the generation of the slot in its high 32 bits, the
+ * generation changes every time the slot is freed so an old id of a reused
+ * slot is rejected
+ */
+static struct mythread_slot *__table[MYTHREAD_TABLE_CHUNKS];
+static int __table_size = 0, __table_free = -1;	//number of slots ever used and first free slot
+
+/* the thread control block of the main thread, it is never in the
+ * thread table and has thread id 0
+ */
+static struct mythread_struct __mainthread;
+
+/* destructors of the thread specific data keys, a key is in use while
+ * its entry in __keys_used is set
+ */
+static void (*__keys_destructor[MYTHREAD_KEYS_MAX])(void *);
+static volatile int __keys_used[MYTHREAD_KEYS_MAX];
+static volatile unsigned int __chan_selectrr = 0;	//first case tried by the next select
+
+/* numbers of created and exited threads and the periodic export of the
+ * counters of all threads, see mythread_stats_export
+ */
+static volatile unsigned long __created = 0, __exited = 0;
+static char __export_path[256];				//file rewritten by the exporter thread
+static long __export_interval = 0;			//milliseconds between two snapshots, 0 if the export is stopped
+static int __exporting = 0;					//non zero while the exporter thread exists
+
+/* detached threads which have exited, linked by reap, a thread can not
+ * free its own stack so they are released by the next create or detach
+ * once the kernel has cleared their tid
+ */
+static struct mythread_struct *volatile __reap = NULL;
+
+/* the first cpu of every physical core (cpus which are hyperthreads of
+ * the same core are counted once), found by the first mythread_attr_setcore
+ */
+static int __cores[MYTHREAD_CPU_SETSIZE];
+static int __ncores = 0;
+
+/* a bounded cache of stacks and thread structures of collected threads,
+ * new threads take them from here before calling malloc
+ * both lists are linked through the first word of the cached memory and
+ * are guarded by their own lock, as join does not take the superlock
  */
-static struct mythread_struct **__allthreads[16] = {0};
+static struct {
+	mythread_spinlock_t lock;
+	void *stacks, *descs;
+	int nstacks, ndescs, cap;
+	unsigned long stack_hits, stack_misses, desc_hits, desc_misses;
+} __pool = {MYTHREAD_SPINLOCK_INITIALIZER, NULL, NULL, 0, 0, MYTHREAD_POOL_CAP, 0, 0, 0, 0};
 
-/* it keeps track of a count of threads created until now
+#ifndef __x86_64__
+/* lowest and highest address of all thread stacks, a stack pointer in
+ * between belongs to a thread and not to the main thread
  */
-static int __ind = 0;
+static unsigned long __stacks_lo = -1UL, __stacks_hi = 0;
+#endif
 
 /* a superlock variable which is used to lock and unlock (spinlock)
  * internally in thread structures (while modifying data structures)
  */
-static volatile int superlock = 0;
+static mythread_spinlock_t superlock = MYTHREAD_SPINLOCK_INITIALIZER;
+
+/* spins one round, pause tells the cpu that this is a busy wait loop, so
+ * it does not fill its pipeline with loads of the lock and leaves the
+ * core to the other hyperthread
+ */
+static inline void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+	__asm__ volatile("pause" ::: "memory");
+#elif defined(__aarch64__)
+	__asm__ volatile("yield" ::: "memory");
+#else
+	__asm__ volatile("" ::: "memory");
+#endif
+}
+
+/* gives the cpu away while a ticket lock is still not ours after
+ * MYTHREAD_SPIN_YIELD rounds, the holder or the waiters ahead of us may
+ * not be running at all
+ */
+static inline void spin_yield(void) {
+	sched_yield();
+}
+
+/* the ticket lock behind mythread_spinlock_t and the superlock
+ * a waiter backs off in proportion to its distance from the owner, so
+ * the waiters do not all hammer the lock line at every handover
+ */
+static inline void ticket_lock(mythread_spinlock_t *lock) {
+	unsigned short ticket = __atomic_fetch_add(&lock->next, 1, __ATOMIC_RELAXED), owner;
+	unsigned int i, delay, rounds = 0;
+	while((owner = __atomic_load_n(&lock->owner, __ATOMIC_ACQUIRE)) != ticket) {
+		if(++rounds > MYTHREAD_SPIN_YIELD) {
+			spin_yield();
+			continue;
+		}
+		delay = (unsigned short)(ticket - owner) * MYTHREAD_SPIN_BACKOFF;
+		if(delay > MYTHREAD_SPIN_BACKOFF_MAX)
+			delay = MYTHREAD_SPIN_BACKOFF_MAX;
+		for(i = 0; i < delay; i++)
+			cpu_relax();
+	}
+}
+
+/* takes a ticket only if it is served right away, owner can not move
+ * past next, so if next is still the observed owner the lock is ours
+ */
+static inline int ticket_trylock(mythread_spinlock_t *lock) {
+	unsigned short owner = __atomic_load_n(&lock->owner, __ATOMIC_ACQUIRE);
+	return __atomic_compare_exchange_n(&lock->next, &owner, owner + 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+static inline void ticket_unlock(mythread_spinlock_t *lock) {
+	__atomic_store_n(&lock->owner, lock->owner + 1, __ATOMIC_RELEASE);
+}
 
 /* a static lock which will only be used internally by thread functions
  * this function locks the lock
  */
 static inline void superlock_lock() {
-	while(__sync_lock_test_and_set(&superlock, 1));
+	ticket_lock(&superlock);
 }
 
 /* unlocks the static superlock 
  */
 static inline void superlock_unlock() {
-	__sync_synchronize();
-	superlock = 0;
+	ticket_unlock(&superlock);
+}
+
+/* the kernel clears the tid of a thread (created with CLONE_CHILD_CLEARTID)
+ * when it exits and wakes one waiter on that word, joiners sleep here
+ */
+static inline int futex(volatile int *addr, int op, int val) {
+	return syscall(SYS_futex, addr, op, val, NULL, NULL, 0);
+}
+
+/* returns the monotonic time in nanoseconds
+ */
+static inline unsigned long now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+/* every thread points its thread pointer to its own mythread_struct,
+ * glibc keeps its TLS in fs on x86-64 and leaves gs alone, so the gs base
+ * is set once when a thread starts and finding the structure of the
+ * calling thread later is a single load (no system call, no lock)
+ * on other architectures stacks are aligned to their size and the
+ * structure address is kept in the lowest word of the stack
+ */
+static void set_thread_pointer(struct mythread_struct *t) {
+	t->self = t;
+#ifdef __x86_64__
+	syscall(SYS_arch_prctl, ARCH_SET_GS, (unsigned long)t);
+#endif
+}
+
+static inline struct mythread_struct *current_thread(void) {
+	struct mythread_struct *t;
+#ifdef __x86_64__
+	__asm__ volatile("mov %%gs:0, %0" : "=r"(t));
+#else
+	unsigned long sp = (unsigned long)&t;
+	if(sp >= __stacks_lo && sp < __stacks_hi)
+		t = *(struct mythread_struct **)(sp & ~(STACK_SIZE - 1UL));
+	else
+		t = &__mainthread;
+#endif
+	return t;
+}
+
+/* sets the thread pointer of the main thread, it is done by the first of
+ * mythread_init, mythread_create or mythread_key_create called by main
+ */
+static void set_main_thread_pointer(void) {
+	if(!__mainthread.self && syscall(SYS_gettid) == getpid())
+		set_thread_pointer(&__mainthread);
+}
+
+/* returns the slot with index ind
+ */
+static inline struct mythread_slot *table_slot(unsigned long ind) {
+	return &__table[ind / MYTHREAD_TABLE_CHUNK][ind % MYTHREAD_TABLE_CHUNK];
+}
+
+/* finds the thread with id mythread, it returns NULL if there is no such
+ * thread or it is already collected
+ * lookups only read the table (which never moves), so no lock is taken
+ * the thread is loaded before the generation is checked, both with
+ * acquire paired with the release stores of table_alloc and table_free,
+ * so a thread which got the slot after the old id was freed is never
+ * returned for it
+ * callers which use the thread after the lookup hold superlock, which
+ * release_thread takes to free the slot, so it is not reused meanwhile
+ */
+static inline struct mythread_struct *table_lookup(mythread_t mythread) {
+	unsigned long ind = (mythread & 0xffffffffUL) - 1;
+	struct mythread_slot *s;
+	struct mythread_struct *t;
+	if(ind >= (unsigned long)__atomic_load_n(&__table_size, __ATOMIC_ACQUIRE))
+		return NULL;
+	s = table_slot(ind);
+	t = __atomic_load_n(&s->thread, __ATOMIC_ACQUIRE);
+	if(__atomic_load_n(&s->gen, __ATOMIC_ACQUIRE) != (unsigned int)(mythread >> 32))
+		return NULL;
+	return t;
+}
+
+/* gives a slot (a freed one if possible) to thread t and sets its id,
+ * it returns -1 if the table is full
+ * called with superlock held
+ */
+static int table_alloc(struct mythread_struct *t) {
+	int ind;
+	struct mythread_slot *s, *chunk;
+	if(__table_free != -1) {
+		ind = __table_free;
+		s = table_slot(ind);
+		__table_free = s->next;
+	}
+	else {
+		ind = __table_size;
+		if(ind >= MYTHREAD_TABLE_CHUNK * MYTHREAD_TABLE_CHUNKS)
+			return -1;
+		if(!__table[ind / MYTHREAD_TABLE_CHUNK]) {
+			chunk = (struct mythread_slot *)calloc(MYTHREAD_TABLE_CHUNK, sizeof(struct mythread_slot));
+			if(!chunk)
+				return -1;
+			__table[ind / MYTHREAD_TABLE_CHUNK] = chunk;
+		}
+		s = table_slot(ind);
+		__atomic_store_n(&__table_size, ind + 1, __ATOMIC_RELEASE);
+	}
+	t->id = ((mythread_t)s->gen << 32) | (ind + 1);
+	__atomic_store_n(&s->thread, t, __ATOMIC_RELEASE);
+	return ind;
+}
+
+/* frees the slot of thread t, its id is not valid any more
+ * called with superlock held
+ */
+static void table_free(struct mythread_struct *t) {
+	int ind = (t->id & 0xffffffffUL) - 1;
+	struct mythread_slot *s = table_slot(ind);
+	__atomic_store_n(&s->gen, s->gen + 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&s->thread, NULL, __ATOMIC_RELEASE);
+	s->next = __table_free;
+	__table_free = ind;
+}
+
+static inline void pool_lock(void) {
+	ticket_lock(&__pool.lock);
+}
+
+static inline void pool_unlock(void) {
+	ticket_unlock(&__pool.lock);
+}
+
+/* takes a block from the cache list *list, it returns NULL if the list
+ * is empty and the caller allocates a new block
+ * the hit and miss counters of the list are updated
+ */
+static void *pool_get(void **list, int *n, unsigned long *hits, unsigned long *misses) {
+	void *p;
+	pool_lock();
+	p = *list;
+	if(p) {
+		*list = *(void **)p;
+		(*n)--;
+		(*hits)++;
+	}
+	else
+		(*misses)++;
+	pool_unlock();
+	return p;
+}
+
+/* gives a block back to the cache list *list, it is freed if the list
+ * is already full
+ */
+static void pool_put(void **list, int *n, void *p) {
+	pool_lock();
+	if(*n < __pool.cap) {
+		*(void **)p = *list;
+		*list = p;
+		(*n)++;
+		p = NULL;
+	}
+	pool_unlock();
+	free(p);
+}
+
+/* asks the kernel to keep the pages which lie wholly in [addr, addr + len)
+ * on the numa node node, pages already in memory are moved there and the
+ * others are put there when they are first touched
+ * it is only a preference, a full node or a kernel without numa support
+ * leaves the pages where the kernel wants them
+ */
+static void node_bind(void *addr, size_t len, int node) {
+	unsigned long nodes[MYTHREAD_MAX_NODES / 64] = {0};
+	unsigned long page = sysconf(_SC_PAGESIZE);
+	unsigned long lo = ((unsigned long)addr + page - 1) & ~(page - 1);
+	unsigned long hi = ((unsigned long)addr + len) & ~(page - 1);
+	if(hi <= lo)
+		return;
+	nodes[node / 64] = 1UL << (node % 64);
+	syscall(SYS_mbind, lo, hi - lo, MPOL_PREFERRED, nodes, MYTHREAD_MAX_NODES + 1, MPOL_MF_MOVE);
+}
+
+/* allocates a stack for a new thread, from the pool if possible
+ * the stack of a thread placed on a numa node is always a new one bound
+ * to that node (and it is freed instead of being pooled)
+ */
+static char *new_stack(int node) {
+	char *stack = NULL;
+	if(node == -1 && (stack = (char *)pool_get(&__pool.stacks, &__pool.nstacks, &__pool.stack_hits, &__pool.stack_misses)))
+		return stack;
+#ifdef __x86_64__
+	stack = (char *)malloc(STACK_SIZE);
+#else
+	if(posix_memalign((void **)&stack, STACK_SIZE, STACK_SIZE))
+		return NULL;
+	if((unsigned long)stack < __stacks_lo)
+		__stacks_lo = (unsigned long)stack;
+	if((unsigned long)stack + STACK_SIZE > __stacks_hi)
+		__stacks_hi = (unsigned long)stack + STACK_SIZE;
+#endif
+	if(stack && node != -1)
+		node_bind(stack, STACK_SIZE, node);
+	return stack;
+}
+
+/* allocates the structure of a thread placed on the numa node node, it
+ * takes whole pages so that binding them does not move other data
+ */
+static struct mythread_struct *new_desc(int node) {
+	void *t;
+	unsigned long page = sysconf(_SC_PAGESIZE);
+	size_t size = (sizeof(struct mythread_struct) + page - 1) & ~(page - 1);
+	if(posix_memalign(&t, page, size))
+		return NULL;
+	node_bind(t, size, node);
+	return (struct mythread_struct *)t;
+}
+
+/* gives the stack and the structure of thread t (which must have exited
+ * already) back to the pool and frees its slot in the thread table
+ */
+static void release_thread(struct mythread_struct *t) {
+	superlock_lock();
+	table_free(t);
+	superlock_unlock();
+	if(t->node != -1) {
+		free(t->stack);
+		free(t);
+		return;
+	}
+	pool_put(&__pool.stacks, &__pool.nstacks, t->stack);
+	pool_put(&__pool.descs, &__pool.ndescs, t);
+}
+
+/* releases the exited detached threads whose stacks are not used any more,
+ * the others are put back on the list
+ */
+static void reap_threads(void) {
+	struct mythread_struct *t, *next, *keep = NULL;
+	for(t = __atomic_exchange_n(&__reap, NULL, __ATOMIC_ACQUIRE); t; t = next) {
+		next = t->reap;
+		if(t->tid) {
+			t->reap = keep;
+			keep = t;
+		}
+		else release_thread(t);
+	}
+	while(keep) {
+		next = keep->reap;
+		do
+			keep->reap = __reap;
+		while(!__sync_bool_compare_and_swap(&__reap, keep->reap, keep));
+		keep = next;
+	}
+}
+
+/* marks the exiting thread t terminated, or if it is detached puts it on
+ * the list of threads to be released
+ */
+static void thread_exited(struct mythread_struct *t) {
+	__atomic_fetch_add(&__exited, 1, __ATOMIC_RELAXED);
+	if(__sync_bool_compare_and_swap(&t->state, THREAD_RUNNING, THREAD_TERMINATED) || t->state != THREAD_DETACHED)
+		return;
+	do
+		t->reap = __reap;
+	while(!__sync_bool_compare_and_swap(&__reap, t->reap, t));
+}
+
+/* calls the destructors of the thread specific data of the exiting thread t
+ * same as pthreads, it is repeated while destructors set new values
+ */
+static void run_key_destructors(struct mythread_struct *t) {
+	int i, iter, again = 1;
+	void *value;
+	for(iter = 0; iter < MYTHREAD_DESTRUCTOR_ITERATIONS && again; iter++) {
+		again = 0;
+		for(i = 0; i < MYTHREAD_KEYS_MAX; i++) {
+			value = t->specific[i];
+			if(value && __keys_used[i] && __keys_destructor[i]) {
+				t->specific[i] = NULL;
+				__keys_destructor[i](value);
+				again = 1;
+			}
+		}
+	}
 }
 
 void mythread_init() {
 	/*
-	 * no need to initialise anything in one-one model, just created
-	 * empty function so that same testing code can be used with many-one
-	 * and one-one model
+	 * nothing else is needed in one-one model except the thread control
+	 * block of the main thread and the limit of the pool, the function
+	 * also keeps the same testing code working with many-one and one-one
+	 * model
 	 */
+	char *env = getenv("MYTHREAD_POOL_CAP");
+	if(env)
+		__pool.cap = atoi(env);
+	set_main_thread_pointer();
 }
 
 /* wrapper function of type int (*f)(void *) which wraps the function
  * of type void *(*f)(void *) in it so that it can be passed to 
  * clone() call.
  * it also stores the returned value in the mythread_struct
+ * if some thread already called join, the state is left as it is, the
+ * joiner is woken by the kernel when this thread has really exited
+ * a detached thread is left to be released by another thread
  */
 int __mythread_wrapper(void *mythread_struct_cur) {
+	set_thread_pointer((struct mythread_struct *)mythread_struct_cur);
+	if(((struct mythread_struct *)mythread_struct_cur)->hascpus)
+		sched_setaffinity(0, sizeof(mythread_cpuset_t), (cpu_set_t *)&((struct mythread_struct *)mythread_struct_cur)->cpus);
 	((struct mythread_struct *)mythread_struct_cur)->returnval = ((struct mythread_struct *)mythread_struct_cur)->fun(((struct mythread_struct *)mythread_struct_cur)->args);
-	superlock_lock();
-	((struct mythread_struct *)mythread_struct_cur)->state = THREAD_TERMINATED;
-	superlock_unlock();
+	run_key_destructors((struct mythread_struct *)mythread_struct_cur);
+	thread_exited((struct mythread_struct *)mythread_struct_cur);
 	return 0;
 }
 
-/* if any error occures, then this function removes the newly allocated
- * thread and decrements the index __ind by one 
- */
-void __mythread_removelastfilled(void) {
-	__ind--;
-	int cur = __ind / 16;
-	int locind = __ind % 16;
-	free(__allthreads[cur][locind]);
-}
-
 /* it takes function and arguments and returns a structure of type
  * mythread_struct which contains useful information of the current 
  * thread and can be passwed to function __mythread_wrapper
+ * the structure and the stack are allocated on the numa node node, or
+ * anywhere (and from the pool) if it is -1
+ * it returns NULL if either can not be allocated or the table is full
  */
-struct mythread_struct *__mythread_fill(void *(*fun)(void *), void *args) {
-	int cur = __ind / 16;
-	int locind = __ind % 16;
-	if(!__allthreads[cur])
-		__allthreads[cur] = (struct mythread_struct **)malloc(sizeof(struct mythread_struct *) * 16);
-	__allthreads[cur][locind] = (struct mythread_struct *)malloc(sizeof(struct mythread_struct));
-	__allthreads[cur][locind]->fun = fun;
-	__allthreads[cur][locind]->args = args;
-	__allthreads[cur][locind]->returnval = NULL;
-	__allthreads[cur][locind]->state = THREAD_NOT_STARTED;
-	__allthreads[cur][locind]->stack = (char *)malloc(STACK_SIZE);
-	__ind++;
-	return __allthreads[cur][locind];
+struct mythread_struct *__mythread_fill(void *(*fun)(void *), void *args, int node) {
+	struct mythread_struct *t;
+	char *stack;
+	if(node != -1)
+		t = new_desc(node);
+	else if(!(t = (struct mythread_struct *)pool_get(&__pool.descs, &__pool.ndescs, &__pool.desc_hits, &__pool.desc_misses)))
+		t = (struct mythread_struct *)malloc(sizeof(struct mythread_struct));
+	if(!t)
+		return NULL;
+	if(!(stack = new_stack(node)) || table_alloc(t) == -1) {
+		if(node != -1) {
+			free(stack);
+			free(t);
+			return NULL;
+		}
+		if(stack)
+			pool_put(&__pool.stacks, &__pool.nstacks, stack);
+		pool_put(&__pool.descs, &__pool.ndescs, t);
+		return NULL;
+	}
+	memset(t->specific, 0, sizeof(t->specific));
+	memset(&t->stats, 0, sizeof(t->stats));
+	t->taskworker = NULL;
+	t->fun = fun;
+	t->args = args;
+	t->returnval = NULL;
+	t->state = THREAD_NOT_STARTED;
+	t->tid = 0;
+	t->node = node;
+	t->hascpus = 0;
+	t->stack = stack;
+#ifndef __x86_64__
+	*(struct mythread_struct **)t->stack = t;
+#endif
+	return t;
 }
 
-/* creates a oneone thread and starts it for given function and given 
- * argument (fun and args)
- * it returns 0 on success and -1 on error
- * the thread id is stored in the location pointed by mythread
- * if any error occures, it frees the allocated structure
+/* reads a list of cpus like "0-3,8,10-11" (the format of the cpu lists in
+ * sysfs) from the file path into set, it returns -1 if the file can not
+ * be read
  */
-int mythread_create(mythread_t *mythread, void *(*fun)(void *), void *args) {
+static int cpulist_read(const char *path, mythread_cpuset_t *set) {
+	FILE *fp;
+	int lo, hi, c = ',';
+	memset(set, 0, sizeof(mythread_cpuset_t));
+	if(!(fp = fopen(path, "r")))
+		return -1;
+	while(c == ',' && fscanf(fp, "%d", &lo) == 1) {
+		hi = lo;
+		if((c = fgetc(fp)) == '-') {
+			if(fscanf(fp, "%d", &hi) != 1)
+				break;
+			c = fgetc(fp);
+		}
+		for(; lo <= hi && lo < MYTHREAD_CPU_SETSIZE; lo++)
+			MYTHREAD_CPU_SET(lo, set);
+	}
+	fclose(fp);
+	return 0;
+}
+
+/* start routine of the threads started with pthread_create (see
+ * thread_create), the kernel does not store their tid, so they store it
+ * themselves, as they never exit nothing clears it again
+ */
+static void *__mythread_pthread_wrapper(void *arg) {
+	struct mythread_struct *t = (struct mythread_struct *)arg;
+	__atomic_store_n(&t->tid, (int)syscall(SYS_gettid), __ATOMIC_RELEASE);
+	__mythread_wrapper(t);
+	return NULL;
+}
+
+/* starts t as a pthread on its own stack instead of a bare clone, libc
+ * then gives it TLS of its own (errno, the malloc cache, stdio state) and
+ * knows that the process has several threads
+ * it returns -1 if the thread can not be created
+ */
+static int thread_pthread(struct mythread_struct *t) {
+	pthread_attr_t attr;
+	pthread_t pt;
 	int status;
+	pthread_attr_init(&attr);
+	pthread_attr_setstack(&attr, t->stack, STACK_SIZE);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	status = pthread_create(&pt, &attr, __mythread_pthread_wrapper, (void *)t) ? -1 : 0;
+	pthread_attr_destroy(&attr);
+	return status;
+}
+
+/* creates the thread of mythread_create_attr, as a bare clone or, if
+ * pthread is non zero, with pthread_create (see thread_pthread), which is
+ * used for the threads of the library which run code of the user that
+ * calls libc, like the workers of the task runtime
+ */
+static int thread_create(mythread_t *mythread, const mythread_attr_t *attr, void *(*fun)(void *), void *args, int pthread) {
+	int status, node = attr ? attr->node : -1, hascpus = 0;
+	mythread_cpuset_t cpus;
+	char path[64];
 	struct mythread_struct *t;
+	if(node < -1 || node >= MYTHREAD_MAX_NODES)
+		return -1;
+	if(attr && attr->hascpus) {
+		cpus = attr->cpus;
+		hascpus = 1;
+	}
+	else if(node != -1) {
+		snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+		hascpus = cpulist_read(path, &cpus) == 0;
+	}
+	set_main_thread_pointer();
+	if(__reap)
+		reap_threads();
 	superlock_lock();
-   	t = __mythread_fill(fun, args);
-	*mythread = __ind;
+   	t = __mythread_fill(fun, args, node);
 	if(!t) {
 		superlock_unlock();
 		return -1;
 	}
-	t->state = THREAD_RUNNING;
-	status = clone(__mythread_wrapper, (void *)(t->stack + STACK_SIZE), SIGCHLD | CLONE_VM | CLONE_SIGHAND | CLONE_FS | CLONE_FILES, (void *)t);
+	*mythread = t->id;
+	t->state = attr && attr->detached ? THREAD_DETACHED : THREAD_RUNNING;
+	if(hascpus) {
+		t->cpus = cpus;
+		t->hascpus = 1;
+	}
+	if(pthread)
+		status = thread_pthread(t);
+	else
+		status = clone(__mythread_wrapper, (void *)(t->stack + STACK_SIZE), CLONE_VM | CLONE_SIGHAND | CLONE_FS | CLONE_FILES | CLONE_THREAD | CLONE_SYSVSEM | CLONE_PARENT_SETTID | CLONE_CHILD_CLEARTID, (void *)t, &t->tid, NULL, &t->tid);
 	if(status == -1) {
-		__mythread_removelastfilled();
 		superlock_unlock();
+		release_thread(t);
 		return -1;
 	}
-	else
-		t->tid = status;
 	superlock_unlock();
+	__atomic_fetch_add(&__created, 1, __ATOMIC_RELAXED);
 	return 0;
 }
 
-/* returns ID of the calling thread, if there are no threads created, 
- * then it returns -1
- * if the thread calling it is main thread, then it returns 0
+/* creates a oneone thread and starts it for given function and given 
+ * argument (fun and args)
+ * the thread is created in the thread group of the caller, the kernel
+ * stores its tid in the structure before clone returns and clears it
+ * (waking the joiner) when the thread exits
+ * it returns 0 on success and -1 on error
+ * the thread id is stored in the location pointed by mythread
+ * if any error occures, it frees the allocated structure
+ */
+int mythread_create(mythread_t *mythread, void *(*fun)(void *), void *args) {
+	return mythread_create_attr(mythread, NULL, fun, args);
+}
+
+/* same as mythread_create but the thread is placed as attr says (default
+ * attributes if attr is NULL)
+ * a thread bound to a numa node without cpus of its own runs on the cpus
+ * of that node
  */
-mythread_t mythread_self(void) {
-	pid_t pid = getpid();
-	int ind, i, cur, locind;
+int mythread_create_attr(mythread_t *mythread, const mythread_attr_t *attr, void *(*fun)(void *), void *args) {
+	return thread_create(mythread, attr, fun, args, 0);
+}
+
+/* initialises attr to the default attributes: any cpu, any node and
+ * joinable
+ */
+int mythread_attr_init(mythread_attr_t *attr) {
+	memset(&attr->cpus, 0, sizeof(attr->cpus));
+	attr->hascpus = 0;
+	attr->node = -1;
+	attr->detached = 0;
+	return 0;
+}
+
+/* makes a thread created with attr detached (see mythread_detach) if
+ * detached is non zero, it returns 0
+ */
+int mythread_attr_setdetached(mythread_attr_t *attr, int detached) {
+	attr->detached = detached != 0;
+	return 0;
+}
+
+/* lets a thread created with attr run only on the cpus in cpus (on any
+ * cpu again if cpus is NULL), it returns 0
+ */
+int mythread_attr_setaffinity(mythread_attr_t *attr, const mythread_cpuset_t *cpus) {
+	attr->hascpus = cpus != NULL;
+	if(cpus)
+		attr->cpus = *cpus;
+	return 0;
+}
+
+/* places the stack and the structure of a thread created with attr on the
+ * numa node node (-1 for any node), it returns 0 or EINVAL if there is no
+ * such node
+ */
+int mythread_attr_setnode(mythread_attr_t *attr, int node) {
+	char path[64];
+	if(node < -1 || node >= MYTHREAD_MAX_NODES)
+		return EINVAL;
+	snprintf(path, sizeof(path), "/sys/devices/system/node/node%d", node);
+	if(node != -1 && access(path, F_OK) == -1)
+		return EINVAL;
+	attr->node = node;
+	return 0;
+}
+
+/* finds the first cpu of every physical core which is online, a cpu is
+ * the first of its core if no lower cpu is one of its hyperthread
+ * siblings, without the topology in sysfs every cpu counts as a core
+ */
+static int cores_find(void) {
+	mythread_cpuset_t online, siblings;
+	char path[96];
+	int cpu, first, n = 0;
+	if(cpulist_read("/sys/devices/system/cpu/online", &online) == -1)
+		return 0;
+	for(cpu = 0; cpu < MYTHREAD_CPU_SETSIZE; cpu++) {
+		if(!MYTHREAD_CPU_ISSET(cpu, &online))
+			continue;
+		snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", cpu);
+		first = cpu;
+		if(cpulist_read(path, &siblings) == 0)
+			for(first = 0; first < cpu && !MYTHREAD_CPU_ISSET(first, &siblings); first++);
+		if(first == cpu)
+			__cores[n++] = cpu;
+	}
+	return n;
+}
+
+/* returns the numa node of cpu, or -1 if the kernel does not tell
+ */
+static int cpu_node(int cpu) {
+	char path[96];
+	int node;
+	for(node = 0; node < MYTHREAD_MAX_NODES; node++) {
+		snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/node%d", cpu, node);
+		if(access(path, F_OK) == 0)
+			return node;
+	}
+	return -1;
+}
+
+/* places a thread created with attr on physical core number core (counted
+ * modulo the number of cores, in the order of their first cpus), the
+ * thread may run on all hyperthreads of that core and its memory is
+ * allocated on the numa node of the core
+ * creating a group of workers with cores 0, 1, 2, ... spreads them one
+ * per physical core, it returns 0 or EINVAL if core is negative or the
+ * cores can not be found
+ */
+int mythread_attr_setcore(mythread_attr_t *attr, int core) {
+	char path[96];
+	int cpu;
 	superlock_lock();
-	ind = __ind;
+	if(!__ncores)
+		__ncores = cores_find();
 	superlock_unlock();
-	if(__ind == 0)
-		return -1;
-	for(i = 0; i < ind; i++) {
-		cur = ind / 16;
-		locind = ind % 16;
-		if(pid == __allthreads[cur][locind]->tid)
-			return i + 1;
+	if(core < 0 || !__ncores)
+		return EINVAL;
+	cpu = __cores[core % __ncores];
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", cpu);
+	if(cpulist_read(path, &attr->cpus) == -1) {
+		memset(&attr->cpus, 0, sizeof(attr->cpus));
+		MYTHREAD_CPU_SET(cpu, &attr->cpus);
 	}
+	attr->hascpus = 1;
+	attr->node = cpu_node(cpu);
 	return 0;
 }
 
+/* returns the kernel thread id of the thread mythread (0 for the main
+ * thread), or 0 if there is no such thread or it has exited
+ * the lookup and the read of tid are done with superlock held, so the
+ * structure can not be released and reused by a new thread in between
+ */
+static int thread_tid(mythread_t mythread) {
+	struct mythread_struct *t;
+	int tid = 0;
+	if(!mythread)
+		return getpid();
+	superlock_lock();
+	if((t = table_lookup(mythread)))
+		tid = t->tid;
+	superlock_unlock();
+	return tid;
+}
+
+/* lets the running thread mythread (0 for the main thread) run only on
+ * the cpus in cpus, it returns 0, ESRCH if there is no such thread or
+ * the error of sched_setaffinity
+ */
+int mythread_setaffinity(mythread_t mythread, const mythread_cpuset_t *cpus) {
+	int tid = thread_tid(mythread);
+	if(!tid)
+		return ESRCH;
+	return sched_setaffinity(tid, sizeof(mythread_cpuset_t), (const cpu_set_t *)cpus) == -1 ? errno : 0;
+}
+
+/* stores the cpus on which the thread mythread (0 for the main thread)
+ * may run in cpus, it returns 0, ESRCH if there is no such thread or the
+ * error of sched_getaffinity
+ */
+int mythread_getaffinity(mythread_t mythread, mythread_cpuset_t *cpus) {
+	int tid = thread_tid(mythread);
+	if(!tid)
+		return ESRCH;
+	memset(cpus, 0, sizeof(mythread_cpuset_t));
+	return sched_getaffinity(tid, sizeof(mythread_cpuset_t), (cpu_set_t *)cpus) == -1 ? errno : 0;
+}
+
+/* kernel threads are scheduled by the kernel, so this is just
+ * sched_yield, it returns 0
+ */
+int mythread_yield(void) {
+	return sched_yield();
+}
+
+/* returns ID of the calling thread, it is read from the thread control
+ * block of the caller in constant time
+ * if the thread calling it is main thread, then it returns 0 and if no
+ * thread function was called yet, it returns -1
+ */
+mythread_t mythread_self(void) {
+	if(!__mainthread.self)
+		return -1;
+	return current_thread()->id;
+}
+
 /* waits for the thread mythread to complete 
  * it returns 0 on success and EINVAL on wrong thread_t argument and ESRCH
  * if the thread with thread id mythread can not be found
+ * the state is changed with compare and swap, so joins of different
+ * threads never wait for each other, and the joiner sleeps on the tid
+ * word of the thread which the kernel clears when the thread exits
+ * the lookup and the compare and swap are done with superlock held, so a
+ * stale id never changes the state of a thread which reused the structure
  * if returnval is not NULL, then stores the value returned by thread 
  * in the location pointed by function which was running by the thread
  */
 int mythread_join(mythread_t mythread, void **returnval) {
-	int cur, locind, status, wstatus;
-	mythread--;
-	cur = mythread / 16;
-	locind = mythread % 16;
-	if(mythread < __ind) {
-		superlock_lock();
-		switch(__allthreads[cur][locind]->state) {
-			case THREAD_RUNNING:
-				__allthreads[cur][locind]->jpid = getpid();
-				__allthreads[cur][locind]->state = THREAD_JOIN_CALLED;
-				superlock_unlock();
-				while(1) {
-					waitpid(__allthreads[cur][locind]->tid, &wstatus, 0);
-					if(WIFEXITED(wstatus))
-						break;
-				}
-				superlock_lock();
-				__allthreads[cur][locind]->state = THREAD_COLLECTED;
-				superlock_unlock();
-				if(returnval)
-					*returnval = __allthreads[cur][locind]->returnval;
-				status = 0;
-				break;
-			case THREAD_NOT_STARTED: 
-			case THREAD_JOIN_CALLED: 
-			case THREAD_COLLECTED:
-				superlock_unlock();
-				status = EINVAL;
-				break;
-			case THREAD_TERMINATED:
-				superlock_unlock();
-				if(returnval) 
-					*returnval = __allthreads[cur][locind]->returnval;
-				status = 0;
-				break;
-			default:
-				superlock_unlock();
-				status = EINVAL;
-				break;
-		}
-		return status;
+	int state, tid;
+	struct mythread_struct *t;
+	superlock_lock();
+	if(!(t = table_lookup(mythread))) {
+		superlock_unlock();
+		return ESRCH;
 	}
-	else 
+	do {
+		state = t->state;
+		if(state != THREAD_RUNNING && state != THREAD_TERMINATED) {
+			superlock_unlock();
+			return EINVAL;
+		}
+	} while(!__sync_bool_compare_and_swap(&t->state, state, state == THREAD_RUNNING ? THREAD_JOIN_CALLED : THREAD_COLLECTED));
+	superlock_unlock();
+	while((tid = t->tid) != 0)
+		futex(&t->tid, FUTEX_WAIT, tid);
+	t->state = THREAD_COLLECTED;
+	if(returnval) 
+		*returnval = t->returnval;
+	release_thread(t);
+	return 0;
+}
+
+/* detaches the thread mythread, it can not be joined any more and its
+ * stack and structure are released as soon as it has exited (at once if
+ * it has exited already)
+ * it returns 0 on success, ESRCH if the thread can not be found and
+ * EINVAL if it is detached already or some thread joins it
+ * like in mythread_join the state is changed with superlock held
+ */
+int mythread_detach(mythread_t mythread) {
+	int state, tid;
+	struct mythread_struct *t;
+	if(__reap)
+		reap_threads();
+	superlock_lock();
+	if(!(t = table_lookup(mythread))) {
+		superlock_unlock();
 		return ESRCH;
+	}
+	do {
+		state = t->state;
+		if(state != THREAD_RUNNING && state != THREAD_TERMINATED) {
+			superlock_unlock();
+			return EINVAL;
+		}
+	} while(!__sync_bool_compare_and_swap(&t->state, state, state == THREAD_RUNNING ? THREAD_DETACHED : THREAD_COLLECTED));
+	superlock_unlock();
+	if(state == THREAD_RUNNING)
+		return 0;
+	while((tid = t->tid) != 0)
+		futex(&t->tid, FUTEX_WAIT, tid);
+	release_thread(t);
+	return 0;
 }
 
 /* sends signal sig to the thread represented by
  * mythread_t mythread
+ * the thread is looked up and its tid read with superlock held, so a
+ * stale id never signals a thread which reused the structure
  */
 int mythread_kill(mythread_t mythread, int sig) {
-	int cur, locind, status;
-	mythread--;
-	cur = mythread / 16;
-	locind = mythread % 16;
-	status = kill(__allthreads[cur][locind]->tid, sig);
-	return status;
+	struct mythread_struct *t;
+	int tid;
+	superlock_lock();
+	if(!(t = table_lookup(mythread)) || !(tid = t->tid)) {
+		superlock_unlock();
+		return ESRCH;
+	}
+	if(sig)
+		__atomic_fetch_add(&t->stats.signals, 1, __ATOMIC_RELAXED);
+	superlock_unlock();
+	return syscall(SYS_tgkill, getpid(), tid, sig);
 }
 
 /* when called, the calling thread exits, if returnval is not 
  * NULL, then the value returned by thread is stored in the location pointed 
  * by returnval
+ * only the calling thread exits (exit() would end the whole thread group)
  */
 void mythread_exit(void *returnval) {
-	pid_t pid = getpid();
-	int i, cur, locind;
-	for(i = 0; i < __ind; i++) {
-		cur = i / 16;
-		locind = i % 16;
-		if(__allthreads[cur][locind]->tid == pid)
-			break;
-	}
-	if(i == __ind)
+	struct mythread_struct *t;
+	if(!__mainthread.self || (t = current_thread()) == &__mainthread)
 		return;
-	superlock_lock();
-	__allthreads[cur][locind]->returnval = returnval;
-	__allthreads[cur][locind]->state = THREAD_TERMINATED;
-	superlock_unlock();
-	exit(0);
+	run_key_destructors(t);
+	t->returnval = returnval;
+	thread_exited(t);
+	syscall(SYS_exit, 0);
 }
 
-/* initialises the mythread_spinlock_t pointed by lock
+/* creates a new key for thread specific data, every thread sees NULL for
+ * the key until it sets its own value, destructor (if not NULL) is called
+ * with the value of an exiting thread
+ * it returns 0 on success and EAGAIN if all keys are in use
  */
-int mythread_spin_init(mythread_spinlock_t *lock) {
-	*lock = 0;
-	return 0;
+int mythread_key_create(mythread_key_t *key, void (*destructor)(void *)) {
+	int i;
+	set_main_thread_pointer();
+	for(i = 0; i < MYTHREAD_KEYS_MAX; i++) {
+		if(!__keys_used[i] && __sync_bool_compare_and_swap(&__keys_used[i], 0, 1)) {
+			__keys_destructor[i] = destructor;
+			*key = i;
+			return 0;
+		}
+	}
+	return EAGAIN;
 }
 
-/* aquires the lock on mythread_spinlock_t pointed by lock, 
- * if the lock is already held by another thread, then it continuously
- * loops until lock is freed again
+/* deletes the key, values of the key are not destroyed (same as pthreads)
  */
-inline int mythread_spin_lock(mythread_spinlock_t *lock) {
-	if(*lock != 0 || *lock != 1)
+int mythread_key_delete(mythread_key_t key) {
+	if(key >= MYTHREAD_KEYS_MAX || !__keys_used[key])
 		return EINVAL;
-	while(__sync_lock_test_and_set(lock, 1));
+	__keys_destructor[key] = NULL;
+	__keys_used[key] = 0;
 	return 0;
 }
 
-/* frees the mythread_spinlock_t pointed by lock
+/* returns the value of the key for the calling thread
  */
-inline int mythread_spin_unlock(mythread_spinlock_t *lock) {
-	if(*lock != 1)
+void *mythread_getspecific(mythread_key_t key) {
+	if(key >= MYTHREAD_KEYS_MAX || !__mainthread.self)
+		return NULL;
+	return current_thread()->specific[key];
+}
+
+/* sets the value of the key for the calling thread
+ */
+int mythread_setspecific(mythread_key_t key, const void *value) {
+	if(key >= MYTHREAD_KEYS_MAX || !__keys_used[key] || !__mainthread.self)
 		return EINVAL;
-	__sync_synchronize();
-	*lock = 0;
+	current_thread()->specific[key] = (void *)value;
 	return 0;
 }
 
-/* same as mythread_spin_lock with the difference that if the lock is 
- * held by some another thread, it returns immediately with the error
+/* sets the number of stacks (and of thread structures) kept in the pool
+ * for reuse, extra cached blocks are freed, it returns the previous limit
+ * the initial limit is MYTHREAD_POOL_CAP or the value of the environment
+ * variable MYTHREAD_POOL_CAP
+ */
+int mythread_pool_setcap(int cap) {
+	int old;
+	void *p;
+	if(cap < 0)
+		return -1;
+	pool_lock();
+	old = __pool.cap;
+	__pool.cap = cap;
+	while(__pool.nstacks > cap) {
+		p = __pool.stacks;
+		__pool.stacks = *(void **)p;
+		__pool.nstacks--;
+		free(p);
+	}
+	while(__pool.ndescs > cap) {
+		p = __pool.descs;
+		__pool.descs = *(void **)p;
+		__pool.ndescs--;
+		free(p);
+	}
+	pool_unlock();
+	return old;
+}
+
+/* copies the counters of the pool in the structure pointed by stats
+ */
+void mythread_pool_getstats(struct mythread_pool_stats *stats) {
+	pool_lock();
+	stats->stack_hits = __pool.stack_hits;
+	stats->stack_misses = __pool.stack_misses;
+	stats->desc_hits = __pool.desc_hits;
+	stats->desc_misses = __pool.desc_misses;
+	stats->stacks = __pool.nstacks;
+	stats->descs = __pool.ndescs;
+	stats->cap = __pool.cap;
+	pool_unlock();
+}
+
+/* reads the counters which the kernel keeps for the thread tid in stats,
+ * schedstat has the time on the cpu and the time waited in a run queue
+ * and status has the state and the numbers of voluntary and forced
+ * context switches, the counters stay 0 if tid is 0 (the thread exited)
+ * it returns 1 if the thread is running or ready to run
+ */
+static int task_stats(int tid, struct mythread_thread_stats *stats) {
+	char path[64], line[256], state = 0;
+	unsigned long voluntary = 0, forced = 0;
+	FILE *fp;
+	stats->run_ns = stats->wait_ns = stats->switches = stats->preempted = 0;
+	if(!tid)
+		return 0;
+	snprintf(path, sizeof(path), "/proc/self/task/%d/schedstat", tid);
+	if((fp = fopen(path, "r"))) {
+		if(fscanf(fp, "%lu %lu", &stats->run_ns, &stats->wait_ns) != 2)
+			stats->run_ns = stats->wait_ns = 0;
+		fclose(fp);
+	}
+	snprintf(path, sizeof(path), "/proc/self/task/%d/status", tid);
+	if(!(fp = fopen(path, "r")))
+		return 0;
+	while(fgets(line, sizeof(line), fp))
+		if(!sscanf(line, "State: %c", &state) && !sscanf(line, "voluntary_ctxt_switches: %lu", &voluntary))
+			sscanf(line, "nonvoluntary_ctxt_switches: %lu", &forced);
+	fclose(fp);
+	stats->switches = voluntary + forced;
+	stats->preempted = forced;
+	return state == 'R';
+}
+
+/* copies the counters which the library keeps for thread t
+ */
+static void stats_copy(struct mythread_struct *t, struct mythread_thread_stats *stats) {
+	*stats = t->stats;
+	stats->id = t->id;
+	stats->state = t->state;
+}
+
+/* copies the counters of the thread mythread (0 for the main thread) in
+ * stats, it returns ESRCH if there is no such thread
+ * the counters of a terminated thread stay until it is collected, but
+ * those read from the kernel are 0 once it has exited
+ */
+int mythread_stats(mythread_t mythread, struct mythread_thread_stats *stats) {
+	struct mythread_struct *t = &__mainthread;
+	int tid;
+	superlock_lock();
+	if(mythread && !(t = table_lookup(mythread))) {
+		superlock_unlock();
+		return ESRCH;
+	}
+	stats_copy(t, stats);
+	tid = t == &__mainthread ? getpid() : t->tid;
+	superlock_unlock();
+	task_stats(tid, stats);
+	return 0;
+}
+
+/* copies the counters of all threads which are not collected (the main
+ * thread first) to a new array *threads and sums them in s, it returns
+ * the number of threads or -1 if there is no memory
+ * the counters of the library are copied with superlock held and those
+ * of the kernel are read after it is released
+ */
+static int stats_collect(struct mythread_thread_stats **threads, struct mythread_sched_stats *s) {
+	struct mythread_thread_stats *th;
+	struct mythread_struct *t;
+	int *tids, i, n = 0;
+	superlock_lock();
+	th = (struct mythread_thread_stats *)malloc((__table_size + 1) * sizeof(struct mythread_thread_stats));
+	tids = (int *)malloc((__table_size + 1) * sizeof(int));
+	if(!th || !tids) {
+		superlock_unlock();
+		free(th);
+		free(tids);
+		return -1;
+	}
+	stats_copy(&__mainthread, &th[n]);
+	tids[n++] = getpid();
+	for(i = 0; i < __table_size; i++)
+		if((t = table_slot(i)->thread)) {
+			stats_copy(t, &th[n]);
+			tids[n++] = t->tid;
+		}
+	superlock_unlock();
+	memset(s, 0, sizeof(struct mythread_sched_stats));
+	for(i = 0; i < n; i++) {
+		s->runnable += task_stats(tids[i], &th[i]);
+		s->switches += th[i].switches;
+		s->preemptions += th[i].preempted;
+	}
+	s->created = __created;
+	s->exited = __exited;
+	s->threads = s->created - s->exited + 1;
+	free(tids);
+	*threads = th;
+	return n;
+}
+
+/* copies the counters of the whole process in stats
+ */
+void mythread_sched_stats(struct mythread_sched_stats *stats) {
+	struct mythread_thread_stats *threads;
+	if(stats_collect(&threads, stats) != -1)
+		free(threads);
+}
+
+/* writes the snapshot of n threads and of the scheduler to path, first
+ * to a temporary file which is then renamed over path, so a reader (like
+ * a top of the threads) never sees a half written snapshot
+ * every line is a json object, the first one has the counters of the
+ * scheduler and every other one those of a thread
+ * it returns 0 or the errno of the failed call
+ */
+static int stats_write(const char *path, struct mythread_sched_stats *s, struct mythread_thread_stats *threads, int n) {
+	char tmp[sizeof(__export_path) + 8];
+	FILE *fp;
+	int i;
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	if(!(fp = fopen(tmp, "w")))
+		return errno;
+	fprintf(fp, "{\"pid\": %d, \"time_ns\": %lu, \"threads\": %d, \"runnable\": %d, \"switches\": %lu, "
+		"\"preemptions\": %lu, \"created\": %lu, \"exited\": %lu, \"idle_ns\": %lu}\n",
+		getpid(), now_ns(), s->threads, s->runnable, s->switches, s->preemptions, s->created, s->exited, s->idle_ns);
+	for(i = 0; i < n; i++)
+		fprintf(fp, "{\"id\": %lu, \"state\": %d, \"run_ns\": %lu, \"wait_ns\": %lu, \"lock_ns\": %lu, "
+			"\"switches\": %lu, \"preempted\": %lu, \"signals\": %lu}\n",
+			threads[i].id, threads[i].state, threads[i].run_ns, threads[i].wait_ns, threads[i].lock_ns,
+			threads[i].switches, threads[i].preempted, threads[i].signals);
+	if(fclose(fp) == EOF || rename(tmp, path) == -1)
+		return errno;
+	return 0;
+}
+
+/* takes a snapshot of all threads which are not collected and writes it
+ * to path
+ */
+static int stats_snapshot(const char *path) {
+	struct mythread_thread_stats *threads;
+	struct mythread_sched_stats s;
+	int n, status;
+	if((n = stats_collect(&threads, &s)) == -1)
+		return ENOMEM;
+	status = stats_write(path, &s, threads, n);
+	free(threads);
+	return status;
+}
+
+/* the exporter thread writes a snapshot every __export_interval
+ * milliseconds until the export is stopped, meanwhile it sleeps in the
+ * kernel and takes no cpu
+ * it is a pthread and not a one-one thread, it calls malloc and stdio
+ * while the other threads do and needs TLS of its own
+ */
+static void *stats_exporter(void *arg) {
+	char path[sizeof(__export_path)];
+	struct timespec ts;
+	long interval;
+	while(1) {
+		superlock_lock();
+		if(!(interval = __export_interval)) {
+			__exporting = 0;
+			superlock_unlock();
+			break;
+		}
+		memcpy(path, __export_path, sizeof(path));
+		superlock_unlock();
+		stats_snapshot(path);
+		ts.tv_sec = interval / 1000;
+		ts.tv_nsec = interval % 1000 * 1000000;
+		nanosleep(&ts, NULL);
+	}
+	return NULL;
+}
+
+/* exports the counters of all threads and of the process to the file
+ * path (for example in /dev/shm), so that other processes can watch them
+ * if interval_ms is positive a thread rewrites the file every interval_ms
+ * milliseconds (calling it again only changes path and interval), else
+ * the file is written once now, if path is NULL the periodic export stops
+ * it returns 0, ENAMETOOLONG if path is too long, EAGAIN if the exporter
+ * thread can not be created or the errno of writing the file
+ */
+int mythread_stats_export(const char *path, long interval_ms) {
+	pthread_t exporter;
+	pthread_attr_t attr;
+	int start, status = 0;
+	if(!path) {
+		superlock_lock();
+		__export_interval = 0;
+		superlock_unlock();
+		return 0;
+	}
+	if(strlen(path) >= sizeof(__export_path))
+		return ENAMETOOLONG;
+	if(interval_ms <= 0)
+		return stats_snapshot(path);
+	superlock_lock();
+	start = !__exporting;
+	__exporting = 1;
+	strcpy(__export_path, path);
+	__export_interval = interval_ms;
+	superlock_unlock();
+	if(!start)
+		return 0;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if(pthread_create(&exporter, &attr, stats_exporter, NULL)) {
+		superlock_lock();
+		__exporting = 0;
+		__export_interval = 0;
+		superlock_unlock();
+		status = EAGAIN;
+	}
+	pthread_attr_destroy(&attr);
+	return status;
+}
+/* initialises the mutex m, a mutex can also be initialised with
+ * MYTHREAD_MUTEX_INITIALIZER
+ * the state of a mutex is 0 when it is unlocked, 1 when it is locked and
+ * 2 when it is locked and some threads may sleep on it (as a futex), only
+ * unlocking a mutex in state 2 needs a system call
+ */
+int mythread_mutex_init(mythread_mutex_t *m) {
+	m->state = 0;
+	return 0;
+}
+
+/* returns EBUSY if the mutex m is locked
+ */
+int mythread_mutex_destroy(mythread_mutex_t *m) {
+	return m->state ? EBUSY : 0;
+}
+
+/* counts the time since start in the lock wait time of the calling thread
+ */
+static inline void lock_waited(unsigned long start) {
+	if(__mainthread.self)
+		current_thread()->stats.lock_ns += now_ns() - start;
+}
+
+/* locks m, a thread which finds it locked marks it contended (state 2)
+ * and sleeps on it until it is unlocked
+ */
+int mythread_mutex_lock(mythread_mutex_t *m) {
+	int c = 0;
+	unsigned long start;
+	if(__atomic_compare_exchange_n(&m->state, &c, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return 0;
+	start = now_ns();
+	if(c != 2)
+		c = __atomic_exchange_n(&m->state, 2, __ATOMIC_ACQUIRE);
+	while(c != 0) {
+		futex(&m->state, FUTEX_WAIT_PRIVATE, 2);
+		c = __atomic_exchange_n(&m->state, 2, __ATOMIC_ACQUIRE);
+	}
+	lock_waited(start);
+	return 0;
+}
+
+/* same as mythread_mutex_lock but the thread sleeps only until abstime
+ * (of CLOCK_REALTIME), then it returns ETIMEDOUT and leaves m contended
+ * (the next unlock just makes a needless wake)
+ */
+int mythread_mutex_timedlock(mythread_mutex_t *m, const struct timespec *abstime) {
+	int c = 0;
+	unsigned long start;
+	if(__atomic_compare_exchange_n(&m->state, &c, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return 0;
+	start = now_ns();
+	if(c != 2)
+		c = __atomic_exchange_n(&m->state, 2, __ATOMIC_ACQUIRE);
+	while(c != 0) {
+		if(syscall(SYS_futex, &m->state, FUTEX_WAIT_BITSET_PRIVATE | FUTEX_CLOCK_REALTIME, 2, abstime, NULL, FUTEX_BITSET_MATCH_ANY) == -1 && errno == ETIMEDOUT) {
+			lock_waited(start);
+			return ETIMEDOUT;
+		}
+		c = __atomic_exchange_n(&m->state, 2, __ATOMIC_ACQUIRE);
+	}
+	lock_waited(start);
+	return 0;
+}
+
+/* same as mythread_mutex_lock but it returns EBUSY if m is locked
+ */
+int mythread_mutex_trylock(mythread_mutex_t *m) {
+	int c = 0;
+	return __atomic_compare_exchange_n(&m->state, &c, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED) ? 0 : EBUSY;
+}
+
+/* unlocks m and wakes one sleeping thread if it was contended, it
+ * returns EPERM if m is not locked
+ */
+int mythread_mutex_unlock(mythread_mutex_t *m) {
+	int c = __atomic_fetch_sub(&m->state, 1, __ATOMIC_RELEASE);
+	if(c == 1)
+		return 0;
+	if(c == 0) {
+		__atomic_store_n(&m->state, 0, __ATOMIC_RELAXED);
+		return EPERM;
+	}
+	__atomic_store_n(&m->state, 0, __ATOMIC_RELEASE);
+	futex(&m->state, FUTEX_WAKE_PRIVATE, 1);
+	return 0;
+}
+
+/* initialises the condition variable c, it can also be initialised with
+ * MYTHREAD_COND_INITIALIZER
+ * seq is a futex which is increased by every signal and broadcast, a
+ * waiter reads it before it unlocks the mutex and sleeps only if it did
+ * not change meanwhile, so no signal can be missed
+ */
+int mythread_cond_init(mythread_cond_t *c) {
+	c->seq = 0;
+	return 0;
+}
+
+int mythread_cond_destroy(mythread_cond_t *c) {
+	return 0;
+}
+
+/* unlocks m and sleeps on c until it is signalled, then locks m again
+ * m is locked as contended (state 2), as other threads woken by a
+ * broadcast may sleep on it
+ * if abstime is not NULL the wait ends at that time (of CLOCK_REALTIME, as
+ * for pthread_cond_timedwait) and ETIMEDOUT is returned
+ */
+int mythread_cond_timedwait(mythread_cond_t *c, mythread_mutex_t *m, const struct timespec *abstime) {
+	int seq = __atomic_load_n(&c->seq, __ATOMIC_ACQUIRE), status = 0;
+	if(mythread_mutex_unlock(m) == EPERM)
+		return EPERM;
+	if(syscall(SYS_futex, &c->seq, FUTEX_WAIT_BITSET_PRIVATE | FUTEX_CLOCK_REALTIME, seq, abstime, NULL, FUTEX_BITSET_MATCH_ANY) == -1 && errno == ETIMEDOUT)
+		status = ETIMEDOUT;
+	while(__atomic_exchange_n(&m->state, 2, __ATOMIC_ACQUIRE) != 0)
+		futex(&m->state, FUTEX_WAIT_PRIVATE, 2);
+	return status;
+}
+
+int mythread_cond_wait(mythread_cond_t *c, mythread_mutex_t *m) {
+	return mythread_cond_timedwait(c, m, NULL);
+}
+
+/* wakes one thread waiting on c
+ */
+int mythread_cond_signal(mythread_cond_t *c) {
+	__atomic_fetch_add(&c->seq, 1, __ATOMIC_RELEASE);
+	futex(&c->seq, FUTEX_WAKE_PRIVATE, 1);
+	return 0;
+}
+
+/* wakes all threads waiting on c
+ */
+int mythread_cond_broadcast(mythread_cond_t *c) {
+	__atomic_fetch_add(&c->seq, 1, __ATOMIC_RELEASE);
+	futex(&c->seq, FUTEX_WAKE_PRIVATE, INT_MAX);
+	return 0;
+}
+
+/* channels, the ring buffer itself is lock free (see mythread.h), a cell
+ * is the sequence number followed by the element, rounded up to keep the
+ * sequence numbers aligned
+ */
+static inline char *chan_cell(mythread_chan_t *ch, unsigned long pos) {
+	return ch->cells + (pos & ch->mask) * ch->stride;
+}
+
+/* copies elem into the cell at the tail of ch, it returns EAGAIN if ch is
+ * full
+ */
+static int chan_push(mythread_chan_t *ch, const void *elem) {
+	unsigned long pos = __atomic_load_n(&ch->tail, __ATOMIC_RELAXED), seq;
+	char *cell;
+	long diff;
+	for(;;) {
+		cell = chan_cell(ch, pos);
+		seq = __atomic_load_n((unsigned long *)cell, __ATOMIC_ACQUIRE);
+		diff = (long)(seq - pos);
+		if(diff == 0) {
+			if(__atomic_compare_exchange_n(&ch->tail, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		}
+		else if(diff < 0)
+			return EAGAIN;
+		else
+			pos = __atomic_load_n(&ch->tail, __ATOMIC_RELAXED);
+	}
+	memcpy(cell + sizeof(unsigned long), elem, ch->elemsize);
+	__atomic_store_n((unsigned long *)cell, pos + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/* copies the element at the head of ch into elem and frees its cell for
+ * the sender one lap later, it returns EAGAIN if ch is empty
+ */
+static int chan_pop(mythread_chan_t *ch, void *elem) {
+	unsigned long pos = __atomic_load_n(&ch->head, __ATOMIC_RELAXED), seq;
+	char *cell;
+	long diff;
+	for(;;) {
+		cell = chan_cell(ch, pos);
+		seq = __atomic_load_n((unsigned long *)cell, __ATOMIC_ACQUIRE);
+		diff = (long)(seq - (pos + 1));
+		if(diff == 0) {
+			if(__atomic_compare_exchange_n(&ch->head, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		}
+		else if(diff < 0)
+			return EAGAIN;
+		else
+			pos = __atomic_load_n(&ch->head, __ATOMIC_RELAXED);
+	}
+	memcpy(elem, cell + sizeof(unsigned long), ch->elemsize);
+	__atomic_store_n((unsigned long *)cell, pos + ch->mask + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/* initialises the channel ch for elements of elemsize bytes, cap (rounded
+ * up to a power of two) elements can be sent before a sender blocks
+ * it returns EINVAL if cap is 0 and ENOMEM if there is no memory
+ */
+int mythread_chan_init(mythread_chan_t *ch, size_t elemsize, unsigned int cap) {
+	unsigned long n = 1, i;
+	if(!ch || !cap)
+		return EINVAL;
+	while(n < cap)
+		n <<= 1;
+	ch->stride = sizeof(unsigned long) + (elemsize + sizeof(unsigned long) - 1) / sizeof(unsigned long) * sizeof(unsigned long);
+	if(!(ch->cells = (char *)malloc(n * ch->stride)))
+		return ENOMEM;
+	for(i = 0; i < n; i++)
+		*(unsigned long *)(ch->cells + i * ch->stride) = i;
+	ch->head = ch->tail = 0;
+	ch->mask = n - 1;
+	ch->elemsize = elemsize;
+	ch->closed = 0;
+	ch->sendseq = ch->recvseq = 0;
+	ch->sendwaiters = ch->recvwaiters = 0;
+	mythread_spin_init(&ch->selectlock);
+	ch->selecters = NULL;
+	return 0;
+}
+
+/* frees the buffer of ch, it returns EBUSY if some thread is blocked on ch
+ * (also in a select with a case of ch)
+ */
+int mythread_chan_destroy(mythread_chan_t *ch) {
+	if(ch->sendwaiters || ch->recvwaiters || ch->selecters)
+		return EBUSY;
+	free(ch->cells);
+	ch->cells = NULL;
+	return 0;
+}
+
+/* wakes n threads sleeping on the futex seq of ch if waiters says there
+ * are any, and the threads sleeping in mythread_chan_select with a case
+ * of ch, each on the futex of its own select
+ * the fence orders the change of the channel before the check of the
+ * waiters, a waiter registers before it checks the channel again
+ */
+static void chan_wake(mythread_chan_t *ch, volatile int *seq, volatile int *waiters, int n) {
+	mythread_chan_case_t *c;
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if(__atomic_load_n(waiters, __ATOMIC_RELAXED)) {
+		__atomic_fetch_add(seq, 1, __ATOMIC_RELEASE);
+		futex(seq, FUTEX_WAKE_PRIVATE, n);
+	}
+	if(!__atomic_load_n(&ch->selecters, __ATOMIC_RELAXED))
+		return;
+	ticket_lock(&ch->selectlock);
+	for(c = ch->selecters; c; c = c->next) {
+		__atomic_fetch_add((volatile int *)c->waiter, 1, __ATOMIC_RELEASE);
+		futex((volatile int *)c->waiter, FUTEX_WAKE_PRIVATE, 1);
+	}
+	ticket_unlock(&ch->selectlock);
+}
+
+/* sends a copy of elem on ch without blocking, it returns EAGAIN if ch is
+ * full and EPIPE if ch is closed
+ */
+int mythread_chan_try_send(mythread_chan_t *ch, const void *elem) {
+	if(__atomic_load_n(&ch->closed, __ATOMIC_ACQUIRE))
+		return EPIPE;
+	if(chan_push(ch, elem))
+		return EAGAIN;
+	chan_wake(ch, &ch->recvseq, &ch->recvwaiters, 1);
+	return 0;
+}
+
+/* receives an element of ch into elem without blocking, it returns EAGAIN
+ * if ch is empty and EPIPE if ch is also closed (elements sent before the
+ * channel was closed are still received)
+ */
+int mythread_chan_try_recv(mythread_chan_t *ch, void *elem) {
+	if(chan_pop(ch, elem)) {
+		if(!__atomic_load_n(&ch->closed, __ATOMIC_ACQUIRE))
+			return EAGAIN;
+		if(chan_pop(ch, elem))
+			return EPIPE;
+	}
+	chan_wake(ch, &ch->sendseq, &ch->sendwaiters, 1);
+	return 0;
+}
+
+/* sends a copy of elem on ch, a sender which finds ch full sleeps on the
+ * futex sendseq until a receiver makes room
+ * it returns 0, or EPIPE if ch is closed
+ */
+int mythread_chan_send(mythread_chan_t *ch, const void *elem) {
+	int seq, status;
+	while((status = mythread_chan_try_send(ch, elem)) == EAGAIN) {
+		seq = __atomic_load_n(&ch->sendseq, __ATOMIC_ACQUIRE);
+		__atomic_fetch_add(&ch->sendwaiters, 1, __ATOMIC_SEQ_CST);
+		if((status = mythread_chan_try_send(ch, elem)) == EAGAIN)
+			futex(&ch->sendseq, FUTEX_WAIT_PRIVATE, seq);
+		__atomic_fetch_sub(&ch->sendwaiters, 1, __ATOMIC_RELAXED);
+		if(status != EAGAIN)
+			break;
+	}
+	return status;
+}
+
+/* receives an element of ch into elem, a receiver which finds ch empty
+ * sleeps on the futex recvseq until a sender sends something
+ * it returns 0, or EPIPE if ch is closed and empty
+ */
+int mythread_chan_recv(mythread_chan_t *ch, void *elem) {
+	int seq, status;
+	while((status = mythread_chan_try_recv(ch, elem)) == EAGAIN) {
+		seq = __atomic_load_n(&ch->recvseq, __ATOMIC_ACQUIRE);
+		__atomic_fetch_add(&ch->recvwaiters, 1, __ATOMIC_SEQ_CST);
+		if((status = mythread_chan_try_recv(ch, elem)) == EAGAIN)
+			futex(&ch->recvseq, FUTEX_WAIT_PRIVATE, seq);
+		__atomic_fetch_sub(&ch->recvwaiters, 1, __ATOMIC_RELAXED);
+		if(status != EAGAIN)
+			break;
+	}
+	return status;
+}
+
+/* closes ch, sends fail from now on and receives fail once ch is empty,
+ * all blocked senders and receivers are woken
+ * it returns EINVAL if ch is already closed
+ */
+int mythread_chan_close(mythread_chan_t *ch) {
+	if(__atomic_exchange_n(&ch->closed, 1, __ATOMIC_SEQ_CST))
+		return EINVAL;
+	chan_wake(ch, &ch->sendseq, &ch->sendwaiters, INT_MAX);
+	chan_wake(ch, &ch->recvseq, &ch->recvwaiters, INT_MAX);
+	return 0;
+}
+
+/* tries the cases once, starting from case start so that no case is
+ * always preferred, it returns the index of the case which was done or
+ * -1 if no case could be done
+ */
+static int chan_select(mythread_chan_case_t *cases, int n, unsigned int start) {
+	int i, k, status;
+	for(k = 0; k < n; k++) {
+		i = (start + k) % n;
+		if(!cases[i].ch)
+			continue;
+		if(cases[i].op == MYTHREAD_CHAN_SEND)
+			status = mythread_chan_try_send(cases[i].ch, cases[i].elem);
+		else
+			status = mythread_chan_try_recv(cases[i].ch, cases[i].elem);
+		if(status != EAGAIN) {
+			cases[i].status = status;
+			return i;
+		}
+	}
+	return -1;
+}
+
+/* links the cases of a select which is going to sleep on the futex wake
+ * into the selecters of their channels, so that a change of one of these
+ * channels (and of no other) wakes it
+ */
+static void chan_select_register(mythread_chan_case_t *cases, int n, volatile int *wake) {
+	int i;
+	for(i = 0; i < n; i++) {
+		if(!cases[i].ch)
+			continue;
+		cases[i].waiter = (void *)wake;
+		ticket_lock(&cases[i].ch->selectlock);
+		cases[i].next = cases[i].ch->selecters;
+		__atomic_store_n(&cases[i].ch->selecters, &cases[i], __ATOMIC_RELAXED);
+		ticket_unlock(&cases[i].ch->selectlock);
+	}
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+/* unlinks the cases of a select from the selecters of their channels
+ */
+static void chan_select_unregister(mythread_chan_case_t *cases, int n) {
+	mythread_chan_case_t **p;
+	int i;
+	for(i = 0; i < n; i++) {
+		if(!cases[i].ch)
+			continue;
+		ticket_lock(&cases[i].ch->selectlock);
+		for(p = (mythread_chan_case_t **)&cases[i].ch->selecters; *p && *p != &cases[i]; p = &(*p)->next)
+			;
+		if(*p)
+			*p = cases[i].next;
+		ticket_unlock(&cases[i].ch->selectlock);
+	}
+}
+
+/* waits until one of the n cases can be done (like select of go), does it
+ * and returns its index, if more cases are ready one of them is chosen
+ * in round robin
+ * if block is 0 it returns -1 at once when no case is ready
+ * a blocked select registers its cases in their channels and sleeps on a
+ * futex of its own, which only the channels of its cases wake
+ */
+int mythread_chan_select(mythread_chan_case_t *cases, int n, int block) {
+	unsigned int start = __atomic_fetch_add(&__chan_selectrr, 1, __ATOMIC_RELAXED);
+	volatile int wake = 0;
+	int i, seq, registered = 0;
+	for(;;) {
+		seq = __atomic_load_n(&wake, __ATOMIC_ACQUIRE);
+		if((i = chan_select(cases, n, start)) != -1 || !block)
+			break;
+		if(registered)
+			futex(&wake, FUTEX_WAIT_PRIVATE, seq);
+		else {
+			chan_select_register(cases, n, &wake);
+			registered = 1;
+		}
+	}
+	if(registered)
+		chan_select_unregister(cases, n);
+	return i;
+}
+
+/* the fork-join task runtime, a fixed set of workers (the thread which
+ * calls mythread_task_run is worker 0, the others are one-one threads
+ * created once) run tasks from per worker deques
+ * a worker pushes and pops tasks at the bottom of its own deque without
+ * any lock, idle workers steal from the top of the deques of random
+ * victims with one compare and swap (the Chase-Lev deque)
+ * workers which find nothing to steal sleep on the futex __task_seq, a
+ * spawn wakes one of them only if some worker sleeps
+ * __task_pending counts the spawned tasks which have not finished, so the
+ * root knows when the tasks stolen by other workers are done as well
+ */
+static struct mythread_task_worker __taskworkers[MYTHREAD_TASK_MAX_WORKERS];
+static int __ntaskworkers = 0;
+static volatile int __task_seq = 0, __task_sleepers = 0;	//futex and number of sleeping workers
+static volatile int __task_root = 0, __task_initlock = 0;	//set while a thread is worker 0, lock of mythread_task_init
+static volatile long __task_pending = 0;		//tasks spawned and not finished yet
+
+/* pushes task at the bottom of the deque of w, it returns -1 if the
+ * deque is full, only the owner of w calls it
+ */
+static inline int deque_push(struct mythread_task_worker *w, mythread_task_t *task) {
+	long b = w->bottom, t = __atomic_load_n(&w->top, __ATOMIC_ACQUIRE);
+	if(b - t >= MYTHREAD_TASK_DEQUE)
+		return -1;
+	__atomic_store_n(&w->tasks[b & (MYTHREAD_TASK_DEQUE - 1)], task, __ATOMIC_RELAXED);
+	__atomic_store_n(&w->bottom, b + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/* pops the task at the bottom of the deque of w, only the owner of w
+ * calls it, the last task may be taken by a thief at the same time, in
+ * that case the compare and swap on top decides who gets it
+ */
+static inline mythread_task_t *deque_pop(struct mythread_task_worker *w) {
+	long b = w->bottom - 1, t;
+	mythread_task_t *task;
+	__atomic_store_n(&w->bottom, b, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	t = __atomic_load_n(&w->top, __ATOMIC_RELAXED);
+	if(t > b) {
+		__atomic_store_n(&w->bottom, b + 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+	task = __atomic_load_n(&w->tasks[b & (MYTHREAD_TASK_DEQUE - 1)], __ATOMIC_RELAXED);
+	if(t == b) {
+		if(!__atomic_compare_exchange_n(&w->top, &t, t + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+			task = NULL;
+		__atomic_store_n(&w->bottom, b + 1, __ATOMIC_RELAXED);
+	}
+	return task;
+}
+
+/* steals the task at the top of the deque of w, it returns NULL if the
+ * deque is empty or another thread took the task first
+ */
+static inline mythread_task_t *deque_steal(struct mythread_task_worker *w) {
+	long t = __atomic_load_n(&w->top, __ATOMIC_ACQUIRE), b;
+	mythread_task_t *task;
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	b = __atomic_load_n(&w->bottom, __ATOMIC_ACQUIRE);
+	if(t >= b)
+		return NULL;
+	task = __atomic_load_n(&w->tasks[t & (MYTHREAD_TASK_DEQUE - 1)], __ATOMIC_RELAXED);
+	if(!__atomic_compare_exchange_n(&w->top, &t, t + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+		return NULL;
+	return task;
+}
+
+/* finds a task for worker w, first in its own deque and then in the deques
+ * of randomly chosen workers
+ */
+static mythread_task_t *task_find(struct mythread_task_worker *w) {
+	mythread_task_t *task = deque_pop(w);
+	int i, n = __ntaskworkers;
+	for(i = 0; !task && i < 2 * n; i++) {
+		w->seed ^= w->seed << 13;
+		w->seed ^= w->seed >> 17;
+		w->seed ^= w->seed << 5;
+		if((int)(w->seed % n) != w->id)
+			task = deque_steal(&__taskworkers[w->seed % n]);
+	}
+	return task;
+}
+
+static inline void task_execute(mythread_task_t *task) {
+	task->fun(task->args);
+	__atomic_store_n(&task->done, 1, __ATOMIC_RELEASE);
+	__atomic_fetch_sub(&__task_pending, 1, __ATOMIC_RELEASE);
+}
+
+/* the function of the worker threads, a worker looks for work a few times
+ * before it sleeps, the sequence number is read before the last look so
+ * that a spawn between that look and the futex wait changes it and the
+ * wait returns at once
+ */
+static void *task_worker(void *arg) {
+	struct mythread_task_worker *w = (struct mythread_task_worker *)arg;
+	mythread_task_t *task;
+	int seq, idle = 0;
+	current_thread()->taskworker = w;
+	while(1) {
+		if((task = task_find(w))) {
+			task_execute(task);
+			idle = 0;
+			continue;
+		}
+		if(++idle < 64)
+			continue;
+		seq = __atomic_load_n(&__task_seq, __ATOMIC_ACQUIRE);
+		__atomic_fetch_add(&__task_sleepers, 1, __ATOMIC_SEQ_CST);
+		if(!(task = task_find(w)))
+			futex(&__task_seq, FUTEX_WAIT_PRIVATE, seq);
+		__atomic_fetch_sub(&__task_sleepers, 1, __ATOMIC_SEQ_CST);
+		if(task)
+			task_execute(task);
+		idle = 0;
+	}
+	return NULL;
+}
+
+/* starts the workers of the task runtime, nworkers is the number of
+ * workers including the thread calling mythread_task_run, if it is 0 the
+ * value of the environment variable MYTHREAD_TASK_WORKERS or the number of
+ * online cpus is used
+ * if the environment variable MYTHREAD_TASK_SPREAD is set, worker i is
+ * placed on physical core i (see mythread_attr_setcore), so the workers
+ * do not share cores as long as there are enough of them
+ * the workers are pthreads, tasks and loop bodies call libc (malloc,
+ * stdio) on all of them at once and need its TLS
+ * it returns the number of workers, the workers are started only once and
+ * later calls just return their number
+ */
+int mythread_task_init(int nworkers) {
+	int i, spread = getenv("MYTHREAD_TASK_SPREAD") != NULL;
+	char *env;
+	mythread_t t;
+	mythread_attr_t attr;
+	while(__sync_lock_test_and_set(&__task_initlock, 1));
+	if(__ntaskworkers) {
+		__sync_lock_release(&__task_initlock);
+		return __ntaskworkers;
+	}
+	if(nworkers <= 0)
+		nworkers = (env = getenv("MYTHREAD_TASK_WORKERS")) ? atoi(env) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+	if(nworkers < 1)
+		nworkers = 1;
+	if(nworkers > MYTHREAD_TASK_MAX_WORKERS)
+		nworkers = MYTHREAD_TASK_MAX_WORKERS;
+	for(i = 0; i < nworkers; i++) {
+		__taskworkers[i].id = i;
+		__taskworkers[i].seed = 2463534242U + i;
+	}
+	__ntaskworkers = nworkers;
+	for(i = 1; i < nworkers; i++) {
+		mythread_attr_init(&attr);
+		if(spread)
+			mythread_attr_setcore(&attr, i);
+		if(thread_create(&t, &attr, task_worker, &__taskworkers[i], 1) != 0)
+			break;
+	}
+	__ntaskworkers = i;
+	__sync_lock_release(&__task_initlock);
+	return __ntaskworkers;
+}
+
+/* runs fun(args) as the root task with the calling thread as worker 0,
+ * tasks spawned by it (and by their children) are run by all workers
+ * it returns when fun has returned and every task it spawned without a
+ * sync has run, also those stolen by other workers, meanwhile worker 0
+ * runs and steals tasks like a worker in mythread_task_sync
+ * only one thread can be worker 0 at a time, others wait
+ * if it is called inside a task, fun is just called
+ */
+void mythread_task_run(void (*fun)(void *), void *args) {
+	struct mythread_struct *self;
+	mythread_task_t *task;
+	int idle = 0;
+	set_main_thread_pointer();
+	mythread_task_init(0);
+	self = current_thread();
+	if(self->taskworker) {
+		fun(args);
+		return;
+	}
+	while(__sync_lock_test_and_set(&__task_root, 1))
+		sched_yield();
+	self->taskworker = &__taskworkers[0];
+	fun(args);
+	while(__atomic_load_n(&__task_pending, __ATOMIC_ACQUIRE)) {
+		if((task = task_find(&__taskworkers[0]))) {
+			task_execute(task);
+			idle = 0;
+		}
+		else if(++idle >= 64) {
+			sched_yield();
+			idle = 0;
+		}
+	}
+	self->taskworker = NULL;
+	__sync_lock_release(&__task_root);
+}
+
+/* makes fun(args) a task which may run on any worker, task is the handle
+ * which is passed to mythread_task_sync and must stay valid until then
+ * (it is usually a local variable of the spawning function)
+ * the task is run at once if the caller is not a worker or its deque is full
+ */
+void mythread_task_spawn(mythread_task_t *task, void (*fun)(void *), void *args) {
+	struct mythread_task_worker *w = current_thread()->taskworker;
+	task->fun = fun;
+	task->args = args;
+	task->done = 0;
+	__atomic_fetch_add(&__task_pending, 1, __ATOMIC_RELAXED);
+	if(!w || deque_push(w, task) == -1) {
+		task_execute(task);
+		return;
+	}
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if(__atomic_load_n(&__task_sleepers, __ATOMIC_RELAXED)) {
+		__atomic_fetch_add(&__task_seq, 1, __ATOMIC_SEQ_CST);
+		futex(&__task_seq, FUTEX_WAKE_PRIVATE, 1);
+	}
+}
+
+/* waits until task has run, meanwhile the caller runs tasks from its own
+ * deque (usually task itself, which is then run without being stolen) and
+ * steals from others, so a waiting worker never sits idle
+ */
+void mythread_task_sync(mythread_task_t *task) {
+	struct mythread_task_worker *w = current_thread()->taskworker;
+	mythread_task_t *other;
+	int idle = 0;
+	while(!__atomic_load_n(&task->done, __ATOMIC_ACQUIRE)) {
+		if(w && (other = task_find(w))) {
+			task_execute(other);
+			idle = 0;
+		}
+		else if(++idle >= 64) {
+			sched_yield();
+			idle = 0;
+		}
+	}
+}
+
+/* runs part (out of f->nparts parts) of the loop f, the chunks of a
+ * static loop are fixed in advance (blocks of grain iterations dealt round
+ * robin, or one equal block per part if grain is 0), the other schedules
+ * take chunks from f->next: dynamic ones always grain iterations, guided
+ * ones a share of the remaining iterations which shrinks down to grain
+ */
+static void for_run(struct mythread_for *f, int part) {
+	long lo, chunk, n;
+	long grain = f->grain > 0 ? f->grain : 1;
+	switch(f->schedule) {
+		case MYTHREAD_FOR_STATIC:
+			if(f->grain <= 0) {
+				n = f->end - f->begin;
+				lo = f->begin + n * part / f->nparts;
+				if(lo < f->begin + n * (part + 1) / f->nparts)
+					f->fn(lo, f->begin + n * (part + 1) / f->nparts, f->ctx);
+				break;
+			}
+			for(lo = f->begin + part * grain; lo < f->end; lo += f->nparts * grain)
+				f->fn(lo, lo + grain < f->end ? lo + grain : f->end, f->ctx);
+			break;
+		case MYTHREAD_FOR_GUIDED:
+			lo = __atomic_load_n(&f->next, __ATOMIC_RELAXED);
+			while(lo < f->end) {
+				chunk = (f->end - lo) / (2 * f->nparts);
+				if(chunk < grain)
+					chunk = grain;
+				if(__atomic_compare_exchange_n(&f->next, &lo, lo + chunk, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+					f->fn(lo, lo + chunk < f->end ? lo + chunk : f->end, f->ctx);
+					lo = __atomic_load_n(&f->next, __ATOMIC_RELAXED);
+				}
+			}
+			break;
+		default:
+			while((lo = __atomic_fetch_add(&f->next, grain, __ATOMIC_RELAXED)) < f->end)
+				f->fn(lo, lo + grain < f->end ? lo + grain : f->end, f->ctx);
+			break;
+	}
+}
+
+/* calls fn(lo, hi, ctx) for chunks [lo, hi) which together cover the
+ * iterations [begin, end), the chunks are run in parallel with the dynamic
+ * schedule (grain iterations at a time), it returns when all chunks are
+ * done, 0 on success and EINVAL for a wrong schedule
+ */
+int mythread_parallel_for(long begin, long end, long grain, void (*fn)(long, long, void *), void *ctx) {
+	return mythread_parallel_for_sched(begin, end, grain, MYTHREAD_FOR_DYNAMIC, fn, ctx);
+}
+
+/* a part of a parallel loop run as a task
+ */
+struct for_part {
+	struct mythread_for *f;
+	int part;
+	mythread_task_t task;
+};
+
+static void for_task(void *arg) {
+	for_run(((struct for_part *)arg)->f, ((struct for_part *)arg)->part);
+}
+
+/* the root task of a parallel loop, it spawns a task for every part except
+ * part 0, which it runs itself
+ */
+static void for_root(void *arg) {
+	struct mythread_for *f = (struct mythread_for *)arg;
+	struct for_part parts[MYTHREAD_TASK_MAX_WORKERS];
+	int i;
+	for(i = 1; i < f->nparts; i++) {
+		parts[i].f = f;
+		parts[i].part = i;
+		mythread_task_spawn(&parts[i].task, for_task, &parts[i]);
+	}
+	for_run(f, 0);
+	for(i = f->nparts - 1; i > 0; i--)
+		mythread_task_sync(&parts[i].task);
+}
+
+/* same as mythread_parallel_for with the given schedule, the loop is split
+ * in one part per worker of the task runtime, it may also be called inside
+ * a task
+ */
+int mythread_parallel_for_sched(long begin, long end, long grain, int schedule, void (*fn)(long, long, void *), void *ctx) {
+	struct mythread_for f;
+	if(schedule != MYTHREAD_FOR_STATIC && schedule != MYTHREAD_FOR_DYNAMIC && schedule != MYTHREAD_FOR_GUIDED)
+		return EINVAL;
+	if(begin >= end)
+		return 0;
+	f.begin = f.next = begin;
+	f.end = end;
+	f.grain = grain;
+	f.schedule = schedule;
+	f.fn = fn;
+	f.ctx = ctx;
+	f.nparts = mythread_task_init(0);
+	mythread_task_run(for_root, &f);
+	return 0;
+}
+
+/* initialises the mythread_spinlock_t pointed by lock
+ */
+int mythread_spin_init(mythread_spinlock_t *lock) {
+	lock->owner = lock->next = 0;
+	return 0;
+}
+
+/* aquires the lock on mythread_spinlock_t pointed by lock,
+ * if the lock is already held by another thread, then it waits for its
+ * turn, lockers get the lock in the order in which they called this
+ */
+int mythread_spin_lock(mythread_spinlock_t *lock) {
+	unsigned long start;
+	if(!lock)
+		return EINVAL;
+	if(!ticket_trylock(lock)) {
+		start = now_ns();
+		ticket_lock(lock);
+		lock_waited(start);
+	}
+	return 0;
+}
+
+/* frees the mythread_spinlock_t pointed by lock
+ */
+int mythread_spin_unlock(mythread_spinlock_t *lock) {
+	if(!lock || lock->owner == lock->next)
+		return EINVAL;
+	ticket_unlock(lock);
+	return 0;
+}
+
+/* same as mythread_spin_lock with the difference that if the lock is
+ * held by some another thread, it returns immediately with the error
  * number EBUSY
  */
-inline int mythread_spin_trylock(mythread_spinlock_t *lock) {
-	return __sync_lock_test_and_set(lock, 1) ? EBUSY : 0;
+int mythread_spin_trylock(mythread_spinlock_t *lock) {
+	if(!lock)
+		return EINVAL;
+	return ticket_trylock(lock) ? 0 : EBUSY;
+}
+
+/* initialises the mythread_mcslock_t pointed by lock
+ */
+int mythread_mcs_init(mythread_mcslock_t *lock) {
+	lock->tail = NULL;
+	return 0;
+}
+
+/* aquires lock using node, which must be owned by the caller until it
+ * unlocks, the caller links node behind the current tail and spins on
+ * node->locked until its predecessor hands the lock over, yielding the
+ * cpu if that takes long
+ */
+int mythread_mcs_lock(mythread_mcslock_t *lock, mythread_mcsnode_t *node) {
+	mythread_mcsnode_t *prev;
+	unsigned int spins = 0;
+	unsigned long start;
+	if(!lock || !node)
+		return EINVAL;
+	node->next = NULL;
+	node->locked = 1;
+	prev = __atomic_exchange_n(&lock->tail, node, __ATOMIC_ACQ_REL);
+	if(!prev)
+		return 0;
+	start = now_ns();
+	__atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+	while(__atomic_load_n(&node->locked, __ATOMIC_ACQUIRE))
+		if(++spins < MYTHREAD_SPIN_YIELD * MYTHREAD_SPIN_BACKOFF)
+			cpu_relax();
+		else
+			spin_yield();
+	lock_waited(start);
+	return 0;
+}
+
+/* releases lock, which must have been aquired with node, to the next
+ * waiter, if a waiter has swapped the tail but not linked itself yet
+ * it waits for the link
+ */
+int mythread_mcs_unlock(mythread_mcslock_t *lock, mythread_mcsnode_t *node) {
+	mythread_mcsnode_t *next, *expected = node;
+	if(!lock || !node || !lock->tail)
+		return EINVAL;
+	if(!(next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE))) {
+		if(__atomic_compare_exchange_n(&lock->tail, &expected, NULL, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+			return 0;
+		while(!(next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE)))
+			spin_yield();
+	}
+	__atomic_store_n(&next->locked, 0, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/* same as mythread_mcs_lock but returns EBUSY if the lock is held
+ */
+int mythread_mcs_trylock(mythread_mcslock_t *lock, mythread_mcsnode_t *node) {
+	mythread_mcsnode_t *expected = NULL;
+	if(!lock || !node)
+		return EINVAL;
+	node->next = NULL;
+	node->locked = 0;
+	return __atomic_compare_exchange_n(&lock->tail, &expected, node, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED) ? 0 : EBUSY;
 }
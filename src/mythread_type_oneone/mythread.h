@@ -12,9 +12,38 @@
 
 #include <setjmp.h>
 #include <bits/types.h>
+#include <time.h>
+#include <stddef.h>
 
 #define SMALL_STACK_SIZE (10240)
 #define STACK_SIZE (1024 * 1024)
+#define MYTHREAD_POOL_CAP 64				//default number of stacks and structures cached for reuse
+#define MYTHREAD_TABLE_CHUNK 1024		//slots in one chunk of the thread table
+#define MYTHREAD_TABLE_CHUNKS 4096		//chunks in the thread table, so 4M threads can be alive at once
+
+/* a waiter of a ticket spinlock pauses MYTHREAD_SPIN_BACKOFF times for
+ * every waiter ahead of it before it looks at the lock again, up to
+ * MYTHREAD_SPIN_BACKOFF_MAX times, and yields after MYTHREAD_SPIN_YIELD
+ * such rounds
+ */
+#define MYTHREAD_SPIN_BACKOFF 32
+#define MYTHREAD_SPIN_BACKOFF_MAX 4096
+#define MYTHREAD_SPIN_YIELD 8			//rounds of backoff after which a waiter yields the cpu
+#define MYTHREAD_KEYS_MAX 64				//number of thread specific data keys
+#define MYTHREAD_DESTRUCTOR_ITERATIONS 4	//same as PTHREAD_DESTRUCTOR_ITERATIONS
+#define MYTHREAD_TASK_MAX_WORKERS 64		//most workers of the task runtime
+#define MYTHREAD_TASK_DEQUE 4096			//tasks in the deque of a worker, a power of 2
+#define MYTHREAD_CPU_SETSIZE 1024			//cpus in a mythread_cpuset_t, same as CPU_SETSIZE
+#define MYTHREAD_MAX_NODES 64				//numa nodes a thread can be placed on
+
+/* schedules of mythread_parallel_for_sched, like the schedules of openmp
+ * a static loop gives every part fixed chunks, a dynamic one hands out
+ * chunks of grain iterations on demand and a guided one hands out chunks
+ * which shrink from 1 / (2 * parts) of the remaining iterations to grain
+ */
+#define MYTHREAD_FOR_STATIC 0
+#define MYTHREAD_FOR_DYNAMIC 1
+#define MYTHREAD_FOR_GUIDED 2
 
 /* these defines denote various states that a thread can 
  * have, an enumeration of these values will be equally 
@@ -25,40 +54,234 @@
 #define THREAD_TERMINATED 0x2	//thread terminated
 #define THREAD_JOIN_CALLED 0x3	//some other thread called join on that thread
 #define THREAD_COLLECTED 0x4	//the thread is already collected by some thread
+#define THREAD_DETACHED 0x5		//thread is running and will never be joined
 
 #define pid_t __pid_t
 
-/* mythread_t stores the index of the thread in the 2d 
- * array of thread pointers
- * for this, just one unsigned number storage is enough
- * same for spinlock type mythread_spinlock_t which will
- * only take values 0 and 1
+/* mythread_t stores the index of the slot of the thread in the thread
+ * table (plus one, so that 0 is the main thread) in its low 32 bits and
+ * the generation of that slot in its high 32 bits
  */
 typedef unsigned long int mythread_t;
-typedef volatile unsigned short int mythread_spinlock_t;
+
+/* a ticket spinlock, a locker takes the next ticket and waits until
+ * owner reaches it, so the lock is handed over in fifo order
+ * it is unlocked when owner equals next
+ */
+typedef struct mythread_spinlock {
+	volatile unsigned short owner, next;
+} mythread_spinlock_t;
+
+/* a queued (mcs) spinlock, every locker passes its own node which is
+ * linked behind tail and spins only on the locked flag of that node,
+ * so waiters do not share a cache line with each other or the lock
+ * the node must stay valid until mythread_mcs_unlock has returned
+ */
+typedef struct mythread_mcsnode {
+	struct mythread_mcsnode *volatile next;
+	volatile int locked;
+} __attribute__((aligned(64))) mythread_mcsnode_t;
+
+typedef struct mythread_mcslock {
+	mythread_mcsnode_t *volatile tail;
+} mythread_mcslock_t;
+
+#define MYTHREAD_SPINLOCK_INITIALIZER {0, 0}
+#define MYTHREAD_MCSLOCK_INITIALIZER {NULL}
+typedef unsigned int mythread_key_t;
+
+/* a blocking mutex, state is also the futex on which waiters sleep
+ */
+typedef struct mythread_mutex {
+	volatile int state;
+} mythread_mutex_t;
+
+/* a condition variable, waiters sleep on the futex seq
+ */
+typedef struct mythread_cond {
+	volatile int seq;
+} mythread_cond_t;
+
+#define MYTHREAD_MUTEX_INITIALIZER {0}
+#define MYTHREAD_COND_INITIALIZER {0}
+
+/* operations of a case of mythread_chan_select
+ */
+#define MYTHREAD_CHAN_SEND 0
+#define MYTHREAD_CHAN_RECV 1
+
+/* a bounded channel of elements of elemsize bytes, its buffer is a ring of
+ * mask + 1 cells (a power of two) and every cell starts with a sequence
+ * number, a cell is free for the sender of position pos when it is pos and
+ * full for the receiver of pos when it is pos + 1, so senders and receivers
+ * claim positions with a compare and swap of tail or head without a lock
+ * head and tail are on cache lines of their own, so senders and receivers
+ * do not slow each other down
+ */
+typedef struct mythread_chan {
+	volatile unsigned long head __attribute__((aligned(64)));	//next position to receive from
+	volatile unsigned long tail __attribute__((aligned(64)));	//next position to send to
+	char *cells __attribute__((aligned(64)));
+	unsigned long mask;
+	size_t elemsize, stride;
+	volatile int closed;
+	volatile int sendseq, recvseq;				//futexes on which blocked senders and receivers sleep
+	volatile int sendwaiters, recvwaiters;		//number of threads sleeping on them
+	mythread_spinlock_t selectlock;				//lock of selecters
+	struct mythread_chan_case *volatile selecters;	//cases of blocked selects which wait for this channel
+} mythread_chan_t;
+
+/* a case of mythread_chan_select, elem is sent to ch or received from it
+ * depending on op, status is set to 0 or EPIPE when the case is chosen
+ * a case with ch NULL is never chosen
+ * next and waiter are used by the library while the select is blocked
+ */
+typedef struct mythread_chan_case {
+	mythread_chan_t *ch;
+	int op;
+	void *elem;
+	int status;
+	struct mythread_chan_case *next;	//next case in the selecters of ch
+	void *waiter;						//futex of the blocked select
+} mythread_chan_case_t;
+
+/* a task of the fork-join runtime, it is filled by mythread_task_spawn
+ * and done is set when fun has returned
+ */
+typedef struct mythread_task {
+	void (*fun)(void *);
+	void *args;
+	volatile int done;
+} mythread_task_t;
+
+/* a worker of the task runtime, top and bottom are the ends of the deque
+ * of its tasks (kept on different cache lines as thieves write top and
+ * the owner writes bottom)
+ */
+struct mythread_task_worker {
+	long top __attribute__((aligned(64)));
+	long bottom __attribute__((aligned(64)));
+	unsigned int seed;						//seed for choosing a random victim while stealing
+	int id;
+	mythread_task_t *tasks[MYTHREAD_TASK_DEQUE];
+};
+
+/* counters of one thread, returned by mythread_stats
+ * run_ns is the time the thread has run and wait_ns the time it was
+ * runnable while other threads ran, switches counts the times it was
+ * switched out and preempted those of them forced by the kernel (the
+ * others were voluntary: it yielded or slept), these four are read from
+ * the kernel (/proc/self/task) and are 0 once the thread has exited
+ * lock_ns is the time it waited for mutexes and spinlocks and signals
+ * counts the signals sent to it with mythread_kill
+ */
+struct mythread_thread_stats {
+	mythread_t id;
+	int state;
+	unsigned long run_ns, wait_ns, lock_ns;
+	unsigned long switches, preempted;
+	unsigned long signals;
+};
+
+/* counters of the whole process, returned by mythread_sched_stats
+ * switches and preemptions are the sums over the threads which have not
+ * exited, threads and runnable are the numbers of those threads and of
+ * those which are running or ready to run, idle_ns is always 0 as idle
+ * cpus belong to the kernel
+ */
+struct mythread_sched_stats {
+	unsigned long switches, preemptions;
+	unsigned long created, exited;
+	unsigned long idle_ns;
+	int threads, runnable;
+};
+
+/* a set of cpus, cpu i is bit i % 64 of mask[i / 64], it has the layout
+ * of cpu_set_t so a cpu_set_t can be passed by a cast
+ */
+typedef struct mythread_cpuset {
+	unsigned long mask[MYTHREAD_CPU_SETSIZE / 64];
+} mythread_cpuset_t;
+
+#define MYTHREAD_CPU_SET(cpu, set) ((set)->mask[(cpu) / 64] |= 1UL << ((cpu) % 64))
+#define MYTHREAD_CPU_ISSET(cpu, set) (((set)->mask[(cpu) / 64] >> ((cpu) % 64)) & 1)
+
+/* attributes of a new thread, initialise them with mythread_attr_init
+ * if hascpus is set the thread runs only on the cpus in cpus, if node is
+ * not -1 its stack and structure are allocated on that numa node and,
+ * unless cpus are given, it runs on the cpus of that node
+ * a detached thread can not be joined, it is released when it exits
+ */
+typedef struct mythread_attr {
+	mythread_cpuset_t cpus;
+	int hascpus;
+	int node;
+	int detached;
+} mythread_attr_t;
 
 /* a structure which will store information about one thread
- * only
- * the information like thread id returned by clone, state of 
- * thread, the pid of the thread which called join on the thread
- * (used when join called and state of thread is THREAD_JOIN_CALLED),
- * the stack of the thread, root function from which the thread 
- * started, argument to the function and returned value is stored in 
- * the respective variables
+ * only, it is also the thread control block of the thread which is
+ * reachable through the thread pointer (self must stay the first member)
+ * the information like id of the thread, thread id set by clone (which is cleared by
+ * the kernel when the thread exits and is used as a futex by join),
+ * state of thread, the stack of the thread, root function from which
+ * the thread started, argument to the function and returned value is
+ * stored in the respective variables along with the values of thread
+ * specific data keys and the task runtime worker of the thread
+ * the placement of a thread created with attributes (numa node and cpus)
+ * is kept too, the thread sets its own affinity when it starts
  */
 struct mythread_struct {
-	int tid, state;
-	__pid_t jpid;
+	struct mythread_struct *self;
+	mythread_t id;
+	volatile int tid, state;
 	char *stack;
 	void *(*fun)(void *);
 	void *args;
 	void *returnval;
+	void *specific[MYTHREAD_KEYS_MAX];
+	struct mythread_task_worker *taskworker;	//worker of the task runtime run by this thread, if any
+	struct mythread_thread_stats stats;			//lock_ns and signals, the rest comes from the kernel
+	int node;									//numa node of the stack and structure, -1 if any
+	int hascpus;								//if set the thread runs only on cpus
+	mythread_cpuset_t cpus;
+	struct mythread_struct *reap;				//next exited detached thread waiting to be released
+};
+
+/* counters of the pool of stacks and thread structures, hits are
+ * allocations served from the pool and misses are those which needed
+ * malloc
+ */
+struct mythread_pool_stats {
+	unsigned long stack_hits, stack_misses;
+	unsigned long desc_hits, desc_misses;
+	int stacks, descs, cap;
+};
+
+/* a slot of the thread table, gen is increased every time the slot is
+ * freed and next links the free slots
+ */
+struct mythread_slot {
+	struct mythread_struct *thread;
+	volatile unsigned int gen;
+	int next;
+};
+
+/* a loop of mythread_parallel_for, shared by the parts which run it,
+ * next is the first iteration not given to any part yet
+ */
+struct mythread_for {
+	long begin, end, grain;
+	long next;
+	int schedule, nparts;
+	void (*fn)(long, long, void *);
+	void *ctx;
 };
 
 /* static functions are not included/declared in header
  */
 int __mythread_wrapper(void *mythread_struct_cur);
-struct mythread_struct *__mythread_fill(void *(*fun)(void *), void *args);
+struct mythread_struct *__mythread_fill(void *(*fun)(void *), void *args, int node);
 
 /* the information about various functions is written in mythread.c
  * file
@@ -67,13 +290,62 @@ struct mythread_struct *__mythread_fill(void *(*fun)(void *), void *args);
  */
 void mythread_init(void);
 int mythread_create(mythread_t *mythread, void *(*fun)(void *), void *args);
+int mythread_attr_init(mythread_attr_t *attr);
+int mythread_attr_setaffinity(mythread_attr_t *attr, const mythread_cpuset_t *cpus);
+int mythread_attr_setnode(mythread_attr_t *attr, int node);
+int mythread_attr_setcore(mythread_attr_t *attr, int core);
+int mythread_attr_setdetached(mythread_attr_t *attr, int detached);
+int mythread_create_attr(mythread_t *mythread, const mythread_attr_t *attr, void *(*fun)(void *), void *args);
+int mythread_setaffinity(mythread_t mythread, const mythread_cpuset_t *cpus);
+int mythread_getaffinity(mythread_t mythread, mythread_cpuset_t *cpus);
 int mythread_join(mythread_t mythread, void **returnval);
+int mythread_detach(mythread_t mythread);
 int mythread_kill(mythread_t mythread, int sig);
 void mythread_exit(void *returnval);
 mythread_t mythread_self(void);
+int mythread_yield(void);
+int mythread_pool_setcap(int cap);
+void mythread_pool_getstats(struct mythread_pool_stats *stats);
+int mythread_stats(mythread_t mythread, struct mythread_thread_stats *stats);
+void mythread_sched_stats(struct mythread_sched_stats *stats);
+int mythread_stats_export(const char *path, long interval_ms);
+int mythread_key_create(mythread_key_t *key, void (*destructor)(void *));
+int mythread_key_delete(mythread_key_t key);
+void *mythread_getspecific(mythread_key_t key);
+int mythread_setspecific(mythread_key_t key, const void *value);
+int mythread_mutex_init(mythread_mutex_t *m);
+int mythread_mutex_destroy(mythread_mutex_t *m);
+int mythread_mutex_lock(mythread_mutex_t *m);
+int mythread_mutex_trylock(mythread_mutex_t *m);
+int mythread_mutex_timedlock(mythread_mutex_t *m, const struct timespec *abstime);
+int mythread_mutex_unlock(mythread_mutex_t *m);
+int mythread_cond_init(mythread_cond_t *c);
+int mythread_cond_destroy(mythread_cond_t *c);
+int mythread_cond_wait(mythread_cond_t *c, mythread_mutex_t *m);
+int mythread_cond_timedwait(mythread_cond_t *c, mythread_mutex_t *m, const struct timespec *abstime);
+int mythread_cond_signal(mythread_cond_t *c);
+int mythread_cond_broadcast(mythread_cond_t *c);
+int mythread_chan_init(mythread_chan_t *ch, size_t elemsize, unsigned int cap);
+int mythread_chan_destroy(mythread_chan_t *ch);
+int mythread_chan_send(mythread_chan_t *ch, const void *elem);
+int mythread_chan_recv(mythread_chan_t *ch, void *elem);
+int mythread_chan_try_send(mythread_chan_t *ch, const void *elem);
+int mythread_chan_try_recv(mythread_chan_t *ch, void *elem);
+int mythread_chan_close(mythread_chan_t *ch);
+int mythread_chan_select(mythread_chan_case_t *cases, int n, int block);
+int mythread_task_init(int nworkers);
+void mythread_task_run(void (*fun)(void *), void *args);
+void mythread_task_spawn(mythread_task_t *task, void (*fun)(void *), void *args);
+void mythread_task_sync(mythread_task_t *task);
+int mythread_parallel_for(long begin, long end, long grain, void (*fn)(long, long, void *), void *ctx);
+int mythread_parallel_for_sched(long begin, long end, long grain, int schedule, void (*fn)(long, long, void *), void *ctx);
 int mythread_spin_init(mythread_spinlock_t *lock);
 int mythread_spin_lock(mythread_spinlock_t *lock);
 int mythread_spin_unlock(mythread_spinlock_t *lock);
 int mythread_spin_trylock(mythread_spinlock_t *lock);
+int mythread_mcs_init(mythread_mcslock_t *lock);
+int mythread_mcs_lock(mythread_mcslock_t *lock, mythread_mcsnode_t *node);
+int mythread_mcs_unlock(mythread_mcslock_t *lock, mythread_mcsnode_t *node);
+int mythread_mcs_trylock(mythread_mcslock_t *lock, mythread_mcsnode_t *node);
 
 #endif
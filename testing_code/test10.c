@@ -0,0 +1,118 @@
+/*
+ * this testing code tests the timed waits of many-one threads
+ * mythread_sleep_ns must never wake a thread before its deadline, each
+ * sleep is measured with CLOCK_MONOTONIC
+ * mythread_join_timed of a thread which sleeps longer than the timeout
+ * returns ETIMEDOUT, after that a join with a longer timeout succeeds and
+ * gets the value of the thread
+ * mythread_mutex_timedlock of a mutex which main keeps locked returns
+ * ETIMEDOUT not before its deadline, and one with a later deadline gets
+ * the mutex when main unlocks it
+ * finally SLEEPERS threads sleep on the timer wheel while a counter
+ * thread does a fixed amount of work, which must not take much longer
+ * than the same work did alone, and every sleeper must wake after its
+ * own deadline
+ */
+
+#include <stdio.h>
+#include <time.h>
+#include <errno.h>
+#include "mythread.h"
+
+#define SLEEPERS 1000
+#define WORK 200000000L
+
+mythread_mutex_t lock = MYTHREAD_MUTEX_INITIALIZER;
+int early = 0;
+
+unsigned long now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+/* abstime of CLOCK_REALTIME ms milliseconds from now, for timedlock
+ */
+struct timespec after_ms(long ms) {
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_nsec += (ms % 1000) * 1000000L;
+	ts.tv_sec += ms / 1000 + ts.tv_nsec / 1000000000L;
+	ts.tv_nsec %= 1000000000L;
+	return ts;
+}
+
+void *sleeper(void *arg) {
+	unsigned long ns = (unsigned long)arg, start = now_ns();
+	mythread_sleep_ns(ns);
+	if(now_ns() - start < ns)
+		early++;
+	return (void *)42L;
+}
+
+void *locker(void *arg) {
+	struct timespec abstime = after_ms((long)arg);
+	unsigned long start = now_ns();
+	int status = mythread_mutex_timedlock(&lock, &abstime);
+	if(status == ETIMEDOUT && now_ns() - start < (unsigned long)(long)arg * 1000000UL)
+		early++;
+	if(!status)
+		mythread_mutex_unlock(&lock);
+	return (void *)(long)status;
+}
+
+void *counter(void *arg) {
+	volatile long i;
+	for(i = 0; i < WORK; i++);
+	return NULL;
+}
+
+/* runs the counter thread and returns the time it took in nanoseconds
+ */
+unsigned long count_time(void) {
+	mythread_t t;
+	unsigned long start = now_ns();
+	mythread_create(&t, counter, NULL);
+	mythread_join(t, NULL);
+	return now_ns() - start;
+}
+
+int main() {
+	mythread_t t, sleepers[SLEEPERS];
+	unsigned long ns[] = {1000000, 5000000, 20000000, 300000000}, start, alone, crowded;
+	void *val = NULL;
+	int i, status;
+	mythread_init();
+
+	for(i = 0; i < 4; i++) {
+		start = now_ns();
+		mythread_sleep_ns(ns[i]);
+		printf("sleep of %lu ms took %s\n", ns[i] / 1000000, now_ns() - start >= ns[i] ? "at least that long, expected at least that long" : "less, expected at least that long");
+	}
+
+	mythread_create(&t, sleeper, (void *)200000000UL);
+	status = mythread_join_timed(t, &val, 20000000UL);
+	printf("join with a timeout of 20 ms returned %s, expected ETIMEDOUT\n", status == ETIMEDOUT ? "ETIMEDOUT" : "something else");
+	status = mythread_join_timed(t, &val, 1000000000UL);
+	printf("join with a timeout of 1 s returned %d with value %ld, expected 0 and 42\n", status, (long)val);
+
+	mythread_mutex_lock(&lock);
+	mythread_create(&t, locker, (void *)30L);
+	mythread_join(t, &val);
+	printf("timedlock of a held mutex returned %s, expected ETIMEDOUT\n", (long)val == ETIMEDOUT ? "ETIMEDOUT" : "something else");
+	mythread_create(&t, locker, (void *)1000L);
+	mythread_sleep_ns(20000000UL);
+	mythread_mutex_unlock(&lock);
+	mythread_join(t, &val);
+	printf("timedlock of a mutex unlocked after 20 ms returned %ld, expected 0\n", (long)val);
+
+	alone = count_time();
+	for(i = 0; i < SLEEPERS; i++)
+		mythread_create(&sleepers[i], sleeper, (void *)(100000000UL + i * 100000UL));
+	crowded = count_time();
+	for(i = 0; i < SLEEPERS; i++)
+		mythread_join(sleepers[i], NULL);
+	printf("work took %.2f times as long with %d sleepers, expected less than 1.5\n", (double)crowded / alone, SLEEPERS);
+	printf("%d threads woke before their deadline, expected 0\n", early);
+	return 0;
+}
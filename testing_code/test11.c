@@ -0,0 +1,98 @@
+/*
+ * this testing code tests detached threads (one-one, many-one and
+ * many-many)
+ * a running thread is detached, after that it can neither be detached
+ * again nor joined, a thread which has already exited is detached and its
+ * id is not valid any more, and a thread created detached can not be
+ * joined or detached either
+ * then ROUNDS batches of BATCH threads are created detached (half of them
+ * at creation and half with mythread_detach) and main waits until they
+ * have finished, their stacks and structures go back to the pool when
+ * they exit, so after the first batch the new threads should be served
+ * from the pool and the pool never holds more than its cap
+ * the threads touch only shared counters (no libc), as one-one threads
+ * share the libc state of the process
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include "mythread.h"
+
+#define BATCH 32
+#define ROUNDS 10
+
+volatile int go = 0, finished = 0;
+
+void *waiter(void *arg) {
+	while(!go)
+		mythread_yield();
+	__sync_fetch_and_add(&finished, 1);
+	return NULL;
+}
+
+void *quick(void *arg) {
+	__sync_fetch_and_add(&finished, 1);
+	return NULL;
+}
+
+/* waits until n threads have finished and gives them some more time to
+ * leave their stacks
+ */
+void wait_finished(int n) {
+	int i;
+	while(finished < n)
+		mythread_yield();
+	for(i = 0; i < 100; i++)
+		mythread_yield();
+}
+
+const char *name(int status) {
+	return status == 0 ? "0" : status == EINVAL ? "EINVAL" : status == ESRCH ? "ESRCH" : "something else";
+}
+
+int main() {
+	mythread_t t;
+	mythread_attr_t attr;
+	struct mythread_pool_stats before, after;
+	int i, j, cap, n = 0;
+	mythread_init();
+
+	mythread_create(&t, waiter, NULL);
+	printf("detach of a running thread returned %s, expected 0\n", name(mythread_detach(t)));
+	printf("second detach returned %s, expected EINVAL\n", name(mythread_detach(t)));
+	printf("join of a detached thread returned %s, expected EINVAL\n", name(mythread_join(t, NULL)));
+	go = 1;
+	wait_finished(++n);
+
+	mythread_create(&t, quick, NULL);
+	wait_finished(++n);
+	printf("detach of an exited thread returned %s, expected 0\n", name(mythread_detach(t)));
+	printf("join after it returned %s, expected ESRCH\n", name(mythread_join(t, NULL)));
+
+	mythread_attr_init(&attr);
+	mythread_attr_setdetached(&attr, 1);
+	go = 0;
+	mythread_create_attr(&t, &attr, waiter, NULL);
+	printf("join of a thread created detached returned %s, expected EINVAL\n", name(mythread_join(t, NULL)));
+	printf("detach of it returned %s, expected EINVAL\n", name(mythread_detach(t)));
+	go = 1;
+	wait_finished(++n);
+
+	cap = mythread_pool_setcap(BATCH);
+	mythread_pool_getstats(&before);
+	for(i = 0; i < ROUNDS; i++) {
+		for(j = 0; j < BATCH; j++) {
+			if(j % 2)
+				mythread_create_attr(&t, &attr, quick, NULL);
+			else if(!mythread_create(&t, quick, NULL))
+				mythread_detach(t);
+		}
+		wait_finished(n += BATCH);
+	}
+	mythread_pool_getstats(&after);
+	printf("%lu of %d stacks came from the pool, expected at least %d\n", after.stack_hits - before.stack_hits, ROUNDS * BATCH, (ROUNDS - 1) * BATCH / 2);
+	printf("%lu of %d structures came from the pool, expected at least %d\n", after.desc_hits - before.desc_hits, ROUNDS * BATCH, (ROUNDS - 1) * BATCH / 2);
+	printf("the pool holds %d stacks with a cap of %d, expected at most %d\n", after.stacks, after.cap, BATCH);
+	mythread_pool_setcap(cap);
+	return 0;
+}
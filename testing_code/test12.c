@@ -0,0 +1,99 @@
+/*
+ * this testing code tests the thread table and the pool of stacks (one-one,
+ * many-one and many-many)
+ * COUNT threads, more than the 256 of the old fixed table, are alive at
+ * the same time and each returns its index, main joins all of them and
+ * checks the sum of the returned values
+ * then a joined thread's slot is reused by a new thread, the new id has
+ * the same slot but another generation, so the old id is stale and join
+ * and detach of it return ESRCH while the new thread is joined normally
+ * finally the pool is limited to CAP stacks with mythread_pool_setcap,
+ * threads created and joined one after the other get their stacks and
+ * structures from the pool (hits), and with a cap of 0 every thread
+ * allocates new ones (misses)
+ * the threads touch only shared variables (no libc), as one-one threads
+ * share the libc state of the process
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include "mythread.h"
+
+#define COUNT 300
+#define CAP 8
+#define SERIAL 20
+
+volatile int go = 0;
+
+void *indexed(void *arg) {
+	while(!go)
+		mythread_yield();
+	return arg;
+}
+
+void *quick(void *arg) {
+	return arg;
+}
+
+const char *name(int status) {
+	return status == 0 ? "0" : status == ESRCH ? "ESRCH" : status == EINVAL ? "EINVAL" : "something else";
+}
+
+/* creates and joins n threads one after the other and stores how many of
+ * their stacks came from the pool in hits and how many did not in misses
+ */
+void serial(int n, unsigned long *hits, unsigned long *misses) {
+	struct mythread_pool_stats before, after;
+	mythread_t t;
+	int i;
+	mythread_pool_getstats(&before);
+	for(i = 0; i < n; i++) {
+		mythread_create(&t, quick, NULL);
+		mythread_join(t, NULL);
+	}
+	mythread_pool_getstats(&after);
+	*hits = after.stack_hits - before.stack_hits;
+	*misses = after.stack_misses - before.stack_misses;
+}
+
+int main() {
+	mythread_t threads[COUNT], old, new;
+	struct mythread_pool_stats stats;
+	unsigned long hits, misses;
+	long sum = 0, created = 0, i;
+	void *val;
+	int cap, status;
+	mythread_init();
+
+	for(i = 0; i < COUNT; i++)
+		if(!mythread_create(&threads[i], indexed, (void *)i))
+			created++;
+	go = 1;
+	for(i = 0; i < COUNT; i++)
+		if(!mythread_join(threads[i], &val))
+			sum += (long)val;
+	printf("%ld threads created, expected %d\n", created, COUNT);
+	printf("sum of their values %ld, expected %d\n", sum, COUNT * (COUNT - 1) / 2);
+
+	mythread_create(&old, quick, NULL);
+	mythread_join(old, NULL);
+	mythread_create(&new, quick, (void *)5L);
+	printf("new thread %s the slot of the joined one, expected reuses\n", (old & 0xffffffffUL) == (new & 0xffffffffUL) && old != new ? "reuses" : "does not reuse");
+	printf("join of the stale id returned %s, expected ESRCH\n", name(mythread_join(old, NULL)));
+	printf("detach of the stale id returned %s, expected ESRCH\n", name(mythread_detach(old)));
+	val = NULL;
+	status = mythread_join(new, &val);
+	printf("join of the new id returned %s with value %ld, expected 0 and 5\n", name(status), (long)val);
+
+	cap = mythread_pool_setcap(CAP);
+	mythread_pool_getstats(&stats);
+	printf("setcap returned the old cap %d, expected %d\n", cap, MYTHREAD_POOL_CAP);
+	printf("the pool holds %d stacks and %d structures, expected at most %d\n", stats.stacks, stats.descs, CAP);
+	serial(SERIAL, &hits, &misses);
+	printf("%lu hits and %lu misses for %d threads with a cap of %d, expected at least %d hits\n", hits, misses, SERIAL, CAP, SERIAL - 1);
+	mythread_pool_setcap(0);
+	serial(SERIAL, &hits, &misses);
+	printf("%lu hits and %lu misses for %d threads with a cap of 0, expected 0 and %d\n", hits, misses, SERIAL, SERIAL);
+	mythread_pool_setcap(cap);
+	return 0;
+}
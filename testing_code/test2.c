@@ -1,12 +1,15 @@
 /*
  * this is a testing program which calculates the multiplication
- * of two matrices by creating 3 threads which calculate the multiplication
- * by dividing rows in between them
+ * of two matrices with mythread_parallel_for, the rows of the answer
+ * are the iterations of the loop and are shared by all cores
+ * the schedule can be given as an argument: static, dynamic (default)
+ * or guided, followed by the grain (number of rows in a chunk)
  * use the mat.txt, bigmat.txt verybigmat.txt files for bigger matrix inputs
  */
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "mythread.h"
 
 struct matrix {
@@ -14,14 +17,12 @@ struct matrix {
 	int r, c;
 };
 
-struct partinfo {
+struct multinfo {
 	struct matrix *m1, *m2, *ans;
-	int start;
-	int end;
 };
 
 struct matrix readmat(void);
-void *partialmult(void *args);
+void partialmult(long start, long end, void *args);
 void printmatrix(struct matrix m);
 void destroymat(struct matrix *m);
 
@@ -43,16 +44,16 @@ void destroymat(struct matrix *m) {
 	free(m->mat);
 }
 
-void *partialmult(void *args) {
-	struct matrix *m1 = ((struct partinfo *)args)->m1, *m2 = ((struct partinfo *)args)->m2, *m3 = ((struct partinfo *)args)->ans;
-	for(int i = ((struct partinfo *)args)->start; i < ((struct partinfo *)args)->end; i++) 
+/* calculates the rows start to end - 1 of the answer
+ */
+void partialmult(long start, long end, void *args) {
+	struct matrix *m1 = ((struct multinfo *)args)->m1, *m2 = ((struct multinfo *)args)->m2, *m3 = ((struct multinfo *)args)->ans;
+	for(long i = start; i < end; i++) 
 		for(int j = 0; j < m2->c; j++) {
 			m3->mat[i][j] = 0;
 			for(int k = 0; k < m1->c; k++)
 				m3->mat[i][j] += (m1->mat[i][k] * m2->mat[k][j]);
 		}
-	mythread_exit(NULL);
-	return NULL;
 }
 
 void printmatrix(struct matrix m) {
@@ -64,11 +65,17 @@ void printmatrix(struct matrix m) {
 	}
 }
 
-int main() {
-	int t;
-	mythread_t pt1, pt2, pt3;
+int main(int argc, char *argv[]) {
+	int schedule = MYTHREAD_FOR_DYNAMIC;
+	long grain = 1;
 	struct matrix mat1, mat2, ansmat;
-	struct partinfo arg1, arg2, arg3;
+	struct multinfo arg;
+	if(argc > 1 && !strcmp(argv[1], "static"))
+		schedule = MYTHREAD_FOR_STATIC;
+	if(argc > 1 && !strcmp(argv[1], "guided"))
+		schedule = MYTHREAD_FOR_GUIDED;
+	if(argc > 2)
+		grain = atol(argv[2]);
 	mythread_init();
 	mat1 = readmat();
 	mat2 = readmat();
@@ -81,28 +88,10 @@ int main() {
 	ansmat.mat = (int **)malloc(sizeof(int *) * mat1.r);
 	for(int i = 0; i < mat1.r; i++)
 		ansmat.mat[i] = (int *)malloc(sizeof(int) * mat2.c);
-	t = mat1.r / 3;
-	arg1.m1 = &mat1;
-	arg1.m2 = &mat2;
-	arg1.ans = &ansmat;
-	arg1.start = 0;
-	arg1.end = t;
-	mythread_create(&pt1, partialmult, &arg1);
-	arg2.m1 = &mat1;
-	arg2.m2 = &mat2;
-	arg2.ans = &ansmat;
-	arg2.start = t;
-	arg2.end = 2 * t;
-	mythread_create(&pt2, partialmult, &arg2);
-	arg3.m1 = &mat1;
-	arg3.m2 = &mat2;
-	arg3.ans = &ansmat;
-	arg3.start = 2 * t;
-	arg3.end = 3 * t + mat1.r % 3;
-	mythread_create(&pt3, partialmult, &arg3);
-	mythread_join(pt1, NULL);
-	mythread_join(pt2, NULL);
-	mythread_join(pt3, NULL);
+	arg.m1 = &mat1;
+	arg.m2 = &mat2;
+	arg.ans = &ansmat;
+	mythread_parallel_for_sched(0, mat1.r, grain, schedule, partialmult, &arg);
 	printmatrix(ansmat);
 	destroymat(&mat1);
 	destroymat(&mat2);
@@ -0,0 +1,121 @@
+/*
+ * this testing code tests the netpoller of many-one threads
+ * (mythread_read, mythread_write, mythread_accept, mythread_connect)
+ * it creates NPAIRS socketpairs with an echo thread on one end and a
+ * client thread on the other end, the client sends ROUNDS messages and
+ * checks that each one comes back
+ * a loopback tcp server is also started which accepts one connection
+ * from a client thread and echoes a message
+ * a thread which only counts in a loop runs all the time, if the program
+ * finishes and prints the echoed messages, a thread blocked in read did
+ * not block the other threads
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include "mythread.h"
+
+#define NPAIRS 500
+#define ROUNDS 20
+
+int fds[NPAIRS][2];
+volatile int done = 0;
+struct sockaddr_in server_addr;
+
+void *echo(void *arg) {
+	int fd = *(int *)arg;
+	char buf[64];
+	ssize_t n;
+	while((n = mythread_read(fd, buf, sizeof(buf))) > 0)
+		mythread_write(fd, buf, n);
+	mythread_close(fd);
+	return NULL;
+}
+
+void *client(void *arg) {
+	int fd = *(int *)arg, i;
+	long errors = 0;
+	char msg[64], buf[64];
+	for(i = 0; i < ROUNDS; i++) {
+		sprintf(msg, "message %d", i);
+		mythread_write(fd, msg, strlen(msg) + 1);
+		if(mythread_read(fd, buf, sizeof(buf)) != (ssize_t)strlen(msg) + 1 || strcmp(msg, buf))
+			errors++;
+	}
+	mythread_close(fd);
+	return (void *)errors;
+}
+
+void *counter(void *arg) {
+	long count = 0;
+	while(!done)
+		count++;
+	return (void *)count;
+}
+
+void *tcp_server(void *arg) {
+	int lfd = *(int *)arg, fd;
+	char buf[64];
+	ssize_t n;
+	fd = mythread_accept(lfd, NULL, NULL);
+	if((n = mythread_read(fd, buf, sizeof(buf))) > 0)
+		mythread_write(fd, buf, n);
+	mythread_close(fd);
+	mythread_close(lfd);
+	return NULL;
+}
+
+void *tcp_client(void *arg) {
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	char buf[64] = "";
+	if(mythread_connect(fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) == -1) {
+		perror("connect");
+		return NULL;
+	}
+	mythread_write(fd, "hello over tcp", 15);
+	mythread_read(fd, buf, sizeof(buf));
+	printf("tcp echo: %s\n", buf);
+	mythread_close(fd);
+	return NULL;
+}
+
+int main() {
+	mythread_t echoes[NPAIRS], clients[NPAIRS], count, server, tcp;
+	socklen_t len = sizeof(server_addr);
+	long errors = 0;
+	void *ret;
+	int i, lfd;
+	mythread_init();
+	mythread_create(&count, counter, NULL);
+	for(i = 0; i < NPAIRS; i++) {
+		socketpair(AF_UNIX, SOCK_STREAM, 0, fds[i]);
+		mythread_create(&echoes[i], echo, &fds[i][0]);
+		mythread_create(&clients[i], client, &fds[i][1]);
+	}
+	lfd = socket(AF_INET, SOCK_STREAM, 0);
+	memset(&server_addr, 0, sizeof(server_addr));
+	server_addr.sin_family = AF_INET;
+	server_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	bind(lfd, (struct sockaddr *)&server_addr, sizeof(server_addr));
+	getsockname(lfd, (struct sockaddr *)&server_addr, &len);
+	listen(lfd, 16);
+	mythread_create(&server, tcp_server, &lfd);
+	mythread_create(&tcp, tcp_client, NULL);
+	for(i = 0; i < NPAIRS; i++) {
+		mythread_join(clients[i], &ret);
+		errors += (long)ret;
+		mythread_join(echoes[i], NULL);
+	}
+	mythread_join(server, NULL);
+	mythread_join(tcp, NULL);
+	done = 1;
+	mythread_join(count, &ret);
+	printf("%d pairs, %d messages each, %ld errors\n", NPAIRS, ROUNDS, errors);
+	printf("counter thread counted to %ld meanwhile\n", (long)ret);
+	return 0;
+}
@@ -0,0 +1,67 @@
+/*
+ * this testing code tests the fork-join task runtime of one-one threads
+ * (mythread_task_run, mythread_task_spawn, mythread_task_sync)
+ * it computes fibonacci numbers by spawning a task for every call of
+ * fib(n - 1) above a small cutoff and compares the result and the time
+ * with a plain recursive function, the number of tasks is printed so that
+ * the cost of one task can be seen
+ * an optional argument gives n (default 36)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "mythread.h"
+
+#define CUTOFF 12
+
+struct fibargs {
+	int n;
+	long result;
+};
+
+long tasks = 0;
+
+long fib_serial(int n) {
+	return n < 2 ? n : fib_serial(n - 1) + fib_serial(n - 2);
+}
+
+void fib_task(void *arg) {
+	struct fibargs *a = (struct fibargs *)arg, a1, a2;
+	mythread_task_t t;
+	if(a->n < CUTOFF) {
+		a->result = fib_serial(a->n);
+		return;
+	}
+	a1.n = a->n - 1;
+	a2.n = a->n - 2;
+	__sync_fetch_and_add(&tasks, 1);
+	mythread_task_spawn(&t, fib_task, &a1);
+	fib_task(&a2);
+	mythread_task_sync(&t);
+	a->result = a1.result + a2.result;
+}
+
+double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[]) {
+	struct fibargs a;
+	double t;
+	long expected;
+	mythread_init();
+	a.n = argc > 1 ? atoi(argv[1]) : 36;
+	printf("%d workers\n", mythread_task_init(0));
+	t = now();
+	expected = fib_serial(a.n);
+	printf("serial:   fib(%d) = %ld in %.3f s\n", a.n, expected, now() - t);
+	t = now();
+	mythread_task_run(fib_task, &a);
+	t = now() - t;
+	printf("parallel: fib(%d) = %ld in %.3f s, %ld tasks\n", a.n, a.result, t, tasks);
+	printf(a.result == expected ? "results match\n" : "results DO NOT match\n");
+	return 0;
+}
@@ -0,0 +1,98 @@
+/*
+ * this testing code tests the blocking mutexes and condition variables
+ * (one-one and many-one)
+ * PRODUCERS threads put ITEMS numbers each in a small bounded buffer and
+ * CONSUMERS threads take them out, the buffer is guarded by a mutex and
+ * the threads wait on two condition variables when it is full or empty
+ * the sum of the consumed numbers must be equal to the sum of produced ones
+ * at the end all threads wait on a condition variable which nobody
+ * signals while main waits half a second with mythread_cond_timedwait,
+ * as waiting threads are blocked the process should use almost no cpu
+ * time meanwhile
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <errno.h>
+#include "mythread.h"
+
+#define PRODUCERS 4
+#define CONSUMERS 4
+#define ITEMS 100000
+#define SIZE 8
+
+mythread_mutex_t lock = MYTHREAD_MUTEX_INITIALIZER;
+mythread_cond_t notfull = MYTHREAD_COND_INITIALIZER, notempty = MYTHREAD_COND_INITIALIZER, never = MYTHREAD_COND_INITIALIZER;
+long buffer[SIZE];
+int head = 0, count = 0, producing = PRODUCERS, quit = 0;
+
+void *producer(void *arg) {
+	for(long i = 1; i <= ITEMS; i++) {
+		mythread_mutex_lock(&lock);
+		while(count == SIZE)
+			mythread_cond_wait(&notfull, &lock);
+		buffer[(head + count++) % SIZE] = i;
+		mythread_cond_signal(&notempty);
+		mythread_mutex_unlock(&lock);
+	}
+	mythread_mutex_lock(&lock);
+	producing--;
+	mythread_cond_broadcast(&notempty);
+	mythread_mutex_unlock(&lock);
+	return NULL;
+}
+
+void *consumer(void *arg) {
+	long sum = 0;
+	mythread_mutex_lock(&lock);
+	while(1) {
+		while(count == 0 && producing)
+			mythread_cond_wait(&notempty, &lock);
+		if(count == 0)
+			break;
+		sum += buffer[head];
+		head = (head + 1) % SIZE;
+		count--;
+		mythread_cond_signal(&notfull);
+	}
+	while(!quit)
+		mythread_cond_wait(&never, &lock);
+	mythread_mutex_unlock(&lock);
+	return (void *)sum;
+}
+
+int main() {
+	mythread_t p[PRODUCERS], c[CONSUMERS];
+	struct timespec ts;
+	long sum = 0;
+	void *ret;
+	clock_t cpu;
+	int i, status;
+	mythread_init();
+	for(i = 0; i < CONSUMERS; i++)
+		mythread_create(&c[i], consumer, NULL);
+	for(i = 0; i < PRODUCERS; i++)
+		mythread_create(&p[i], producer, NULL);
+	for(i = 0; i < PRODUCERS; i++)
+		mythread_join(p[i], NULL);
+	cpu = clock();
+	mythread_mutex_lock(&lock);
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_nsec += 500000000;
+	if(ts.tv_nsec >= 1000000000) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000;
+	}
+	status = mythread_cond_timedwait(&never, &lock, &ts);
+	quit = 1;
+	mythread_cond_broadcast(&never);
+	mythread_mutex_unlock(&lock);
+	printf("timedwait returned %s, cpu time used while waiting: %.3f s\n", status == ETIMEDOUT ? "ETIMEDOUT" : "0", (double)(clock() - cpu) / CLOCKS_PER_SEC);
+	for(i = 0; i < CONSUMERS; i++) {
+		mythread_join(c[i], &ret);
+		sum += (long)ret;
+	}
+	printf("consumed sum %ld, expected %ld\n", sum, (long)PRODUCERS * ITEMS * (ITEMS + 1) / 2);
+	return 0;
+}
@@ -0,0 +1,99 @@
+/*
+ * this testing code tests the channels (one-one and many-one)
+ * PRODUCERS threads send ITEMS numbers each on the channel jobs, WORKERS
+ * threads receive them and send the square of even numbers on the
+ * channel evens and of odd numbers on the channel odds
+ * main selects over evens and odds until both are closed (a closed
+ * channel is taken out of the select by setting its case to NULL), the
+ * sums must be equal to the ones computed directly
+ * finally a full channel is tried without blocking
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include "mythread.h"
+
+#define PRODUCERS 4
+#define WORKERS 4
+#define ITEMS 50000
+#define CAP 16
+
+mythread_chan_t jobs, evens, odds;
+
+void *producer(void *arg) {
+	long i;
+	for(i = 1; i <= ITEMS; i++)
+		mythread_chan_send(&jobs, &i);
+	return NULL;
+}
+
+void *worker(void *arg) {
+	long i, sq;
+	while(mythread_chan_recv(&jobs, &i) == 0) {
+		sq = i * i;
+		mythread_chan_send(i % 2 ? &odds : &evens, &sq);
+	}
+	return NULL;
+}
+
+/* closes jobs when all producers have finished and the result channels
+ * when all workers have finished
+ */
+void *closer(void *arg) {
+	mythread_t *threads = (mythread_t *)arg;
+	int i;
+	for(i = 0; i < PRODUCERS; i++)
+		mythread_join(threads[i], NULL);
+	mythread_chan_close(&jobs);
+	for(i = PRODUCERS; i < PRODUCERS + WORKERS; i++)
+		mythread_join(threads[i], NULL);
+	mythread_chan_close(&evens);
+	mythread_chan_close(&odds);
+	return NULL;
+}
+
+int main() {
+	mythread_t threads[PRODUCERS + WORKERS], c;
+	mythread_chan_case_t cases[2];
+	long sq, sum[2] = {0, 0}, expected[2] = {0, 0}, n = 0, i;
+	int open = 2, k;
+	mythread_init();
+	mythread_chan_init(&jobs, sizeof(long), CAP);
+	mythread_chan_init(&evens, sizeof(long), CAP);
+	mythread_chan_init(&odds, sizeof(long), CAP);
+	for(i = 0; i < PRODUCERS; i++)
+		mythread_create(&threads[i], producer, NULL);
+	for(i = PRODUCERS; i < PRODUCERS + WORKERS; i++)
+		mythread_create(&threads[i], worker, NULL);
+	mythread_create(&c, closer, threads);
+	cases[0] = (mythread_chan_case_t){&evens, MYTHREAD_CHAN_RECV, &sq, 0};
+	cases[1] = (mythread_chan_case_t){&odds, MYTHREAD_CHAN_RECV, &sq, 0};
+	while(open) {
+		k = mythread_chan_select(cases, 2, 1);
+		if(cases[k].status == EPIPE) {
+			cases[k].ch = NULL;
+			open--;
+			continue;
+		}
+		sum[k] += sq;
+		n++;
+	}
+	mythread_join(c, NULL);
+	for(i = 1; i <= ITEMS; i++)
+		expected[i % 2] += PRODUCERS * i * i;
+	printf("received %ld squares\n", n);
+	printf("even sum %ld, expected %ld\n", sum[0], expected[0]);
+	printf("odd sum %ld, expected %ld\n", sum[1], expected[1]);
+	mythread_chan_destroy(&jobs);
+	mythread_chan_destroy(&evens);
+	mythread_chan_destroy(&odds);
+
+	mythread_chan_init(&jobs, sizeof(long), 2);
+	for(i = 0; mythread_chan_try_send(&jobs, &i) == 0; i++);
+	printf("try_send filled a channel of 2 with %ld elements\n", i);
+	mythread_chan_close(&jobs);
+	for(i = 0; mythread_chan_try_recv(&jobs, &sq) == 0; i++);
+	printf("try_recv received %ld elements after close\n", i);
+	mythread_chan_destroy(&jobs);
+	return 0;
+}
@@ -0,0 +1,53 @@
+/*
+ * this testing code tests the joins of many-one threads
+ * a thread which joins itself must get EDEADLK at once instead of parking
+ * forever, after that it finishes normally and main can join it (main
+ * yields first so that the thread joins itself before anyone joins it)
+ * then CHAIN threads are created, each one joins the one created before it
+ * and returns the value it got plus one, so every joiner is parked in the
+ * thread it joins while main joins the last one, which must return CHAIN
+ * finally a collected thread can not be joined again (ESRCH)
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include "mythread.h"
+
+#define CHAIN 100
+
+int selfjoin;
+
+void *joinself(void *arg) {
+	selfjoin = mythread_join(mythread_self(), NULL);
+	return (void *)7L;
+}
+
+void *chainlink(void *arg) {
+	void *val = (void *)0L;
+	volatile long i;
+	if(arg)
+		mythread_join(*(mythread_t *)arg, &val);
+	for(i = 0; i < 100000; i++);
+	return (void *)((long)val + 1);
+}
+
+int main() {
+	mythread_t t, chain[CHAIN];
+	void *val = NULL;
+	int i, status;
+	mythread_init();
+	mythread_create(&t, joinself, NULL);
+	for(i = 0; i < 10 && !selfjoin; i++)
+		mythread_yield();
+	status = mythread_join_timed(t, &val, 1000000000UL);
+	printf("self join returned %s, expected EDEADLK\n", selfjoin == EDEADLK ? "EDEADLK" : "something else");
+	printf("join of the thread returned %d with value %ld, expected 0 and 7\n", status, (long)val);
+
+	for(i = 0; i < CHAIN; i++)
+		mythread_create(&chain[i], chainlink, i ? &chain[i - 1] : NULL);
+	mythread_join(chain[CHAIN - 1], &val);
+	printf("chain of %d joins returned %ld, expected %d\n", CHAIN, (long)val, CHAIN);
+	status = mythread_join(chain[CHAIN - 1], NULL);
+	printf("second join returned %s, expected ESRCH\n", status == ESRCH ? "ESRCH" : "something else");
+	return 0;
+}